@@ -6,8 +6,13 @@
 // Tianzheng Wang <tzwang@sfu.ca>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include "bztree.h"
 
@@ -19,16 +24,128 @@ pmwcas::PMDKAllocator *Allocator::allocator_ = nullptr;
 
 uint64_t global_epoch = 0;
 
-void InternalNode::New(bztree::InternalNode **mem, uint32_t alloc_size) {
-#ifdef  PMDK
+// Free callback for nodes and blobs, used by descriptors that allocate them
+// (to drop them if the PMwCAS fails) and by the tree's garbage list (to drop
+// replaced ones); [node] is a PMDK offset under PMDK
+static void FreeNode(void *, void *node) {
+  if (node == nullptr) {
+    return;
+  }
+#ifdef PMDK
+  Allocator::Get()->Free(Allocator::Get()->GetDirect(node));
+#else
+  pmwcas::Allocator::Get()->Free(node);
+#endif
+}
+
+#if ENABLE_STATS
+// Counters of the tree the calling thread is operating on, set for the
+// duration of each tree operation so that node code can count events too
+static thread_local Stats *thread_stats = nullptr;
+
+class StatsScope {
+ public:
+  explicit StatsScope(Stats *stats) : saved(thread_stats) { thread_stats = stats; }
+  ~StatsScope() { thread_stats = saved; }
+
+ private:
+  Stats *saved;
+};
+
+// STATS_SCOPE is used in BzTree members; STATS_INC outside of any scope (e.g.,
+// on nodes used without a tree) does nothing
+#define STATS_SCOPE() StatsScope stats_scope(GetThreadStats())
+#define STATS_INC(counter) \
+  do { if (thread_stats) { ++thread_stats->counter; } } while (0)
+#define STATS_ADD(counter, n) \
+  do { if (thread_stats) { thread_stats->counter += (n); } } while (0)
+#else
+#define STATS_SCOPE()
+#define STATS_INC(counter)
+#define STATS_ADD(counter, n)
+#endif
+
+Stats &Stats::operator+=(const Stats &other) {
+  // All counters are uint64_t
+  static_assert(sizeof(Stats) % sizeof(uint64_t) == 0, "unexpected Stats layout");
+  auto *counters = reinterpret_cast<uint64_t *>(this);
+  auto *other_counters = reinterpret_cast<const uint64_t *>(&other);
+  for (uint32_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); ++i) {
+    counters[i] += other_counters[i];
+  }
+  return *this;
+}
+
+// Hint to the CPU that this is a spin-wait loop
+static inline void CpuPause() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+void Backoff::Wait() {
+  if (max_pause == 0) {
+    return;
+  }
+  if (pause > max_pause) {
+    if (yield) {
+      STATS_INC(backoff_yields);
+      std::this_thread::yield();
+      return;
+    }
+    pause = max_pause;
+  }
+  for (uint32_t i = 0; i < pause; ++i) {
+    CpuPause();
+  }
+  STATS_ADD(backoff_pauses, pause);
+  pause *= 2;
+}
+
+// Allocate a PMwCAS descriptor, counting it
+static inline pmwcas::Descriptor *AllocateDescriptor(
+    pmwcas::DescriptorPool *pool, pmwcas::Descriptor::FreeCallback fc = nullptr) {
+  STATS_INC(descriptors);
+  return fc ? pool->AllocateDescriptor(fc) : pool->AllocateDescriptor();
+}
+
+void InternalNode::New(const std::vector<BuildRecord> &records, InternalNode **mem) {
+  // The keys are in order, so all of them start with the common prefix of the
+  // first and the last one
+  thread_local std::string first;
+  thread_local std::string last;
+  uint32_t prefix_size = 0;
+  if (records.size() > 1) {
+    first.resize(records[1].GetKeySize());
+    records[1].CopyKey(&first[0], 0, static_cast<uint32_t>(first.size()));
+    last.resize(records.back().GetKeySize());
+    records.back().CopyKey(&last[0], 0, static_cast<uint32_t>(last.size()));
+    prefix_size = ChoosePrefixSize(first.data(), static_cast<uint32_t>(first.size()),
+                                   last.data(), static_cast<uint32_t>(last.size()));
+  }
+
+  uint32_t alloc_size = sizeof(InternalNode) + RecordMetadata::PadKeyLength(prefix_size);
+  for (auto &record : records) {
+    uint32_t key_size = record.GetKeySize();
+    alloc_size += sizeof(RecordMetadata) + kKeyPrefixSize + sizeof(uint64_t) +
+        (key_size == 0 ? 0 : RecordMetadata::PadKeyLength(key_size - prefix_size));
+  }
+
+#ifdef PMDK
   Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
   memset(*mem, 0, alloc_size);
-  (*mem)->header.size = alloc_size;
+  new(*mem) InternalNode(alloc_size, records, first.data(), prefix_size);
+  pmwcas::NVRAM::Flush(alloc_size, *mem);
   *mem = Allocator::Get()->GetOffset(*mem);
 #else
   pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), alloc_size);
   memset(*mem, 0, alloc_size);
-  (*mem)->header.size = alloc_size;
+  new(*mem) InternalNode(alloc_size, records, first.data(), prefix_size);
+#ifdef PMEM
+  pmwcas::NVRAM::Flush(alloc_size, *mem);
+#endif  // PMEM
 #endif  // PMDK
 }
 
@@ -40,26 +157,8 @@ void InternalNode::New(InternalNode *src_node,
                        uint64_t left_child_addr,
                        uint64_t right_child_addr,
                        InternalNode **mem) {
-  uint32_t alloc_size = src_node->GetHeader()->size +
-      RecordMetadata::PadKeyLength(key_size) +
-      sizeof(right_child_addr) + sizeof(RecordMetadata);
-
-#ifdef  PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, src_node, 0, src_node->header.sorted_count,
-                         key, key_size, left_child_addr, right_child_addr);
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-  *mem = Allocator::Get()->GetOffset(*mem);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, src_node, 0, src_node->header.sorted_count,
-                         key, key_size, left_child_addr, right_child_addr);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-#endif  // PMEM
-#endif  // PMDK
+  New(src_node, 0, src_node->header.sorted_count, key, key_size,
+      left_child_addr, right_child_addr, mem, 0);
 }
 
 // Create an internal node with a single separator key and two pointers
@@ -68,25 +167,12 @@ void InternalNode::New(const char *key,
                        uint64_t left_child_addr,
                        uint64_t right_child_addr,
                        InternalNode **mem) {
-  uint32_t alloc_size = sizeof(InternalNode) +
-      RecordMetadata::PadKeyLength(key_size) +
-      sizeof(left_child_addr) +
-      sizeof(right_child_addr) +
-      sizeof(RecordMetadata) * 2;
-#ifdef PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, key, key_size, left_child_addr, right_child_addr);
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-  *mem = Allocator::Get()->GetOffset(*mem);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), alloc_size);
-  memset(*mem, 0, alloc_size);
-  new(*mem) InternalNode(alloc_size, key, key_size, left_child_addr, right_child_addr);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(alloc_size, *mem);
-#endif  // PMEM
-#endif  // PMDK
+  thread_local std::vector<BuildRecord> records;
+  records.clear();
+  records.push_back(BuildRecord{nullptr, 0, nullptr, 0, left_child_addr});
+  records.push_back(BuildRecord{nullptr, 0, key, static_cast<uint16_t>(key_size),
+                                right_child_addr});
+  New(records, mem);
 }
 
 // Create an internal node with keys and pointers in the provided range from an
@@ -97,180 +183,125 @@ void InternalNode::New(InternalNode *src_node,
                        uint64_t left_child_addr, uint64_t right_child_addr,
                        InternalNode **new_node,
                        uint64_t left_most_child_addr) {
-  // Figure out how large the new node will be
-  uint32_t alloc_size = sizeof(InternalNode);
-  if (begin_meta_idx > 0) {
-    // Will not copy from the first element (dummy key), so add it here
-    alloc_size += src_node->record_metadata[0].GetTotalLength();
-    alloc_size += sizeof(RecordMetadata);
-  }
-
+  ALWAYS_ASSERT(src_node);
   assert(nr_records > 0);
-  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
-    RecordMetadata meta = src_node->record_metadata[i];
-    alloc_size += meta.GetTotalLength();
-    alloc_size += sizeof(RecordMetadata);
-  }
+  thread_local std::vector<BuildRecord> records;
+  records.clear();
 
-  // Add the new key, if provided
+  // The new key, if provided, goes right after the record of the child it
+  // splits, which now points to [left_child_addr]
+  uint32_t split_idx = 0;
   if (key) {
     ALWAYS_ASSERT(key_size > 0);
-    alloc_size +=
-        (RecordMetadata::PadKeyLength(key_size) + sizeof(uint64_t) + sizeof(RecordMetadata));
+    split_idx = src_node->GetChildIndex(key, static_cast<uint16_t>(key_size));
   }
+  bool need_insert_new = key;
+  auto insert_new = [&]() {
+    records.back().child_addr = left_child_addr;
+    records.push_back(BuildRecord{nullptr, 0, key, static_cast<uint16_t>(key_size),
+                                  right_child_addr});
+    need_insert_new = false;
+  };
 
-#ifdef PMDK
-  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(new_node), alloc_size);
-  memset(*new_node, 0, alloc_size);
-  new(*new_node) InternalNode(alloc_size, src_node, begin_meta_idx, nr_records,
-                              key, key_size, left_child_addr, right_child_addr,
-                              left_most_child_addr);
-  pmwcas::NVRAM::Flush(alloc_size, new_node);
-  *new_node = Allocator::Get()->GetOffset(*new_node);
-#else
-  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(new_node), alloc_size);
-  memset(*new_node, 0, alloc_size);
-  new(*new_node) InternalNode(alloc_size, src_node, begin_meta_idx, nr_records,
-                              key, key_size, left_child_addr, right_child_addr,
-                              left_most_child_addr);
-#ifdef PMEM
-  pmwcas::NVRAM::Flush(alloc_size, *new_node);
-#endif  // PMEM
-#endif  // PMDK
+  // A new left-most child (i.e., this is the new node on the right) takes the
+  // place of the record before [begin_meta_idx]
+  if (left_most_child_addr) {
+    records.push_back(BuildRecord{nullptr, 0, nullptr, 0, left_most_child_addr});
+    if (need_insert_new && split_idx + 1 == begin_meta_idx) {
+      insert_new();
+    }
+  }
+  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
+    src_node->GetBuildRecords(i, i + 1, &records);
+    if (need_insert_new && split_idx == i) {
+      insert_new();
+    }
+  }
+  ALWAYS_ASSERT(!need_insert_new);
+  New(records, new_node);
 }
 
-InternalNode::InternalNode(uint32_t node_size,
-                           const char *key,
-                           const uint16_t key_size,
-                           uint64_t left_child_addr,
-                           uint64_t right_child_addr)
-    : BaseNode(false, node_size) {
-  // Initialize a new internal node with one key only
-  header.sorted_count = 2;  // Includes the null dummy key
-  header.size = node_size;
-
-  // Fill in left child address, with an empty key
-  uint64_t offset = node_size - sizeof(left_child_addr);
-  record_metadata[0].FinalizeForInsert(offset, 0, sizeof(left_child_addr));
-  char *ptr = reinterpret_cast<char *>(this) + offset;
-  memcpy(ptr, &left_child_addr, sizeof(left_child_addr));
-
-  // Fill in right child address, with the separator key
-  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
-  auto total_len = padded_key_size + sizeof(right_child_addr);
-  offset -= total_len;
-  record_metadata[1].FinalizeForInsert(offset, key_size, total_len);
-  ptr = reinterpret_cast<char *>(this) + offset;
-  memcpy(ptr, key, key_size);
-  memcpy(ptr + padded_key_size, &right_child_addr, sizeof(right_child_addr));
-
-  assert((uint64_t) ptr == (uint64_t) this + sizeof(*this) + 2 * sizeof(RecordMetadata));
+// Create an internal node pointing to the children in [begin_it, end_it), used
+// by bulk loading
+void InternalNode::New(std::vector<BulkLoadEntry>::iterator begin_it,
+                       std::vector<BulkLoadEntry>::iterator end_it,
+                       InternalNode **mem) {
+  // The first child has the null dummy key, the others are keyed by the
+  // largest key of their left sibling. Separator semantics follow leaf splits:
+  // a key goes to the child on the left of a separator if it is <= the
+  // separator
+  thread_local std::vector<BuildRecord> records;
+  records.clear();
+  for (auto it = begin_it; it != end_it; ++it) {
+    if (it == begin_it) {
+      records.push_back(BuildRecord{nullptr, 0, nullptr, 0, it->child_addr});
+    } else {
+      records.push_back(BuildRecord{nullptr, 0, (it - 1)->key, (it - 1)->key_size,
+                                    it->child_addr});
+    }
+  }
+  New(records, mem);
 }
 
 InternalNode::InternalNode(uint32_t node_size,
-                           InternalNode *src_node,
-                           uint32_t begin_meta_idx,
-                           uint32_t nr_records,
-                           const char *key,
-                           const uint16_t key_size,
-                           uint64_t left_child_addr,
-                           uint64_t right_child_addr,
-                           uint64_t left_most_child_addr)
+                           const std::vector<BuildRecord> &records,
+                           const char *prefix,
+                           uint32_t prefix_size)
     : BaseNode(false, node_size) {
-  ALWAYS_ASSERT(src_node);
-  __builtin_prefetch((const void *) (src_node), 0, 3);
-  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+  header.prefix_size = prefix_size;
+  uint64_t offset = node_size - RecordMetadata::PadKeyLength(prefix_size);
+  memcpy(reinterpret_cast<char *>(this) + offset, prefix, prefix_size);
 
-  uint64_t offset = node_size;
-  bool need_insert_new = key;
   uint32_t insert_idx = 0;
-
-  // See if we need a new left_most_child_addr, i.e., this must be the new node
-  // on the right
-  if (left_most_child_addr) {
-    offset -= sizeof(uint64_t);
-    record_metadata[0].FinalizeForInsert(offset, 0, sizeof(uint64_t));
-    memcpy(reinterpret_cast<char *>(this) + offset, &left_most_child_addr, sizeof(uint64_t));
+  for (auto &record : records) {
+    // Records keep their keys without the prefix, except for the first one,
+    // which has no key
+    uint32_t key_size = record.GetKeySize();
+    assert((insert_idx == 0) == (key_size == 0));
+    if (key_size > 0) {
+      assert(key_size > prefix_size);
+      key_size -= prefix_size;
+    }
+    auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+    auto total_len = padded_key_size + sizeof(uint64_t);
+    offset -= total_len;
+    record_metadata[insert_idx].FinalizeForInsert(offset, key_size, total_len);
+    char *ptr = reinterpret_cast<char *>(this) + offset;
+    record.CopyKey(ptr, prefix_size, prefix_size + key_size);
+    memcpy(ptr + padded_key_size, &record.child_addr, sizeof(uint64_t));
     ++insert_idx;
   }
+  assert(offset == sizeof(*this) + insert_idx * (sizeof(RecordMetadata) + kKeyPrefixSize));
+  header.sorted_count = insert_idx;
+  BuildKeyPrefixes();
+}
 
-  assert(nr_records > 0);
-
-  for (uint32_t i = begin_meta_idx; i < begin_meta_idx + nr_records; ++i) {
-    RecordMetadata meta = src_node->record_metadata[i];
+void InternalNode::GetBuildRecords(uint32_t begin, uint32_t end,
+                                   std::vector<BuildRecord> *records) {
+  for (uint32_t i = begin; i < end; ++i) {
+    RecordMetadata meta = record_metadata[i];
     assert(meta.IsVisible());
-    uint64_t m_payload = 0;
-    char *m_key = nullptr;
-    char *m_data = nullptr;
-    src_node->GetRawRecord(meta, &m_data, &m_key, &m_payload);
-    auto m_key_size = meta.GetKeyLength();
-
-    if (!need_insert_new) {
-      // New key already inserted, so directly insert the key from src node
-      assert(meta.GetTotalLength() >= sizeof(uint64_t));
-      offset -= (meta.GetTotalLength());
-      record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-      memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
+    uint64_t child_addr = 0;
+    char *key = nullptr;
+    GetRawRecord(meta, nullptr, &key, &child_addr);
+    if (key) {
+      records->push_back(BuildRecord{GetPrefix(), static_cast<uint16_t>(header.prefix_size),
+                                     key, meta.GetKeyLength(), child_addr});
     } else {
-      // Compare the two keys to see which one to insert (first)
-      auto cmp = KeyCompare(m_key, m_key_size, key, key_size);
-      ALWAYS_ASSERT(!(cmp == 0 && key_size == m_key_size));
-
-      if (cmp > 0) {
-        assert(insert_idx >= 1);
-
-        // Modify the previous key's payload to left_child_addr
-        auto prev_meta = record_metadata[insert_idx - 1];
-
-        memcpy(reinterpret_cast<char *>(this) +
-                   prev_meta.GetOffset() + prev_meta.GetPaddedKeyLength(),
-               &left_child_addr, sizeof(left_child_addr));
-
-        // Now the new separtor key itself
-        offset -= (padded_key_size + sizeof(right_child_addr));
-        record_metadata[insert_idx].FinalizeForInsert(
-            offset, key_size, padded_key_size + sizeof(left_child_addr));
-
-        ++insert_idx;
-        memcpy(reinterpret_cast<char *>(this) + offset, key, key_size);
-        memcpy(reinterpret_cast<char *>(this) + offset + padded_key_size,
-               &right_child_addr, sizeof(right_child_addr));
-
-        offset -= (meta.GetTotalLength());
-        assert(meta.GetTotalLength() >= sizeof(uint64_t));
-        record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-        memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
-
-        need_insert_new = false;
-      } else {
-        assert(meta.GetTotalLength() >= sizeof(uint64_t));
-        offset -= (meta.GetTotalLength());
-        record_metadata[insert_idx].FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-        memcpy(reinterpret_cast<char *>(this) + offset, m_data, meta.GetTotalLength());
-      }
+      records->push_back(BuildRecord{nullptr, 0, nullptr, 0, child_addr});
     }
-    ++insert_idx;
   }
+}
 
-  if (need_insert_new) {
-    // The new key-payload pair will be the right-most (largest key) element
-    uint32_t total_size = RecordMetadata::PadKeyLength(key_size) + sizeof(uint64_t);
-    offset -= total_size;
-    record_metadata[insert_idx].FinalizeForInsert(offset, key_size, total_size);
-    memcpy(reinterpret_cast<char *>(this) + offset, key, key_size);
-    memcpy(reinterpret_cast<char *>(this) + offset + RecordMetadata::PadKeyLength(key_size),
-           &right_child_addr, sizeof(right_child_addr));
-
-    // Modify the previous key's payload to left_child_addr
-    auto prev_meta = record_metadata[insert_idx - 1];
-    memcpy(reinterpret_cast<char *>(this) + prev_meta.GetOffset() + prev_meta.GetPaddedKeyLength(),
-           &left_child_addr, sizeof(left_child_addr));
-
-    ++insert_idx;
+void InternalNode::BuildKeyPrefixes() {
+  uint64_t *prefixes = GetKeyPrefixes();
+  for (uint32_t i = 0; i < header.sorted_count; ++i) {
+    RecordMetadata meta = record_metadata[i];
+    assert(reinterpret_cast<char *>(prefixes + header.sorted_count) <=
+        reinterpret_cast<char *>(this) + meta.GetOffset());
+    prefixes[i] = GetKeyPrefix(reinterpret_cast<char *>(this) + meta.GetOffset(),
+                               meta.GetKeyLength());
   }
-
-  header.size = node_size;
-  header.sorted_count = insert_idx;
 }
 
 // Insert record to this internal node. The node is frozen at this time.
@@ -285,7 +316,7 @@ bool InternalNode::PrepareForSplit(Stack &stack,
                                    pmwcas::DescriptorPool *pool,
                                    bool backoff) {
   uint32_t data_size = header.size + key_size +
-      sizeof(right_child_addr) + sizeof(RecordMetadata);
+      sizeof(right_child_addr) + sizeof(RecordMetadata) + kKeyPrefixSize;
   uint32_t new_node_size = sizeof(InternalNode) + data_size;
   if (new_node_size < split_threshold) {
     // good boy
@@ -303,22 +334,23 @@ bool InternalNode::PrepareForSplit(Stack &stack,
   auto i_left = pd->ReserveAndAddEntry(
       reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
       reinterpret_cast<uint64_t>(nullptr),
-      pmwcas::Descriptor::kRecycleOnRecovery);
+      pmwcas::Descriptor::kRecycleNewOnFailure);
   auto i_right = pd->ReserveAndAddEntry(
       reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
       reinterpret_cast<uint64_t>(nullptr),
-      pmwcas::Descriptor::kRecycleOnRecovery);
+      pmwcas::Descriptor::kRecycleNewOnFailure);
   uint64_t *ptr_l = pd->GetNewValuePtr(i_left);
   uint64_t *ptr_r = pd->GetNewValuePtr(i_right);
 
   // Figure out where the new key will go
   auto separator_meta = record_metadata[n_left];
-  char *separator_key = nullptr;
-  uint16_t separator_key_size = separator_meta.GetKeyLength();
   uint64_t separator_payload = 0;
-  bool success = GetRawRecord(separator_meta, nullptr, &separator_key,
-                              &separator_payload);
+  bool success = GetRawRecord(separator_meta, nullptr, nullptr, &separator_payload);
   ALWAYS_ASSERT(success);
+  std::string separator;
+  GetFullKey(separator_meta, &separator);
+  const char *separator_key = separator.data();
+  auto separator_key_size = static_cast<uint16_t>(separator.size());
 
   int cmp = KeyCompare(key, key_size, separator_key, separator_key_size);
   if (cmp == 0) {
@@ -358,10 +390,14 @@ bool InternalNode::PrepareForSplit(Stack &stack,
   }
   __builtin_prefetch((const void *) (parent), 0, 2);
 
-  // Try to freeze the parent node first
-  bool frozen_by_me = false;
-  while (!parent->IsFrozen()) {
-    frozen_by_me = parent->Freeze(pool);
+  // Try to freeze the parent node first. This node is frozen, but a merge
+  // may take it over and replace it before then; the parent's pointers don't
+  // change any more once it is frozen.
+  Backoff wait = stack.tree->parameters.NewBackoff();
+  uint32_t meta_index = stack.Top()->meta_index;
+  bool frozen_by_me = parent->FreezeWithChild(meta_index, this, pool, &wait);
+  if (!frozen_by_me && parent->GetChildByMetaIndex(meta_index, pool->GetEpoch()) != this) {
+    return false;
   }
 
   // Someone else froze the parent node and we are told not to compete with
@@ -376,19 +412,41 @@ bool InternalNode::PrepareForSplit(Stack &stack,
                                  new_node, pd, pool, backoff);
 }
 
-void LeafNode::New(LeafNode **mem, uint32_t node_size) {
+void LeafNode::New(LeafNode **mem, uint32_t node_size, bool persist) {
 #ifdef PMDK
   Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), node_size);
   memset(*mem, 0, node_size);
   new(*mem)LeafNode(node_size);
-  pmwcas::NVRAM::Flush(node_size, *mem);
+  if (persist) {
+    pmwcas::NVRAM::Flush(node_size, *mem);
+  }
   *mem = Allocator::Get()->GetOffset(*mem);
 #else
   pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), node_size);
   memset(*mem, 0, node_size);
   new(*mem) LeafNode(node_size);
 #ifdef PMEM
-  pmwcas::NVRAM::Flush(node_size, *mem);
+  if (persist) {
+    pmwcas::NVRAM::Flush(node_size, *mem);
+  }
+#endif  // PMEM
+#endif  // PMDK
+}
+
+void Blob::New(Blob **mem, const char *value, uint32_t value_size) {
+  uint32_t size = sizeof(Blob) + value_size;
+#ifdef PMDK
+  Allocator::Get()->AllocateDirect(reinterpret_cast<void **>(mem), size);
+  (*mem)->size = value_size;
+  memcpy((*mem)->data, value, value_size);
+  pmwcas::NVRAM::Flush(size, *mem);
+  *mem = Allocator::Get()->GetOffset(*mem);
+#else
+  pmwcas::Allocator::Get()->Allocate(reinterpret_cast<void **>(mem), size);
+  (*mem)->size = value_size;
+  memcpy((*mem)->data, value, value_size);
+#ifdef PMEM
+  pmwcas::NVRAM::Flush(size, *mem);
 #endif  // PMEM
 #endif  // PMDK
 }
@@ -412,6 +470,7 @@ void BaseNode::Dump(pmwcas::EpochManager *epoch) {
             << std::endl;
 
   std::cout << " - size: " << header.size << std::endl;
+  std::cout << " - prefix: " << std::string(GetPrefix(), header.prefix_size) << std::endl;
 
   std::cout << " Record Metadata Array:" << std::endl;
   uint32_t n_meta = std::max<uint32_t>(header.status.GetRecordCount(), header.sorted_count);
@@ -436,10 +495,9 @@ void LeafNode::Dump(pmwcas::EpochManager *epoch) {
     RecordMetadata meta = record_metadata[i];
     if (meta.IsVisible()) {
       uint64_t payload = 0;
-      char *key = nullptr;
-      GetRawRecord(meta, &key, &payload, epoch);
-      assert(key);
-      std::string keystr(key, key + meta.GetKeyLength());
+      GetRawRecord(meta, nullptr, &payload, epoch);
+      std::string keystr;
+      GetFullKey(meta, &keystr);
       std::cout << " - record " << i << ": key = " << keystr
                 << ", payload = " << payload << std::endl;
     }
@@ -459,7 +517,8 @@ void InternalNode::Dump(pmwcas::EpochManager *epoch, bool dump_children) {
     char *key = nullptr;
     GetRawRecord(meta, nullptr, &key, &right_child_addr);
     if (key) {
-      std::string keystr(key, key + meta.GetKeyLength());
+      std::string keystr;
+      GetFullKey(meta, &keystr);
       std::cout << " || " << keystr << " | ";
     }
     std::cout << std::hex << "0x" << right_child_addr << std::dec;
@@ -485,22 +544,68 @@ void InternalNode::Dump(pmwcas::EpochManager *epoch, bool dump_children) {
 
 ReturnCode LeafNode::Insert(const char *key, uint16_t key_size, uint64_t payload,
                             pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold) {
-  retry:
-  NodeHeader::StatusWord expected_status = header.GetStatus();
+  return InsertRecord(key, key_size, payload, nullptr, 0, false, pmwcas_pool, split_threshold);
+}
 
-  // If frozon then retry
-  if (expected_status.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
+ReturnCode LeafNode::InsertValue(const char *key, uint16_t key_size,
+                                 const char *value, uint32_t value_size,
+                                 pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                                 bool blob) {
+  return InsertRecord(key, key_size, value_size, value, value_size, blob, pmwcas_pool,
+                      split_threshold);
+}
+
+ReturnCode LeafNode::InsertRecord(const char *key, uint16_t key_size, uint64_t payload,
+                                  const char *value, uint32_t value_size, bool blob,
+                                  pmwcas::DescriptorPool *pmwcas_pool,
+                                  uint32_t split_threshold) {
+  StripPrefix(&key, &key_size);
+  while (true) {
+    NodeHeader::StatusWord expected_status = header.GetStatus();
+
+    // If frozon then retry
+    if (expected_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+
+    auto uniqueness = CheckUnique(key, key_size, pmwcas_pool->GetEpoch());
+    if (uniqueness == Duplicate) {
+      return ReturnCode::KeyExists();
+    }
+
+    auto rc = Append(key, key_size, payload, value, value_size, blob, pmwcas_pool,
+                     split_threshold, expected_status, uniqueness);
+    if (!rc.IsPMWCASFailure()) {
+      return rc;
+    }
   }
+}
 
-  auto uniqueness = CheckUnique(key, key_size, pmwcas_pool->GetEpoch());
-  if (uniqueness == Duplicate) {
-    return ReturnCode::KeyExists();
+ReturnCode LeafNode::Append(const char *key, uint16_t key_size, uint64_t payload,
+                            const char *value, uint32_t value_size, bool blob,
+                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                            NodeHeader::StatusWord expected_status, Uniqueness uniqueness,
+                            RecordMetadata *replaced, Blob **old_blob,
+                            const uint64_t *replaced_payload) {
+  // A payload that overflows the payload word goes to a one-word value
+  uint64_t overflow_payload = payload;
+  if (!value && (payload & kOverflowPayload)) {
+    value = reinterpret_cast<const char *>(&overflow_payload);
+    value_size = sizeof(uint64_t);
+    payload = kOverflowPayload;
+  }
+
+  // Block size includes key, payload and value sizes; a blob takes a word
+  assert(!blob || value_size > sizeof(uint64_t));
+  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+  uint32_t padded_value_size = 0;
+  if (value) {
+    padded_value_size = blob ? sizeof(uint64_t) : RecordMetadata::PadValueLength(value_size);
   }
+  auto total_size = padded_key_size + sizeof(payload) + padded_value_size;
 
   // Check space to see if we need to split the node
-  auto new_size = LeafNode::GetUsedSpace(expected_status) + sizeof(RecordMetadata) +
-      RecordMetadata::PadKeyLength(key_size) + sizeof(payload);
+  auto new_size = LeafNode::GetUsedSpace(expected_status) + sizeof(RecordMetadata) + total_size;
   if (new_size >= split_threshold) {
     return ReturnCode::NotEnoughSpace();
   }
@@ -510,28 +615,25 @@ ReturnCode LeafNode::Insert(const char *key, uint16_t key_size, uint64_t payload
   // Step 2. Flip the record metadata entry's high order bit and fill in global
   // epoch
   NodeHeader::StatusWord desired_status = expected_status;
-
-  // Block size includes both key and payload sizes
-  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
-  auto total_size = padded_key_size + sizeof(payload);
   desired_status.PrepareForInsert(total_size);
 
   // Get the tentative metadata entry (again, make a local copy to work on it)
   RecordMetadata *meta_ptr = &record_metadata[expected_status.GetRecordCount()];
   RecordMetadata expected_meta = *meta_ptr;
   if (!expected_meta.IsVacant()) {
-    goto retry;
+    return ReturnCode::PMWCASFailure();
   }
 
   RecordMetadata desired_meta;
   desired_meta.PrepareForInsert();
 
   // Now do the PMwCAS
-  pmwcas::Descriptor *pd = pmwcas_pool->AllocateDescriptor();
+  pmwcas::Descriptor *pd = AllocateDescriptor(pmwcas_pool);
   pd->AddEntry(&(&header.status)->word, expected_status.word, desired_status.word);
   pd->AddEntry(&meta_ptr->meta, expected_meta.meta, desired_meta.meta);
   if (!pd->MwCAS()) {
-    goto retry;
+    STATS_INC(insert_mwcas_failures);
+    return ReturnCode::PMWCASFailure();
   }
 
   // Reserved space! Now copy data
@@ -540,43 +642,106 @@ ReturnCode LeafNode::Insert(const char *key, uint16_t key_size, uint64_t payload
   char *ptr = &(reinterpret_cast<char *>(this))[offset];
   memcpy(ptr, key, key_size);
   memcpy(ptr + padded_key_size, &payload, sizeof(payload));
+  uint64_t *blob_ptr = reinterpret_cast<uint64_t *>(ptr + padded_key_size + sizeof(payload));
+  if (blob) {
+    // Installed with the record by the final PMwCAS
+    *blob_ptr = 0;
+  } else if (value) {
+    memcpy(blob_ptr, value, value_size);
+  }
   // Flush the word
 
 #ifdef PMEM
   pmwcas::NVRAM::Flush(total_size, ptr);
 #endif
 
+  // A duplicate, or a new version of a deleted record, leaves behind an
+  // invisible record
+  ReturnCode lost = replaced ? ReturnCode::NotFound() : ReturnCode::KeyExists();
+  RecordMetadata replaced_meta;
+
   retry_phase2:
   // Re-check if the node is frozen
   if (uniqueness == ReCheck) {
     auto new_uniqueness = RecheckUnique(key, key_size,
                                         expected_status.GetRecordCount());
     if (new_uniqueness == Duplicate) {
-      memset(ptr, 0, key_size);
-      memset(ptr + padded_key_size, 0, sizeof(payload));
+      memset(ptr, 0, total_size);
       offset = 0;
     } else if (new_uniqueness == NodeFrozen) {
       return ReturnCode::NodeFrozen();
     }
   }
+  if (replaced) {
+    // Concurrent updates and deletes race to replace the same version; follow
+    // the one that won, skipping our own record as it is not finalized, unless
+    // the new version depends on the replaced one. A winner appended after us
+    // is not replaced: versions of a key must stay in index order, or a search
+    // that skips our in-progress record and then finds the winner replaced
+    // would miss the key; append again instead.
+    replaced_meta = GetMetadata(static_cast<uint32_t>(replaced - record_metadata));
+    if (replaced_payload && (!replaced_meta.IsVisible() ||
+        reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(GetPayloadPtr(replaced_meta))
+            ->GetValueProtected() != *replaced_payload)) {
+      memset(ptr, 0, total_size);
+      offset = 0;
+      replaced = nullptr;
+      lost = ReturnCode::PMWCASFailure();
+    } else if (!replaced_meta.IsVisible()) {
+      replaced_meta = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &replaced,
+                                       0, (uint32_t) -1, false);
+      if (replaced_meta.IsVacant() || replaced > meta_ptr) {
+        memset(ptr, 0, total_size);
+        offset = 0;
+        if (replaced_meta.IsVisible()) {
+          lost = ReturnCode::PMWCASFailure();
+        }
+        replaced = nullptr;
+      }
+    }
+  }
   // Final step: make the new record visible, a 2-word PMwCAS:
   // 1. Metadata - set the visible bit and actual block offset
   // 2. Status word - set to the initial value read above (s) to detect
   // conflicting threads that are trying to set the frozen bit
+  // A new version also deletes the old one, which must still be visible. A
+  // blob is allocated by the PMwCAS that installs it, which frees it if the
+  // PMwCAS fails here or is rolled back on recovery.
   auto new_meta = desired_meta;
-  new_meta.FinalizeForInsert(offset, key_size, total_size);
-  assert(new_meta.GetTotalLength() < 100);
+  new_meta.FinalizeForInsert(offset, key_size, total_size,
+                             RecordMetadata::Fingerprint(key, key_size));
 
   NodeHeader::StatusWord s = header.GetStatus();
   if (s.IsFrozen()) {
     return ReturnCode::NodeFrozen();
   }
-  pd = pmwcas_pool->AllocateDescriptor();
-  pd->AddEntry(&(&header.status)->word, s.word, s.word);
+  NodeHeader::StatusWord new_s = s;
+  pd = AllocateDescriptor(pmwcas_pool, blob && offset ? FreeNode : nullptr);
+  if (blob && offset) {
+    auto index = pd->ReserveAndAddEntry(blob_ptr, 0, pmwcas::Descriptor::kRecycleNewOnFailure);
+    Blob::New(reinterpret_cast<Blob **>(pd->GetNewValuePtr(index)), value, value_size);
+  }
+  if (replaced) {
+    auto deleted_meta = replaced_meta;
+    deleted_meta.SetVisible(false);
+    new_s.SetDeleteSize(s.GetDeletedSize() + replaced_meta.GetTotalLength());
+    pd->AddEntry(&replaced->meta, replaced_meta.meta, deleted_meta.meta);
+    if (replaced_payload) {
+      pd->AddEntry(GetPayloadPtr(replaced_meta), *replaced_payload, *replaced_payload);
+    }
+  }
+  pd->AddEntry(&(&header.status)->word, s.word, new_s.word);
   pd->AddEntry(&meta_ptr->meta, desired_meta.meta, new_meta.meta);
   if (pd->MwCAS()) {
+    if (offset == 0) {
+      return lost;
+    }
+    if (replaced && old_blob) {
+      *old_blob = GetBlob(replaced_meta);
+    }
     return ReturnCode::Ok();
   } else {
+    STATS_INC(insert_mwcas_failures);
     goto retry_phase2;
   }
 }
@@ -615,8 +780,10 @@ LeafNode::Uniqueness LeafNode::RecheckUnique(const char *key, uint32_t key_size,
   uint32_t linear_end = std::min<uint32_t>(header.GetStatus().GetRecordCount(), end_pos);
   thread_local std::vector<uint32_t> check_idx;
   check_idx.clear();
+  auto fingerprint = RecordMetadata::Fingerprint(key, key_size);
 
-  auto check_metadata = [key, key_size, this](uint32_t i, bool push) -> LeafNode::Uniqueness {
+  auto check_metadata = [key, key_size, fingerprint, this](uint32_t i,
+                                                           bool push) -> LeafNode::Uniqueness {
     RecordMetadata md = GetMetadata(i);
     if (md.IsInserting()) {
       if (push) {
@@ -628,7 +795,8 @@ LeafNode::Uniqueness LeafNode::RecheckUnique(const char *key, uint32_t key_size,
     } else {
       ALWAYS_ASSERT(md.IsVisible());
       auto len = md.GetKeyLength();
-      if (key_size == len && (KeyCompare(key, key_size, GetKey(md), len) == 0)) {
+      if (key_size == len && md.GetFingerprint() == fingerprint &&
+          (KeyCompare(key, key_size, GetKey(md), len) == 0)) {
         return Duplicate;
       }
       return IsUnique;
@@ -658,43 +826,146 @@ LeafNode::Uniqueness LeafNode::RecheckUnique(const char *key, uint32_t key_size,
 ReturnCode LeafNode::Update(const char *key,
                             uint16_t key_size,
                             uint64_t payload,
-                            pmwcas::DescriptorPool *pmwcas_pool) {
-  retry:
-  auto old_status = header.GetStatus();
-  if (old_status.IsFrozen()) {
-    return ReturnCode::NodeFrozen();
-  }
+                            pmwcas::DescriptorPool *pmwcas_pool,
+                            uint32_t split_threshold) {
+  StripPrefix(&key, &key_size);
+  while (true) {
+    auto old_status = header.GetStatus();
+    if (old_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
 
-  RecordMetadata *meta_ptr = nullptr;
-  auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
-  if (metadata.IsVacant()) {
-    return ReturnCode::NotFound();
-  } else if (metadata.IsInserting()) {
-    goto retry;
+    RecordMetadata *meta_ptr = nullptr;
+    auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+    if (metadata.IsVacant()) {
+      return ReturnCode::NotFound();
+    } else if (metadata.IsInserting()) {
+      continue;
+    }
+
+    auto rc = UpdatePayload(key, key_size, metadata, meta_ptr, payload, pmwcas_pool,
+                            split_threshold, old_status);
+    if (!rc.IsPMWCASFailure()) {
+      return rc;
+    }
   }
+}
 
+ReturnCode LeafNode::UpdatePayload(const char *key, uint16_t key_size,
+                                   RecordMetadata metadata, RecordMetadata *meta_ptr,
+                                   uint64_t payload, pmwcas::DescriptorPool *pmwcas_pool,
+                                   uint32_t split_threshold,
+                                   NodeHeader::StatusWord expected_status,
+                                   const uint64_t *expected_payload) {
   char *record_key = nullptr;
   uint64_t record_payload = 0;
   GetRawRecord(metadata, &record_key, &record_payload, pmwcas_pool->GetEpoch());
-  if (payload == record_payload) {
+  if (expected_payload && record_payload != *expected_payload) {
+    return ReturnCode::PMWCASFailure();
+  }
+  bool has_value = metadata.GetPaddedValueLength() > 0;
+  bool overflow = (record_payload & kOverflowPayload) > 0;
+  if (has_value && !overflow) {
+    // The payload word holds the size of the record's value
+    return ReturnCode();
+  }
+  if (LoadPayload(record_key + metadata.GetPaddedKeyLength(), record_payload) == payload) {
     return ReturnCode::Ok();
   }
+  if (overflow || (payload & kOverflowPayload)) {
+    // Only the payload word is a PMwCAS target, so the record is replaced
+    return Append(key, key_size, payload, nullptr, 0, false, pmwcas_pool, split_threshold,
+                  expected_status, IsUnique, meta_ptr, nullptr,
+                  expected_payload ? &record_payload : nullptr);
+  }
 
   // 1. Update the corresponding payload
   // 2. Make sure meta data is not changed
   // 3. Make sure status word is not changed
-  auto pd = pmwcas_pool->AllocateDescriptor();
+  auto pd = AllocateDescriptor(pmwcas_pool);
   pd->AddEntry(reinterpret_cast<uint64_t *>(record_key + metadata.GetPaddedKeyLength()),
                record_payload, payload);
   pd->AddEntry(&meta_ptr->meta, metadata.meta, metadata.meta);
-  pd->AddEntry(&(&header.status)->word, old_status.word, old_status.word);
+  pd->AddEntry(&(&header.status)->word, expected_status.word, expected_status.word);
 
   if (!pd->MwCAS()) {
-    goto retry;
+    STATS_INC(update_mwcas_failures);
+    return ReturnCode::PMWCASFailure();
   }
   return ReturnCode::Ok();
 }
 
+ReturnCode LeafNode::Upsert(const char *key, uint16_t key_size, uint64_t payload,
+                            pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold) {
+  StripPrefix(&key, &key_size);
+  while (true) {
+    auto old_status = header.GetStatus();
+    if (old_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+
+    // One search decides between the two paths; an in-progress insert that
+    // stopped the search is rechecked by the append like in Insert, and a
+    // concurrent insert of [key] sends us back here to update it instead (as
+    // does a delete of [key] before a new version of its record is in)
+    RecordMetadata *meta_ptr = nullptr;
+    auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+    ReturnCode rc;
+    if (metadata.IsVacant()) {
+      rc = Append(key, key_size, payload, nullptr, 0, false, pmwcas_pool, split_threshold,
+                  old_status, IsUnique);
+    } else if (metadata.IsInserting()) {
+      rc = Append(key, key_size, payload, nullptr, 0, false, pmwcas_pool, split_threshold,
+                  old_status, ReCheck);
+    } else {
+      rc = UpdatePayload(key, key_size, metadata, meta_ptr, payload, pmwcas_pool,
+                         split_threshold, old_status);
+    }
+    if (!rc.IsPMWCASFailure() && !rc.IsKeyExists() && !rc.IsNotFound()) {
+      return rc;
+    }
+  }
+}
+
+ReturnCode LeafNode::ReadModifyWrite(const char *key, uint16_t key_size,
+                                     const PayloadModifier &modify, uint64_t *old_payload,
+                                     pmwcas::DescriptorPool *pmwcas_pool,
+                                     uint32_t split_threshold) {
+  StripPrefix(&key, &key_size);
+  while (true) {
+    auto old_status = header.GetStatus();
+    if (old_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+
+    RecordMetadata *meta_ptr = nullptr;
+    auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+    if (metadata.IsVacant()) {
+      return ReturnCode::NotFound();
+    } else if (metadata.IsInserting()) {
+      continue;
+    }
+
+    // The payload word read here is the expected value of the PMwCAS
+    char *record_key = nullptr;
+    uint64_t record_payload = 0;
+    GetRawRecord(metadata, &record_key, &record_payload, pmwcas_pool->GetEpoch());
+    if (metadata.GetPaddedValueLength() > 0 && !(record_payload & kOverflowPayload)) {
+      return ReturnCode();
+    }
+    uint64_t payload = LoadPayload(record_key + metadata.GetPaddedKeyLength(), record_payload);
+    *old_payload = payload;
+    if (!modify(&payload)) {
+      return ReturnCode::Ok();
+    }
+    auto rc = UpdatePayload(key, key_size, metadata, meta_ptr, payload, pmwcas_pool,
+                            split_threshold, old_status, &record_payload);
+    if (!rc.IsPMWCASFailure()) {
+      return rc;
+    }
+  }
+}
+
 RecordMetadata BaseNode::SearchRecordMeta(pmwcas::EpochManager *epoch,
                                           const char *key,
                                           uint32_t key_size,
@@ -702,24 +973,33 @@ RecordMetadata BaseNode::SearchRecordMeta(pmwcas::EpochManager *epoch,
                                           uint32_t start_pos,
                                           uint32_t end_pos,
                                           bool check_concurrency) {
-  // Binary search on sorted field
-  for (uint32_t i = 0; i < header.sorted_count; i++) {
-    RecordMetadata current = GetMetadata(i);
-    char *current_key = GetKey(current);
-    assert(current_key || !is_leaf);
+  // Binary search on sorted field. Records in the sorted region are never
+  // moved once the node is built, and a deleted record only loses its visible
+  // bit, so its key (at the original offset) still participates in the search.
+  int32_t left = 0, right = static_cast<int32_t>(header.sorted_count) - 1;
+  while (left <= right) {
+    int32_t mid = (left + right) / 2;
+    RecordMetadata current = GetMetadata(mid);
+    char *current_key = reinterpret_cast<char *>(this) + current.GetOffset();
     auto cmp_result = KeyCompare(key, key_size, current_key, current.GetKeyLength());
     if (cmp_result == 0) {
       if (!current.IsVisible()) {
+        // Deleted; the key might have been re-inserted to the unsorted field
         break;
       }
       if (out_metadata_ptr) {
-        *out_metadata_ptr = record_metadata + i;
+        *out_metadata_ptr = record_metadata + mid;
       }
       return current;
+    } else if (cmp_result > 0) {
+      left = mid + 1;
+    } else {
+      right = mid - 1;
     }
   }
-  // Linear search on unsorted field
-//  uint32_t linear_end = std::min<uint32_t>(header.GetStatus().GetRecordCount(), end_pos);
+  // Linear search on unsorted field; only keys whose length and fingerprint
+  // match are read
+  auto fingerprint = RecordMetadata::Fingerprint(key, key_size);
   for (uint32_t i = header.sorted_count; i < header.GetStatus().GetRecordCount(); i++) {
     RecordMetadata current = GetMetadata(i);
 
@@ -737,7 +1017,7 @@ RecordMetadata BaseNode::SearchRecordMeta(pmwcas::EpochManager *epoch,
 
     if (current.IsVisible()) {
       auto current_size = current.GetKeyLength();
-      if (current_size == key_size &&
+      if (current_size == key_size && current.GetFingerprint() == fingerprint &&
           KeyCompare(key, key_size, GetKey(current), current_size) == 0) {
         if (out_metadata_ptr) {
           *out_metadata_ptr = record_metadata + i;
@@ -751,7 +1031,9 @@ RecordMetadata BaseNode::SearchRecordMeta(pmwcas::EpochManager *epoch,
 
 ReturnCode LeafNode::Delete(const char *key,
                             uint16_t key_size,
-                            pmwcas::DescriptorPool *pmwcas_pool) {
+                            pmwcas::DescriptorPool *pmwcas_pool,
+                            Blob **old_blob) {
+  StripPrefix(&key, &key_size);
   retry:
   NodeHeader::StatusWord old_status = header.GetStatus();
   if (old_status.IsFrozen()) {
@@ -774,68 +1056,161 @@ ReturnCode LeafNode::Delete(const char *key,
   auto old_delete_size = old_status.GetDeletedSize();
   new_status.SetDeleteSize(old_delete_size + metadata.GetTotalLength());
 
-  pmwcas::Descriptor *pd = pmwcas_pool->AllocateDescriptor();
+  pmwcas::Descriptor *pd = AllocateDescriptor(pmwcas_pool);
   pd->AddEntry(&(&header.status)->word, old_status.word, new_status.word);
   pd->AddEntry(&meta_ptr->meta, metadata.meta, new_meta.meta);
   if (!pd->MwCAS()) {
+    STATS_INC(delete_mwcas_failures);
     goto retry;
   }
+  if (old_blob) {
+    *old_blob = GetBlob(metadata);
+  }
   return ReturnCode::Ok();
 }
 ReturnCode LeafNode::Read(const char *key, uint16_t key_size, uint64_t *payload,
                           pmwcas::DescriptorPool *pmwcas_pool) {
+  StripPrefix(&key, &key_size);
   auto meta = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, nullptr,
                                0, (uint32_t) -1, false);
   if (meta.IsVacant()) {
     return ReturnCode::NotFound();
   }
 
-  char *source_addr = (reinterpret_cast<char *>(this) + meta.GetOffset());
-  *payload = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
-      source_addr + meta.GetPaddedKeyLength())->GetValueProtected();
+  char *payload_addr = reinterpret_cast<char *>(this) + meta.GetOffset() +
+      meta.GetPaddedKeyLength();
+  *payload = LoadPayload(payload_addr, reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+      payload_addr)->GetValueProtected());
   return ReturnCode::Ok();
 }
-ReturnCode LeafNode::RangeScanBySize(const char *key1,
-                                     uint32_t size1,
-                                     uint32_t to_scan,
-                                     std::list<std::unique_ptr<Record>> *result,
-                                     pmwcas::DescriptorPool *pmwcas_pool) {
-  thread_local std::vector<Record *> tmp_result;
-  tmp_result.clear();
-
-  if (to_scan == 0) {
-    return ReturnCode::Ok();
-  }
-
-  // Enter a new epoch and copy data
-  pmwcas::EpochGuard guard(pmwcas_pool->GetEpoch());
 
-  // Have to scan all keys
-  auto count = header.GetStatus().GetRecordCount();
-  for (uint32_t i = 0; i < count; ++i) {
-    auto curr_meta = GetMetadata(i);
-    if (curr_meta.IsVisible()) {
-      int cmp = KeyCompare(key1, size1, GetKey(curr_meta), curr_meta.GetKeyLength());
-      if (cmp <= 0) {
-        tmp_result.emplace_back(Record::New(curr_meta, this));
-      }
+ReturnCode LeafNode::UpdateValue(const char *key, uint16_t key_size,
+                                 const char *value, uint32_t value_size,
+                                 pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                                 bool blob, Blob **old_blob) {
+  StripPrefix(&key, &key_size);
+  while (true) {
+    auto old_status = header.GetStatus();
+    if (old_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
     }
-  }
 
-  std::sort(tmp_result.begin(), tmp_result.end(),
-            [this](Record *a, Record *b) -> bool {
-              auto cmp = KeyCompare(a->GetKey(), a->meta.GetKeyLength(),
-                                    b->GetKey(), b->meta.GetKeyLength());
-              return cmp < 0;
-            });
+    // In-progress inserts are not versions of [key] yet
+    RecordMetadata *meta_ptr = nullptr;
+    auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr,
+                                     0, (uint32_t) -1, false);
+    if (metadata.IsVacant()) {
+      return ReturnCode::NotFound();
+    }
 
-  for (auto item : tmp_result) {
-    result->emplace_back(item);
+    auto rc = Append(key, key_size, value_size, value, value_size, blob, pmwcas_pool,
+                     split_threshold, old_status, IsUnique, meta_ptr, old_blob);
+    if (!rc.IsPMWCASFailure()) {
+      return rc;
+    }
   }
-  return ReturnCode::Ok();
 }
 
-ReturnCode LeafNode::RangeScanByKey(const char *key1,
+ReturnCode LeafNode::UpsertValue(const char *key, uint16_t key_size,
+                                 const char *value, uint32_t value_size,
+                                 pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                                 bool blob, Blob **old_blob) {
+  StripPrefix(&key, &key_size);
+  while (true) {
+    auto old_status = header.GetStatus();
+    if (old_status.IsFrozen()) {
+      return ReturnCode::NodeFrozen();
+    }
+
+    // As in Upsert, a concurrent insert or delete of [key] sends us back here
+    RecordMetadata *meta_ptr = nullptr;
+    auto metadata = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, &meta_ptr);
+    ReturnCode rc;
+    if (metadata.IsVacant()) {
+      rc = Append(key, key_size, value_size, value, value_size, blob, pmwcas_pool,
+                  split_threshold, old_status, IsUnique);
+    } else if (metadata.IsInserting()) {
+      rc = Append(key, key_size, value_size, value, value_size, blob, pmwcas_pool,
+                  split_threshold, old_status, ReCheck);
+    } else {
+      rc = Append(key, key_size, value_size, value, value_size, blob, pmwcas_pool,
+                  split_threshold, old_status, IsUnique, meta_ptr, old_blob);
+    }
+    if (!rc.IsPMWCASFailure() && !rc.IsKeyExists() && !rc.IsNotFound()) {
+      return rc;
+    }
+  }
+}
+
+ReturnCode LeafNode::ReadValue(const char *key, uint16_t key_size, std::string *value,
+                               pmwcas::DescriptorPool *pmwcas_pool) {
+  StripPrefix(&key, &key_size);
+  auto meta = SearchRecordMeta(pmwcas_pool->GetEpoch(), key, key_size, nullptr,
+                               0, (uint32_t) -1, false);
+  if (meta.IsVacant()) {
+    return ReturnCode::NotFound();
+  }
+
+  // Versions are never modified in place, so the value needs no protection
+  char *payload_addr = reinterpret_cast<char *>(this) + meta.GetOffset() +
+      meta.GetPaddedKeyLength();
+  uint64_t payload = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+      payload_addr)->GetValueProtected();
+  if (meta.GetPaddedValueLength() == 0 || (payload & kOverflowPayload)) {
+    payload = LoadPayload(payload_addr, payload);
+    value->assign(reinterpret_cast<char *>(&payload), sizeof(payload));
+  } else if (payload <= meta.GetPaddedValueLength()) {
+    value->assign(payload_addr + sizeof(payload), payload);
+  } else {
+    Blob *blob = GetBlob(meta);
+    assert(blob->size == payload);
+    value->assign(blob->data, blob->size);
+  }
+  return ReturnCode::Ok();
+}
+
+Blob *LeafNode::GetBlob(RecordMetadata meta) {
+  auto padded_value_size = meta.GetPaddedValueLength();
+  if (padded_value_size == 0) {
+    return nullptr;
+  }
+  char *value = GetValue(meta);
+  uint64_t value_size = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+      value - sizeof(uint64_t))->GetValueProtected();
+  if (value_size <= padded_value_size || (value_size & kOverflowPayload)) {
+    return nullptr;
+  }
+  auto blob = reinterpret_cast<Blob *>(reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
+      value)->GetValueProtected());
+#ifdef PMDK
+  return Allocator::Get()->GetDirect(blob);
+#else
+  return blob;
+#endif
+}
+
+ReturnCode LeafNode::RangeScanBySize(const char *key1,
+                                     uint32_t size1,
+                                     uint32_t to_scan,
+                                     std::list<std::unique_ptr<Record>> *result,
+                                     pmwcas::DescriptorPool *pmwcas_pool) {
+  if (to_scan == 0) {
+    return ReturnCode::Ok();
+  }
+
+  // Enter a new epoch and copy data; only the records returned are copied
+  pmwcas::EpochGuard guard(pmwcas_pool->GetEpoch());
+  bool done = false;
+  ScanBuffers buffers;
+  Scan(key1, size1, true, nullptr, 0, to_scan,
+       [result](const char *key, uint16_t key_size, uint64_t payload) {
+         result->emplace_back(Record::New(key, key_size, payload));
+         return true;
+       }, &done, &buffers, pmwcas_pool->GetEpoch());
+  return ReturnCode::Ok();
+}
+
+ReturnCode LeafNode::RangeScanByKey(const char *key1,
                                     uint32_t size1,
                                     const char *key2,
                                     uint32_t size2,
@@ -847,15 +1222,16 @@ ReturnCode LeafNode::RangeScanByKey(const char *key1,
   // scan the sorted fields first
   uint32_t i = 0;
   auto count = header.GetStatus().GetRecordCount();
+  thread_local std::string curr_key;
   while (i < count) {
     auto curr_meta = GetMetadata(i);
     if (!curr_meta.IsVisible()) {
       i += 1;
       continue;
     }
-    char *curr_key;
-    GetRawRecord(curr_meta, &curr_key, nullptr, pmwcas_pool->GetEpoch());
-    auto range_code = KeyInRange(curr_key, curr_meta.GetKeyLength(), key1, size1, key2, size2);
+    GetFullKey(curr_meta, &curr_key);
+    auto range_code = KeyInRange(curr_key.data(), static_cast<uint32_t>(curr_key.size()),
+                                 key1, size1, key2, size2);
     if (range_code == 0) {
       result->emplace_back(Record::New(curr_meta, this));
     } else if (range_code == 1 && i < header.sorted_count) {
@@ -875,37 +1251,193 @@ ReturnCode LeafNode::RangeScanByKey(const char *key1,
   return ReturnCode::Ok();
 }
 
+uint32_t LeafNode::Scan(const char *key1, uint32_t size1, bool include_key1,
+                        const char *key2, uint32_t size2, uint32_t to_scan,
+                        const ScanVisitor &visitor, bool *done, ScanBuffers *buffers,
+                        pmwcas::EpochManager *epoch) {
+  auto &unsorted = buffers->unsorted;
+  unsorted.clear();
+  *done = false;
+  StripPrefix(&key1, &size1);
+
+  auto after_key1 = [&](RecordMetadata meta) -> bool {
+    int cmp = KeyCompare(key1, size1, GetKey(meta), meta.GetKeyLength());
+    return cmp < 0 || (cmp == 0 && include_key1);
+  };
+  auto key_cmp = [this](RecordMetadata m1, RecordMetadata m2) -> bool {
+    return KeyCompare(GetKey(m1), m1.GetKeyLength(), GetKey(m2), m2.GetKeyLength()) < 0;
+  };
+
+  // Find the first sorted record that may be in range; as in SearchRecordMeta
+  // deleted records still have their keys in place
+  int32_t left = 0, right = static_cast<int32_t>(header.sorted_count) - 1;
+  while (left <= right) {
+    int32_t mid = (left + right) / 2;
+    RecordMetadata current = GetMetadata(mid);
+    char *current_key = reinterpret_cast<char *>(this) + current.GetOffset();
+    int cmp = KeyCompare(key1, size1, current_key, current.GetKeyLength());
+    if (cmp > 0 || (cmp == 0 && !include_key1)) {
+      left = mid + 1;
+    } else {
+      right = mid - 1;
+    }
+  }
+  uint32_t sorted_pos = static_cast<uint32_t>(left);
+
+  // The unsorted field is short, sort the records in range from it on the
+  // side. At most [to_scan] of them can be visited, so only the smallest
+  // [to_scan] need to be in order
+  auto count = header.GetStatus().GetRecordCount();
+  for (uint32_t i = header.sorted_count; i < count; ++i) {
+    auto meta = GetMetadata(i);
+    if (meta.IsVisible() && after_key1(meta)) {
+      unsorted.push_back(meta);
+    }
+  }
+  if (unsorted.size() > to_scan) {
+    std::nth_element(unsorted.begin(), unsorted.begin() + to_scan, unsorted.end(), key_cmp);
+    unsorted.resize(to_scan);
+  }
+  std::sort(unsorted.begin(), unsorted.end(), key_cmp);
+
+  // Merge the two fields
+  uint32_t scanned = 0;
+  uint32_t unsorted_pos = 0;
+  auto &full_key = buffers->full_key;
+  while (scanned < to_scan) {
+    RecordMetadata meta;
+    if (sorted_pos < header.sorted_count) {
+      meta = GetMetadata(sorted_pos);
+      if (!meta.IsVisible()) {
+        ++sorted_pos;
+        continue;
+      }
+      if (unsorted_pos < unsorted.size() && key_cmp(unsorted[unsorted_pos], meta)) {
+        meta = unsorted[unsorted_pos++];
+      } else {
+        ++sorted_pos;
+      }
+    } else if (unsorted_pos < unsorted.size()) {
+      meta = unsorted[unsorted_pos++];
+    } else {
+      break;
+    }
+
+    char *key = nullptr;
+    uint64_t payload = 0;
+    GetRawRecord(meta, &key, &payload, epoch);
+    payload = LoadPayload(key + meta.GetPaddedKeyLength(), payload);
+    uint16_t key_size = meta.GetKeyLength();
+    if (header.prefix_size > 0) {
+      // Hand out the full key
+      key_size += header.prefix_size;
+      full_key.resize(key_size);
+      CopyKey(&full_key[0], key, 0, key_size);
+      key = &full_key[0];
+    }
+    if (key2 && KeyCompare(key, key_size, key2, size2) > 0) {
+      *done = true;
+      break;
+    }
+    ++scanned;
+    if (!visitor(key, key_size, payload)) {
+      *done = true;
+      break;
+    }
+  }
+  return scanned;
+}
+
 bool BaseNode::Freeze(pmwcas::DescriptorPool *pmwcas_pool) {
   NodeHeader::StatusWord expected = header.GetStatus();
   if (expected.IsFrozen()) {
     return false;
   }
 
-  pmwcas::Descriptor *pd = pmwcas_pool->AllocateDescriptor();
+  pmwcas::Descriptor *pd = AllocateDescriptor(pmwcas_pool);
   pd->AddEntry(&(&header.status)->word, expected.word, expected.Freeze().word);
   return pd->MwCAS();
 }
 
+bool BaseNode::Freeze(pmwcas::DescriptorPool *pmwcas_pool, Backoff *backoff) {
+  while (!Freeze(pmwcas_pool)) {
+    if (IsFrozen()) {
+      return false;
+    }
+    backoff->Wait();
+  }
+  return true;
+}
+
+bool InternalNode::FreezeWithChild(uint32_t meta_index, BaseNode *child,
+                                   pmwcas::DescriptorPool *pmwcas_pool, Backoff *backoff) {
+#ifdef PMDK
+  auto child_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(child));
+#else
+  auto child_addr = reinterpret_cast<uint64_t>(child);
+#endif
+  uint64_t *child_ptr = GetPayloadPtr(GetMetadata(meta_index));
+  while (GetChildByMetaIndex(meta_index, pmwcas_pool->GetEpoch()) == child) {
+    NodeHeader::StatusWord expected = header.GetStatus();
+    if (expected.IsFrozen()) {
+      return false;
+    }
+    pmwcas::Descriptor *pd = AllocateDescriptor(pmwcas_pool);
+    pd->AddEntry(&(&header.status)->word, expected.word, expected.Freeze().word);
+    pd->AddEntry(child_ptr, child_addr, child_addr);
+    if (pd->MwCAS()) {
+      return true;
+    }
+    backoff->Wait();
+  }
+  return false;
+}
+
 LeafNode *LeafNode::Consolidate(pmwcas::DescriptorPool *pmwcas_pool) {
   // Freeze the node to prevent new modifications first
   if (!Freeze(pmwcas_pool)) {
     return nullptr;
   }
 
+  LeafNode *new_leaf = nullptr;
+  NewConsolidated(&new_leaf, pmwcas_pool);
+#ifdef PMDK
+  return Allocator::Get()->GetDirect(new_leaf);
+#else
+  return new_leaf;
+#endif
+}
+
+void LeafNode::NewConsolidated(LeafNode **mem, pmwcas::DescriptorPool *pmwcas_pool) {
   thread_local std::vector<RecordMetadata> meta_vec;
   meta_vec.clear();
   SortMetadataByKey(meta_vec, true, pmwcas_pool->GetEpoch());
 
   // Allocate and populate a new node
-  LeafNode *new_leaf = nullptr;
-  LeafNode::New(&new_leaf, this->header.size);
-  new_leaf->CopyFrom(this, meta_vec.begin(), meta_vec.end(), pmwcas_pool->GetEpoch());
+  LeafNode::New(mem, this->header.size, false);
+#ifdef PMDK
+  LeafNode *new_leaf = Allocator::Get()->GetDirect(*mem);
+#else
+  LeafNode *new_leaf = *mem;
+#endif
+  new_leaf->CopyFrom(this, meta_vec.begin(), meta_vec.end(), header.prefix_size,
+                     pmwcas_pool->GetEpoch());
 
 #ifdef PMEM
   pmwcas::NVRAM::Flush(this->header.size, new_leaf);
 #endif
+}
 
-  return new_leaf;
+uint32_t LeafNode::GetConsolidatedSpace() {
+  uint32_t space = sizeof(LeafNode) + RecordMetadata::PadKeyLength(header.prefix_size);
+  auto count = header.GetStatus().GetRecordCount();
+  for (uint32_t i = 0; i < count; ++i) {
+    auto meta = GetMetadata(i);
+    if (meta.IsVisible()) {
+      space += sizeof(RecordMetadata) + meta.GetTotalLength();
+    }
+  }
+  return space;
 }
 
 uint32_t LeafNode::SortMetadataByKey(std::vector<RecordMetadata> &vec,
@@ -942,26 +1474,56 @@ uint32_t LeafNode::SortMetadataByKey(std::vector<RecordMetadata> &vec,
 void LeafNode::CopyFrom(LeafNode *node,
                         std::vector<RecordMetadata>::iterator begin_it,
                         std::vector<RecordMetadata>::iterator end_it,
+                        uint32_t prefix_size,
                         pmwcas::EpochManager *epoch) {
+  if (header.status.GetBlockSize() == 0) {
+    // Take the prefix from the first key, or from the source node's prefix if
+    // there are no records
+    header.prefix_size = prefix_size;
+    char *prefix = GetPrefix();
+    if (begin_it != end_it) {
+      node->CopyKey(prefix, node->GetKey(*begin_it), 0, prefix_size);
+    } else {
+      assert(prefix_size <= node->header.prefix_size);
+      node->CopyKey(prefix, nullptr, 0, prefix_size);
+    }
+    header.status.SetBlockSize(RecordMetadata::PadKeyLength(prefix_size));
+  }
+  assert(header.prefix_size == prefix_size);
+
   // meta_vec is assumed to be in sorted order, insert records one by one
-  uint32_t offset = this->header.size;
-  uint16_t nrecords = 0;
+  uint32_t offset = this->header.size - header.status.GetBlockSize();
+  uint16_t nrecords = header.sorted_count;
   for (auto it = begin_it; it != end_it; ++it) {
     auto meta = *it;
     uint64_t payload = 0;
     char *key;
     node->GetRawRecord(meta, &key, &payload, epoch);
 
-    // Copy data
-    assert(meta.GetTotalLength() >= sizeof(uint64_t));
-    uint64_t total_len = meta.GetTotalLength();
+    // Copy data, with the key re-encoded for the prefix of this node
+    uint32_t key_size = node->header.prefix_size + meta.GetKeyLength() - prefix_size;
+    auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+    uint32_t padded_value_size = meta.GetPaddedValueLength();
+    uint64_t total_len = padded_key_size + sizeof(payload) + padded_value_size;
     assert(offset >= total_len);
     offset -= total_len;
     char *ptr = &(reinterpret_cast<char *>(this))[offset];
-    memcpy(ptr, key, total_len);
+    node->CopyKey(ptr, key, prefix_size, prefix_size + key_size);
+    memcpy(ptr + padded_key_size, &payload, sizeof(payload));
+    if (padded_value_size) {
+      memcpy(ptr + padded_key_size + sizeof(payload), node->GetValue(meta), padded_value_size);
+      auto blob = node->GetBlob(meta);
+      if (blob) {
+        // The blob address was installed by a PMwCAS
+#ifdef PMDK
+        blob = Allocator::Get()->GetOffset(blob);
+#endif
+        memcpy(ptr + padded_key_size + sizeof(payload), &blob, sizeof(blob));
+      }
+    }
 
     // Setup new metadata
-    record_metadata[nrecords].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
+    record_metadata[nrecords].FinalizeForInsert(offset, key_size, total_len);
     ++nrecords;
   }
   // Finalize header stats
@@ -973,41 +1535,40 @@ void LeafNode::CopyFrom(LeafNode *node,
 #endif
 }
 
+bool LeafNode::AppendSorted(const char *key, uint16_t key_size, uint64_t payload,
+                            uint32_t space_limit) {
+  auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+  bool overflow = (payload & kOverflowPayload) > 0;
+  uint32_t total_len = padded_key_size + sizeof(payload) * (overflow ? 2 : 1);
+  if (GetUsedSpace(header.status) + sizeof(RecordMetadata) + total_len >= space_limit) {
+    return false;
+  }
+
+  uint32_t count = header.status.GetRecordCount();
+  uint32_t offset = header.size - header.status.GetBlockSize() - total_len;
+  char *ptr = reinterpret_cast<char *>(this) + offset;
+  memcpy(ptr, key, key_size);
+  if (overflow) {
+    memcpy(ptr + padded_key_size + sizeof(payload), &payload, sizeof(payload));
+    payload = kOverflowPayload;
+  }
+  memcpy(ptr + padded_key_size, &payload, sizeof(payload));
+
+  record_metadata[count].FinalizeForInsert(offset, key_size, total_len);
+  header.status.PrepareForInsert(total_len);
+  header.sorted_count = count + 1;
+  return true;
+}
+
 void InternalNode::DeleteRecord(uint32_t meta_to_update,
                                 uint64_t new_child_ptr,
                                 bztree::InternalNode **new_node) {
-  uint32_t meta_to_delete = meta_to_update + 1;
-  uint32_t offset = this->header.size -
-      this->record_metadata[meta_to_delete].GetTotalLength() - sizeof(RecordMetadata);
-  InternalNode::New(new_node, offset);
-
-  uint32_t insert_idx = 0;
-  for (uint32_t i = 0; i < this->header.sorted_count; i += 1) {
-    if (i == meta_to_delete) {
-      continue;
-    }
-    RecordMetadata meta = record_metadata[i];
-    uint64_t m_payload = 0;
-    char *m_key = nullptr;
-    char *m_data = nullptr;
-    GetRawRecord(meta, &m_data, &m_key, &m_payload);
-    auto m_key_size = meta.GetKeyLength();
-    offset -= meta.GetTotalLength();
-    (*new_node)->record_metadata[insert_idx].
-        FinalizeForInsert(offset, m_key_size, meta.GetTotalLength());
-    auto ptr = reinterpret_cast<char *>(*new_node) + offset;
-    if (i == meta_to_update) {
-      memcpy(ptr, m_data, meta.GetKeyLength());
-      memcpy(ptr + meta.GetPaddedKeyLength(), &new_child_ptr, sizeof(uint64_t));
-    } else {
-      memcpy(ptr, m_data, meta.GetTotalLength());
-    }
-    insert_idx += 1;
-  }
-  (*new_node)->header.sorted_count = insert_idx;
-#ifdef PMEM
-  pmwcas::NVRAM::Flush((*new_node)->header.size, *new_node);
-#endif
+  thread_local std::vector<BuildRecord> records;
+  records.clear();
+  GetBuildRecords(0, header.sorted_count, &records);
+  records[meta_to_update].child_addr = new_child_ptr;
+  records.erase(records.begin() + meta_to_update + 1);
+  New(records, new_node);
 }
 
 ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
@@ -1067,6 +1628,16 @@ ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
   // do the real merge
   BaseNode *sibling = parent->GetChildByMetaIndex(sibling_index, epoch);
 
+  // Leaves are only merged into a leaf of the configured size; it may not
+  // fit if the keys lose part of their prefixes
+  uint32_t leaf_node_size = stack->tree->parameters.leaf_node_size;
+  uint32_t unused_prefix_size = 0;
+  if (IsLeaf() && LeafNode::GetMergedSize(reinterpret_cast<LeafNode *>(this),
+                                          reinterpret_cast<LeafNode *>(sibling),
+                                          &unused_prefix_size) > leaf_node_size) {
+    return ReturnCode::Ok();
+  }
+
   // Phase 1: freeze both nodes, and their parent
   auto node_status = this->GetHeader()->GetStatus();
   auto sibling_status = sibling->GetHeader()->GetStatus();
@@ -1077,54 +1648,75 @@ ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
     return ReturnCode::NodeFrozen();
   }
 
-  auto *pd = pmwcas_pool->AllocateDescriptor();
+  // Also make sure the parent still points to both nodes: either may have been
+  // replaced (e.g., consolidated) since we read it, and merging a replaced node
+  // would lose its replacement and retire it twice. The pointers can't change
+  // any more once the parent is frozen.
+#ifdef PMDK
+  auto node_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(this));
+  auto sibling_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(sibling));
+#else
+  auto node_addr = reinterpret_cast<uint64_t>(this);
+  auto sibling_addr = reinterpret_cast<uint64_t>(sibling);
+#endif
+  auto *pd = AllocateDescriptor(pmwcas_pool);
   pd->AddEntry(&(&this->GetHeader()->status)->word,
                node_status.word, node_status.Freeze().word);
   pd->AddEntry(&(&sibling->GetHeader()->status)->word,
                sibling_status.word, sibling_status.Freeze().word);
   pd->AddEntry(&(&parent->GetHeader()->status)->word,
                parent_status.word, parent_status.Freeze().word);
+  pd->AddEntry(parent->GetPayloadPtr(parent->GetMetadata(parent_frame->meta_index)),
+               node_addr, node_addr);
+  pd->AddEntry(parent->GetPayloadPtr(parent->GetMetadata(sibling_index)),
+               sibling_addr, sibling_addr);
   if (!pd->MwCAS()) {
     return ReturnCode::PMWCASFailure();
   }
 
   // Phase 2: allocate parent and new node
-  pd = pmwcas_pool->AllocateDescriptor();
+  pd = AllocateDescriptor(pmwcas_pool, FreeNode);
   pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
                          reinterpret_cast<uint64_t>(nullptr),
-                         pmwcas::Descriptor::kRecycleOnRecovery);
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
   pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
                          reinterpret_cast<uint64_t>(nullptr),
-                         pmwcas::Descriptor::kRecycleOnRecovery);
+                         pmwcas::Descriptor::kRecycleNewOnFailure);
   auto *new_parent = reinterpret_cast<InternalNode **>(pd->GetNewValuePtr(0));
   auto *new_node = reinterpret_cast<BaseNode **>(pd->GetNewValuePtr(1));
 
   // lambda wrapper for merge leaf nodes
   auto merge_leaf_nodes = [&](uint32_t left_index, LeafNode *left_node, LeafNode *right_node) {
-    LeafNode::MergeNodes(left_node, right_node,
-                         reinterpret_cast<LeafNode **>(new_node));
+    if (!LeafNode::MergeNodes(left_node, right_node, leaf_node_size,
+                              reinterpret_cast<LeafNode **>(new_node))) {
+      return false;
+    }
     parent->DeleteRecord(left_index,
                          reinterpret_cast<uint64_t>(*new_node),
                          new_parent);
+    return true;
   };
   // lambda wrapper for merge internal nodes
   auto merge_internal_nodes = [&](uint32_t left_node_index,
                                   InternalNode *left_node, InternalNode *right_node) {
     // get the key for right node
     RecordMetadata right_meta = parent->record_metadata[left_node_index + 1];
-    char *new_key = nullptr;
-    parent->GetRawRecord(right_meta, nullptr, &new_key, nullptr);
     assert(right_meta.GetKeyLength() != 0);
-    InternalNode::MergeNodes(left_node, right_node, new_key, right_meta.GetKeyLength(),
+    std::string new_key;
+    parent->GetFullKey(right_meta, &new_key);
+    InternalNode::MergeNodes(left_node, right_node, new_key.data(),
+                             static_cast<uint32_t>(new_key.size()),
                              reinterpret_cast<InternalNode **> (new_node));
     parent->DeleteRecord(left_node_index,
                          reinterpret_cast<uint64_t>(*new_node),
                          new_parent);
+    return true;
   };
 
   // Phase 3: merge and init nodes
+  bool merged;
   if (sibling_index < parent_frame->meta_index) {
-    IsLeaf() ?
+    merged = IsLeaf() ?
     merge_leaf_nodes(sibling_index,
                      reinterpret_cast<LeafNode *>(sibling),
                      reinterpret_cast<LeafNode *>(this)) :
@@ -1132,7 +1724,7 @@ ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
                          reinterpret_cast<InternalNode *>(sibling),
                          reinterpret_cast<InternalNode *>(this));
   } else {
-    IsLeaf() ?
+    merged = IsLeaf() ?
     merge_leaf_nodes(parent_frame->meta_index,
                      reinterpret_cast<LeafNode *>(this),
                      reinterpret_cast<LeafNode *>(sibling)) :
@@ -1140,35 +1732,61 @@ ReturnCode BaseNode::CheckMerge(bztree::Stack *stack, const char *key,
                          reinterpret_cast<InternalNode *>(this),
                          reinterpret_cast<InternalNode *>(sibling));
   }
+  if (!merged) {
+    // Records were inserted after the size check above. The nodes stay
+    // frozen, to be consolidated or split by the next insert, like after a
+    // failed split.
+    pd->Abort();
+    return ReturnCode::Ok();
+  }
 
-  // Phase 4: install new nodes
+  // Phase 4: install new nodes, then retire the merged nodes and old parent
+  auto retire_merged = [&]() {
+    stack->tree->RetireNode(this);
+    stack->tree->RetireNode(sibling);
+    stack->tree->RetireNode(parent);
+  };
   auto grandpa_frame = stack->Top();
   ReturnCode rc;
   if (!grandpa_frame) {
     rc = stack->tree->ChangeRoot(reinterpret_cast<uint64_t>(stack->GetRoot()),
                                  reinterpret_cast<uint64_t>(*new_parent), pd) ?
          ReturnCode::Ok() : ReturnCode::PMWCASFailure();
+    if (rc.IsOk()) {
+      STATS_INC(merges);
+      retire_merged();
+    }
     return rc;
   } else {
+    // [pd] may be recycled once its PMwCAS is done, so the new parent is read
+    // out of it first
+    InternalNode *merged_parent = *new_parent;
     InternalNode *grandparent = grandpa_frame->node;
     rc = grandparent->Update(grandparent->GetMetadata(grandpa_frame->meta_index),
-                             parent, *new_parent, pd, pmwcas_pool);
+                             parent, merged_parent, pd, pmwcas_pool);
     if (!rc.IsOk()) {
+      if (rc.IsNodeFrozen()) {
+        pd->Abort();
+      }
       return rc;
     }
+    STATS_INC(merges);
+    retire_merged();
 
     uint32_t freeze_retry = 0;
+    Backoff wait = stack->tree->parameters.NewBackoff();
     do {
       // if previous merge succeeded, we move on to check new_parent
-      rc = (*new_parent)->CheckMerge(stack, key, key_size,
-                                     freeze_retry < MAX_FREEZE_RETRY);
+      rc = merged_parent->CheckMerge(stack, key, key_size,
+                                     freeze_retry < stack->tree->parameters.max_freeze_retry);
       if (rc.IsOk()) {
         return rc;
       }
       freeze_retry += 1;
+      wait.Wait();
       stack->Clear();
-      BaseNode *landed_on = stack->tree->TraverseToNode(stack, key, key_size, *new_parent);
-      if (landed_on != *new_parent) {
+      BaseNode *landed_on = stack->tree->TraverseToNode(stack, key, key_size, merged_parent);
+      if (landed_on != merged_parent) {
         // we landed on a leaf node
         // means the *new_parent has been swapped out
         // either splitted or merged
@@ -1205,17 +1823,13 @@ ReturnCode InternalNode::Update(RecordMetadata meta,
   }
 }
 
-uint32_t InternalNode::GetChildIndex(const char *key,
-                                     uint16_t key_size,
-                                     bool get_le) {
+template <class Compare>
+uint32_t InternalNode::SearchChildIndex(Compare compare, bool get_le) {
   // Keys in internal nodes are always sorted, visible
   int32_t left = 0, right = header.sorted_count - 1, mid = 0;
   while (true) {
     mid = (left + right) / 2;
-    auto meta = record_metadata[mid];
-    char *record_key = nullptr;
-    GetRawRecord(meta, nullptr, &record_key, nullptr, nullptr);
-    auto cmp = KeyCompare(key, key_size, record_key, meta.GetKeyLength());
+    auto cmp = compare(static_cast<uint32_t>(mid));
     if (cmp == 0) {
       // Key exists
       if (get_le) {
@@ -1225,7 +1839,9 @@ uint32_t InternalNode::GetChildIndex(const char *key,
       }
     }
     if (left > right) {
-      if (cmp <= 0 && get_le) {
+      // get_le only decides which child an exact match goes to; a key that
+      // is smaller than the last separator probed belongs to the left of it
+      if (cmp < 0) {
         return static_cast<uint32_t>(mid - 1);
       } else {
         return static_cast<uint32_t> (mid);
@@ -1240,67 +1856,99 @@ uint32_t InternalNode::GetChildIndex(const char *key,
   }
 }
 
+uint32_t InternalNode::GetChildIndex(const char *key,
+                                     uint16_t key_size,
+                                     bool get_le) {
+  // All separators start with the node's prefix, so a key that does not is
+  // smaller or larger than all of them; otherwise only the rest of the key is
+  // compared with the separators
+  uint32_t prefix_size = header.prefix_size;
+  if (prefix_size > 0) {
+    uint32_t size = key_size < prefix_size ? key_size : prefix_size;
+    int cmp = KeyCompare(key, size, GetPrefix(), size);
+    if (cmp < 0 || (cmp == 0 && key_size < prefix_size)) {
+      return 0;
+    } else if (cmp > 0) {
+      return header.sorted_count - 1;
+    }
+    key += prefix_size;
+    key_size -= prefix_size;
+  }
+
+  // Prefixes give the same order as KeyCompare. Equal prefixes decide on the
+  // key sizes if either key fits in a prefix (it is then a prefix of the
+  // other key), and only otherwise on the rest of the keys. As in KeyCompare,
+  // the null key of the left-most child is smaller than any search key.
+  uint64_t prefix = GetKeyPrefix(key, key_size);
+  uint64_t *prefixes = GetKeyPrefixes();
+  auto compare = [this, key, key_size, prefix, prefixes](uint32_t i) -> int {
+    if (prefix != prefixes[i]) {
+      return prefix < prefixes[i] ? -1 : 1;
+    }
+    RecordMetadata meta = record_metadata[i];
+    uint32_t record_key_size = meta.GetKeyLength();
+    if (record_key_size == 0) {
+      return 1;
+    }
+    if (key_size <= kKeyPrefixSize || record_key_size <= kKeyPrefixSize) {
+      return (key_size > record_key_size) - (key_size < record_key_size);
+    }
+    char *record_key = reinterpret_cast<char *>(this) + meta.GetOffset();
+    return KeyCompare(key + kKeyPrefixSize, key_size - kKeyPrefixSize,
+                      record_key + kKeyPrefixSize, record_key_size - kKeyPrefixSize);
+  };
+  return SearchChildIndex(compare, get_le);
+}
+
 bool InternalNode::MergeNodes(InternalNode *left_node,
                               InternalNode *right_node,
                               const char *key, uint32_t key_size,
                               InternalNode **new_node) {
-  uint32_t padded_keysize = RecordMetadata::PadKeyLength(key_size);
-  uint32_t offset = left_node->header.size + right_node->header.size +
-      padded_keysize - sizeof(InternalNode);
-  InternalNode::New(new_node, offset);
-  thread_local std::vector<RecordMetadata> meta_vec;
-  meta_vec.clear();
-  uint32_t cur_record = 0;
-
-  InternalNode *node = *new_node;
-
-  for (uint32_t i = 0; i < left_node->header.sorted_count; i += 1) {
-    RecordMetadata meta = left_node->record_metadata[i];
-    uint64_t payload;
-    char *data;
-    char *record_key;
-    left_node->GetRawRecord(meta, &data, &record_key, &payload);
-    assert(meta.GetTotalLength() >= sizeof(uint64_t));
-    uint64_t total_len = meta.GetTotalLength();
-    offset -= total_len;
-    memcpy(reinterpret_cast<char *>(node) + offset,
-           data, total_len);
-
-    node->record_metadata[cur_record].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
-    cur_record += 1;
-  }
-  for (uint32_t i = 0; i < right_node->header.sorted_count; i += 1) {
-    RecordMetadata meta = right_node->record_metadata[i];
-    uint64_t payload;
-    char *cur_key;
-    right_node->GetRawRecord(meta, nullptr, &cur_key, &payload);
-    if (i == 0) {
-      offset -= (padded_keysize + sizeof(uint64_t));
-      memcpy(reinterpret_cast<char *>(node) + offset,
-             key, key_size);
-      memcpy(reinterpret_cast<char *>(node) + offset + padded_keysize,
-             &payload, sizeof(uint64_t));
-      node->record_metadata[cur_record].
-          FinalizeForInsert(offset, key_size, padded_keysize + sizeof(uint64_t));
-    } else {
-      assert(meta.GetTotalLength() >= sizeof(uint64_t));
-      uint64_t total_len = meta.GetTotalLength();
-      offset -= total_len;
-      memcpy(reinterpret_cast<char *>(node) + offset,
-             cur_key, total_len);
-      node->record_metadata[cur_record].FinalizeForInsert(offset, meta.GetKeyLength(), total_len);
+  // The left-most child of the right node gets [key]
+  thread_local std::vector<BuildRecord> records;
+  records.clear();
+  left_node->GetBuildRecords(0, left_node->header.sorted_count, &records);
+  uint32_t right_begin = static_cast<uint32_t>(records.size());
+  right_node->GetBuildRecords(0, right_node->header.sorted_count, &records);
+  records[right_begin].suffix = key;
+  records[right_begin].suffix_size = static_cast<uint16_t>(key_size);
+  New(records, new_node);
+  return true;
+}
+
+uint32_t LeafNode::GetMergedSize(LeafNode *left_node, LeafNode *right_node,
+                                 uint32_t *prefix_size) {
+  // Keys of both nodes start with the common part of their prefixes. Keys
+  // that lose part of their prefix get longer, so the new node can be larger
+  // than the two nodes.
+  uint32_t left_prefix_size = left_node->header.prefix_size;
+  uint32_t right_prefix_size = right_node->header.prefix_size;
+  *prefix_size = GetCommonPrefixSize(
+      left_node->GetPrefix(), right_node->GetPrefix(),
+      left_prefix_size < right_prefix_size ? left_prefix_size : right_prefix_size);
+  uint32_t node_size = sizeof(LeafNode) + RecordMetadata::PadKeyLength(*prefix_size);
+  for (auto *node : {left_node, right_node}) {
+    uint32_t count = node->header.GetStatus().GetRecordCount();
+    for (uint32_t i = 0; i < count; ++i) {
+      RecordMetadata meta = node->record_metadata[i];
+      if (meta.IsVisible()) {
+        uint32_t key_size = meta.GetKeyLength() + node->header.prefix_size - *prefix_size;
+        node_size += sizeof(RecordMetadata) + RecordMetadata::PadKeyLength(key_size) +
+            sizeof(uint64_t) + meta.GetPaddedValueLength();
+      }
     }
-    cur_record += 1;
   }
-  node->header.sorted_count = cur_record;
-#ifdef PMDK
-  Allocator::Get()->PersistPtr(node, node->header.size);
-#endif
-  return true;
+  return node_size;
 }
 
-bool LeafNode::MergeNodes(LeafNode *left_node, LeafNode *right_node, LeafNode **new_node) {
-  LeafNode::New(new_node, left_node->header.size);
+bool LeafNode::MergeNodes(LeafNode *left_node, LeafNode *right_node, uint32_t node_size,
+                          LeafNode **new_node) {
+  // Both nodes are frozen, so the size is final
+  uint32_t prefix_size = 0;
+  if (GetMergedSize(left_node, right_node, &prefix_size) > node_size) {
+    return false;
+  }
+
   thread_local std::vector<RecordMetadata> meta_vec;
   meta_vec.clear();
   auto copy_metadata = [](std::vector<RecordMetadata> *meta_vec, LeafNode *node) -> uint32_t {
@@ -1330,46 +1978,72 @@ bool LeafNode::MergeNodes(LeafNode *left_node, LeafNode *right_node, LeafNode **
   std::sort(meta_vec.begin() + left_count,
             meta_vec.begin() + left_count + right_count, key_cmp(right_node));
 
+  LeafNode::New(new_node, node_size);
+
   LeafNode *node = *new_node;
-  uint32_t offset = node->header.size;
-  uint32_t cur_record = 0;
-  for (auto meta_iter = meta_vec.begin(); meta_iter < meta_vec.end(); meta_iter++) {
-    uint64_t payload;
-    char *key;
-    if (meta_iter < meta_vec.begin() + left_count) {
-      left_node->GetRawRecord(*meta_iter, &key, &payload);
-    } else {
-      right_node->GetRawRecord(*meta_iter, &key, &payload);
-    }
+  node->CopyFrom(left_node, meta_vec.begin(), meta_vec.begin() + left_count, prefix_size,
+                 nullptr);
+  node->CopyFrom(right_node, meta_vec.begin() + left_count, meta_vec.end(), prefix_size,
+                 nullptr);
+  return true;
+}
 
-    assert(meta_iter->GetTotalLength() >= sizeof(uint64_t));
-    uint64_t total_len = meta_iter->GetTotalLength();
-    offset -= total_len;
-    char *ptr = reinterpret_cast<char *>(node) + offset;
-    memcpy(ptr, key, total_len);
+void LeafNode::GetFences(Stack &stack, std::string *low, bool *has_low,
+                         std::string *high, bool *has_high) {
+  // The fences are the nearest separators to the left and to the right of
+  // the path
+  *has_low = false;
+  *has_high = false;
+  for (uint32_t i = stack.num_frames; i > 0 && !(*has_low && *has_high); --i) {
+    auto &frame = stack.frames[i - 1];
+    if (!*has_low && frame.meta_index > 0) {
+      frame.node->GetFullKey(frame.node->GetMetadata(frame.meta_index), low);
+      *has_low = true;
+    }
+    if (!*has_high && frame.meta_index + 1 < frame.node->GetHeader()->sorted_count) {
+      frame.node->GetFullKey(frame.node->GetMetadata(frame.meta_index + 1), high);
+      *has_high = true;
+    }
+  }
+}
 
-    node->record_metadata[cur_record].
-        FinalizeForInsert(offset, meta_iter->GetKeyLength(), total_len);
-    cur_record += 1;
+void LeafNode::GetSeparator(const char *left, uint32_t left_size,
+                            const char *right, uint32_t right_size,
+                            std::string *separator) {
+  assert(KeyCompare(left, left_size, right, right_size) < 0);
+  uint32_t common_size = 0;
+  uint32_t min_size = std::min(left_size, right_size);
+  while (common_size < min_size && left[common_size] == right[common_size]) {
+    ++common_size;
+  }
+
+  // Past the common part, the first byte of [left] that can be incremented
+  // gives a key that is larger than [left]. It is also smaller than [right]
+  // unless it is the first differing byte and becomes the last byte of
+  // [right]. Otherwise no key shorter than [left] will do.
+  for (uint32_t i = common_size; i + 1 < left_size; ++i) {
+    auto byte = static_cast<uint8_t>(left[i]);
+    if (byte == UINT8_MAX) {
+      continue;
+    }
+    if (i > common_size || byte + 1 < static_cast<uint8_t>(right[i]) ||
+        right_size > i + 1) {
+      separator->assign(left, i + 1);
+      (*separator)[i] = static_cast<char>(byte + 1);
+      return;
+    }
   }
-  node->header.status.SetBlockSize(node->header.size - offset);
-  node->header.status.SetRecordCount(cur_record);
-  node->header.sorted_count = cur_record;
-#ifdef PMDK
-  Allocator::Get()->PersistPtr(node, node->header.size);
-#endif
-  return true;
+  separator->assign(left, left_size);
 }
 
 bool LeafNode::PrepareForSplit(Stack &stack,
                                uint32_t split_threshold,
+                               const char *new_key, uint32_t new_key_size,
                                pmwcas::Descriptor *pd,
                                pmwcas::DescriptorPool *pmwcas_pool,
                                LeafNode **left, LeafNode **right,
                                InternalNode **new_parent,
                                bool backoff) {
-  ALWAYS_ASSERT(header.GetStatus().GetRecordCount() > 2);
-
   // Prepare new nodes: a parent node, a left leaf and a right leaf
   LeafNode::New(left, this->header.size);
   LeafNode::New(right, this->header.size);
@@ -1378,7 +2052,28 @@ bool LeafNode::PrepareForSplit(Stack &stack,
   meta_vec.clear();
   uint32_t total_size = SortMetadataByKey(meta_vec, true, pmwcas_pool->GetEpoch());
 
-  int32_t left_size = total_size / 2;
+  // The new leaves take the prefix of their key ranges, (low, separator] and
+  // (separator, high], where low and high are the fences of this leaf. A leaf
+  // without a fence on either side keeps full keys.
+  thread_local std::string low;
+  thread_local std::string high;
+  bool has_low = false;
+  bool has_high = false;
+  GetFences(stack, &low, &has_low, &high, &has_high);
+
+  // Keys that go after all keys of the right-most leaf likely keep doing so,
+  // and would leave half-empty left leaves behind
+  float left_fill = 0.5;
+  if (new_key && !has_high && !meta_vec.empty()) {
+    thread_local std::string last_key;
+    GetFullKey(meta_vec.back(), &last_key);
+    if (KeyCompare(new_key, new_key_size, last_key.data(),
+                   static_cast<uint32_t>(last_key.size())) > 0) {
+      left_fill = stack.tree->parameters.append_split_fill;
+    }
+  }
+
+  int32_t left_size = static_cast<int32_t>(total_size * left_fill);
   uint32_t nleft = 0;
   for (uint32_t i = 0; i < meta_vec.size(); ++i) {
     auto &meta = meta_vec[i];
@@ -1389,42 +2084,72 @@ bool LeafNode::PrepareForSplit(Stack &stack,
     }
   }
 
-  assert(nleft > 0);
+  // When traversing the tree, we go left if <= separator, and go right if >.
+  // Instead of the last key of the left leaf, promote the shortest key between
+  // it and the first key of the right leaf: it is the separator that makes
+  // the parent smallest.
+  std::string separator;
+  if (nleft > 0) {
+    RecordMetadata separator_meta = meta_vec[nleft - 1];
+
+    // The node is already frozen, so we must be able to get a valid key
+    assert(GetKey(separator_meta));
+    GetFullKey(separator_meta, &separator);
+    if (nleft < meta_vec.size()) {
+      thread_local std::string left_max;
+      thread_local std::string right_min;
+      left_max.swap(separator);
+      GetFullKey(meta_vec[nleft], &right_min);
+      GetSeparator(left_max.data(), static_cast<uint32_t>(left_max.size()),
+                   right_min.data(), static_cast<uint32_t>(right_min.size()), &separator);
+    }
+  } else {
+    // Nothing visible is left, e.g., a merge froze the leaf after its records
+    // were deleted and has yet to replace it; the new key lies in this leaf's
+    // range, so split there
+    ALWAYS_ASSERT(new_key);
+    separator.assign(new_key, new_key_size);
+  }
+  const char *key = separator.data();
+  auto key_size = static_cast<uint32_t>(separator.size());
+
+  uint32_t left_prefix_size = has_low ?
+      ChoosePrefixSize(low.data(), static_cast<uint32_t>(low.size()), key, key_size) : 0;
+  uint32_t right_prefix_size = has_high ?
+      ChoosePrefixSize(key, key_size, high.data(), static_cast<uint32_t>(high.size())) : 0;
 
   // TODO(tzwang): also put the new insert here to save some cycles
   auto left_end_it = meta_vec.begin() + nleft;
 #ifdef PMDK
-  (Allocator::Get()->GetDirect(*left))->CopyFrom(this, meta_vec.begin(),
-                                                 left_end_it, pmwcas_pool->GetEpoch());
-  (Allocator::Get()->GetDirect(*right))->CopyFrom(this, left_end_it,
-                                                  meta_vec.end(), pmwcas_pool->GetEpoch());
+  (Allocator::Get()->GetDirect(*left))->CopyFrom(this, meta_vec.begin(), left_end_it,
+                                                 left_prefix_size, pmwcas_pool->GetEpoch());
+  (Allocator::Get()->GetDirect(*right))->CopyFrom(this, left_end_it, meta_vec.end(),
+                                                  right_prefix_size, pmwcas_pool->GetEpoch());
 #else
-  (*left)->CopyFrom(this, meta_vec.begin(), left_end_it, pmwcas_pool->GetEpoch());
-  (*right)->CopyFrom(this, left_end_it, meta_vec.end(), pmwcas_pool->GetEpoch());
+  (*left)->CopyFrom(this, meta_vec.begin(), left_end_it, left_prefix_size,
+                    pmwcas_pool->GetEpoch());
+  (*right)->CopyFrom(this, left_end_it, meta_vec.end(), right_prefix_size,
+                     pmwcas_pool->GetEpoch());
 #endif
 
-  // Separator exists in the new left leaf node, i.e., when traversing the tree,
-  // we go left if <=, and go right if >.
-  RecordMetadata separator_meta = meta_vec[nleft - 1];
-
-  // The node is already frozen (by us), so we must be able to get a valid key
-  char *key = GetKey(separator_meta);
-  assert(key);
-
   InternalNode *parent = stack.Top() ?
                          stack.Top()->node : nullptr;
   if (parent == nullptr) {
     // Good boy!
-    InternalNode::New(key, separator_meta.GetKeyLength(),
+    InternalNode::New(key, key_size,
                       reinterpret_cast<uint64_t>(*left),
                       reinterpret_cast<uint64_t>(*right),
                       new_parent);
     return true;
   }
 
-  bool frozen_by_me = false;
-  while (!parent->IsFrozen()) {
-    frozen_by_me = parent->Freeze(pmwcas_pool);
+  // As for internal nodes, the leaf must still be the parent's child
+  Backoff wait = stack.tree->parameters.NewBackoff();
+  uint32_t meta_index = stack.Top()->meta_index;
+  bool frozen_by_me = parent->FreezeWithChild(meta_index, this, pmwcas_pool, &wait);
+  if (!frozen_by_me &&
+      parent->GetChildByMetaIndex(meta_index, pmwcas_pool->GetEpoch()) != this) {
+    return false;
   }
 
   if (!frozen_by_me && backoff) {
@@ -1433,8 +2158,7 @@ bool LeafNode::PrepareForSplit(Stack &stack,
     // Has a parent node. PrepareForSplit will see if we need to split this
     // parent node as well, and if so, return a new (possibly upper-level) parent
     // node that needs to be installed to its parent
-    return parent->PrepareForSplit(stack, split_threshold, key,
-                                   separator_meta.GetKeyLength(),
+    return parent->PrepareForSplit(stack, split_threshold, key, key_size,
                                    reinterpret_cast<uint64_t>(*left),
                                    reinterpret_cast<uint64_t>(*right),
                                    new_parent,
@@ -1469,7 +2193,6 @@ BaseNode *BzTree::TraverseToNode(bztree::Stack *stack,
 LeafNode *BzTree::TraverseToLeaf(Stack *stack, const char *key,
                                  uint16_t key_size,
                                  bool le_child) {
-  static const uint32_t kCacheLineSize = 64;
   BaseNode *node = GetRootNodeSafe();
   __builtin_prefetch((const void *) (root), 0, 3);
 
@@ -1483,53 +2206,153 @@ LeafNode *BzTree::TraverseToLeaf(Stack *stack, const char *key,
     parent = reinterpret_cast<InternalNode *>(node);
     meta_index = parent->GetChildIndex(key, key_size, le_child);
     node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
-    for (uint32_t i = 0; i < parameters.leaf_node_size / kCacheLineSize; ++i) {
-      __builtin_prefetch((const void *) ((char *) node + i * kCacheLineSize), 0, 3);
-    }
+    PrefetchNode(node, parameters.leaf_node_size);
     assert(node);
     if (stack != nullptr) {
       stack->Push(parent, meta_index);
     }
   }
 
-  for (uint32_t i = 0; i < parameters.leaf_node_size / kCacheLineSize; ++i) {
-    __builtin_prefetch((const void *) ((char *) node + i * kCacheLineSize), 0, 3);
-  }
+  PrefetchNode(node, parameters.leaf_node_size);
   return reinterpret_cast<LeafNode *>(node);
 }
 
 ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload) {
+  STATS_SCOPE();
+  STATS_INC(inserts);
+  return InsertRecord(key, key_size, payload, nullptr, 0, false, InsertOp);
+}
+
+ReturnCode BzTree::InsertValue(const char *key, uint16_t key_size,
+                               const char *value, uint32_t value_size) {
+  STATS_SCOPE();
+  STATS_INC(inserts);
+  return WriteValue(key, key_size, value, value_size, InsertOp);
+}
+
+ReturnCode BzTree::UpdateValue(const char *key, uint16_t key_size,
+                               const char *value, uint32_t value_size) {
+  STATS_SCOPE();
+  STATS_INC(updates);
+  return WriteValue(key, key_size, value, value_size, UpdateOp);
+}
+
+ReturnCode BzTree::UpsertValue(const char *key, uint16_t key_size,
+                               const char *value, uint32_t value_size) {
+  STATS_SCOPE();
+  STATS_INC(upserts);
+  return WriteValue(key, key_size, value, value_size, UpsertOp);
+}
+
+ReturnCode BzTree::WriteValue(const char *key, uint16_t key_size,
+                              const char *value, uint32_t value_size, RecordOp op) {
+  // Values of up to a word stay in the leaf, so that a record has a blob iff
+  // its value is longer than the space it has in the leaf
+  bool blob = value_size > sizeof(uint64_t) &&
+      (value_size > parameters.max_inline_value || !RecordFits(key_size, value_size));
+  if (!RecordFits(key_size, blob ? sizeof(uint64_t) : value_size)) {
+    return ReturnCode::NotEnoughSpace();
+  }
+  return InsertRecord(key, key_size, value_size, value, value_size, blob, op);
+}
+
+ReturnCode BzTree::InsertRecord(const char *key, uint16_t key_size, uint64_t payload,
+                                const char *value, uint32_t value_size, bool blob,
+                                RecordOp op, const PayloadModifier *modify,
+                                uint64_t *old_payload) {
   thread_local Stack stack;
   stack.tree = this;
   uint64_t freeze_retry = 0;
+  Backoff wait = parameters.NewBackoff();
+  bool use_hint = true;
 
   while (true) {
     stack.Clear();
     pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
-    LeafNode *node = TraverseToLeaf(&stack, key, key_size);
+    // Keys in the range of the leaf the last operation went to (increasing
+    // keys past the right-most leaf, unless leaf hints are on) go there
+    // directly, without a stack unless it is needed
+    LeafNode *node = use_hint ? GetHintedLeaf(key, key_size) : nullptr;
+    bool hinted = node != nullptr;
+    if (!hinted) {
+      uint64_t retired = retired_nodes.load();
+      node = TraverseToLeaf(&stack, key, key_size);
+      SetLeafHint(stack, node, retired);
+    }
 
     // Try to insert to the leaf node
-    auto rc = node->Insert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
-    if (rc.IsOk() || rc.IsKeyExists()) {
+    ReturnCode rc;
+    Blob *old_blob = nullptr;
+    if (op == UpdateOp && value) {
+      rc = node->UpdateValue(key, key_size, value, value_size, GetPMWCASPool(),
+                             parameters.split_threshold, blob, &old_blob);
+    } else if (op == UpdateOp) {
+      rc = node->Update(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
+    } else if (op == UpsertOp && value) {
+      rc = node->UpsertValue(key, key_size, value, value_size, GetPMWCASPool(),
+                             parameters.split_threshold, blob, &old_blob);
+    } else if (op == UpsertOp) {
+      rc = node->Upsert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
+    } else if (op == ModifyOp) {
+      rc = node->ReadModifyWrite(key, key_size, *modify, old_payload, GetPMWCASPool(),
+                                 parameters.split_threshold);
+    } else if (value) {
+      rc = node->InsertValue(key, key_size, value, value_size, GetPMWCASPool(),
+                             parameters.split_threshold, blob);
+    } else {
+      rc = node->Insert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
+    }
+    if (old_blob) {
+      RetireBlob(old_blob);
+    }
+    if (rc.IsOk() || rc.IsKeyExists() || rc.IsNotFound() || rc.IsInvalid()) {
+      // Sort a long unsorted field, unless the maintenance thread will
+      if (rc.IsOk() && maintenance == nullptr && parameters.max_unsorted_records > 0 &&
+          node->GetUnsortedCount() >= parameters.max_unsorted_records &&
+          node->Freeze(GetPMWCASPool())) {
+        if (hinted) {
+          TraverseToLeaf(&stack, key, key_size);
+        }
+        ConsolidateLeaf(&stack, node, key, key_size);
+      }
       return rc;
     }
+    if (hinted) {
+      // Split (or wait for) the leaf on the normal path
+      use_hint = false;
+      continue;
+    }
 
     assert(rc.IsNotEnoughSpace() || rc.IsNodeFrozen());
     if (rc.IsNodeFrozen()) {
-      if (++freeze_retry <= MAX_FREEZE_RETRY) {
+      if (++freeze_retry <= parameters.max_freeze_retry) {
+        STATS_INC(frozen_retries);
+        wait.Wait();
         continue;
       }
     } else {
-      bool frozen_by_me = false;
-      while (!node->IsFrozen()) {
-        frozen_by_me = node->Freeze(GetPMWCASPool());
+      bool frozen_by_me = node->Freeze(GetPMWCASPool(), &wait);
+      // Compact instead of splitting if enough of the node is deleted records
+      uint32_t record_space = sizeof(RecordMetadata) +
+          RecordMetadata::PadKeyLength(key_size) + sizeof(payload);
+      if (value) {
+        record_space += blob ? sizeof(uint64_t) : RecordMetadata::PadValueLength(value_size);
+      } else if (payload & LeafNode::kOverflowPayload) {
+        record_space += sizeof(uint64_t);
       }
-      if (!frozen_by_me && ++freeze_retry <= MAX_FREEZE_RETRY) {
+      if (frozen_by_me && node->GetConsolidatedSpace() + record_space <=
+          parameters.split_threshold * parameters.consolidate_fill) {
+        ConsolidateLeaf(&stack, node, key, key_size);
+        continue;
+      }
+      if (!frozen_by_me && ++freeze_retry <= parameters.max_freeze_retry) {
+        STATS_INC(frozen_retries);
+        wait.Wait();
         continue;
       }
     }
 
-    bool backoff = (freeze_retry <= MAX_FREEZE_RETRY);
+    bool backoff = (freeze_retry <= parameters.max_freeze_retry);
 
     // Should split and we have three cases to handle:
     // 1. Root node is a leaf node - install [parent] as the new root
@@ -1538,21 +2361,39 @@ ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload)
     // 3. We have a grandparent - update the child pointer in the grandparent
     //    to point to the new [parent] (might further cause splits up the tree)
 
-    auto *pd = GetPMWCASPool()->AllocateDescriptor();
-    // TODO(hao): should implement a cascading memory recycle callback
+    // All nodes allocated for the split (including those of internal nodes
+    // split along the way) are placeholders in [pd], freed if it fails
+    auto *pd = AllocateDescriptor(GetPMWCASPool(), FreeNode);
     pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
                            reinterpret_cast<uint64_t>(nullptr),
-                           pmwcas::Descriptor::kRecycleOnRecovery);
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
     pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
                            reinterpret_cast<uint64_t>(nullptr),
-                           pmwcas::Descriptor::kRecycleOnRecovery);
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
     pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
                            reinterpret_cast<uint64_t>(nullptr),
-                           pmwcas::Descriptor::kRecycleOnRecovery);
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
     uint64_t *ptr_r = pd->GetNewValuePtr(0);
     uint64_t *ptr_l = pd->GetNewValuePtr(1);
     uint64_t *ptr_parent = pd->GetNewValuePtr(2);
 
+    // Fail the split if the leaf was replaced (e.g., consolidated by the
+    // thread that froze it) in the meantime, so that the replacement and the
+    // records inserted into it are not dropped, and the leaf is retired once
+    if (stack.Top()) {
+#ifdef PMDK
+      auto leaf_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(node));
+#else
+      auto leaf_addr = reinterpret_cast<uint64_t>(node);
+#endif
+      auto *leaf_parent = stack.Top()->node;
+      pd->AddEntry(leaf_parent->GetPayloadPtr(leaf_parent->GetMetadata(stack.Top()->meta_index)),
+                   leaf_addr, leaf_addr);
+    }
+
+    // Frames above [depth] are the internal nodes replaced by this split
+    uint32_t depth = stack.num_frames;
+
     // Note that when we split internal nodes (if needed), stack will get
     // Pop()'ed recursively, leaving the grantparent as the top (if any) here.
     // So we save the root node here in case we need to change root later.
@@ -1570,14 +2411,16 @@ ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload)
     // the new parent node returned by leaf.PrepareForSplit to the grandparent.
     bool should_proceed = node->PrepareForSplit(stack,
                                                 parameters.split_threshold,
+                                                key, key_size,
                                                 pd, GetPMWCASPool(),
                                                 reinterpret_cast<LeafNode **>(ptr_l),
                                                 reinterpret_cast<LeafNode **>(ptr_r),
                                                 reinterpret_cast<InternalNode **>(ptr_parent),
                                                 backoff);
     if (!should_proceed) {
+      // Frees the nodes allocated so far
       pd->Abort();
-      // TODO(tzwang): free memory allocated in ptr_l, ptr_r, and ptr_parent
+      wait.Wait();
       continue;
     }
 
@@ -1588,6 +2431,22 @@ ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload)
     if (top) {
       old_parent = top->node;
     }
+    uint32_t replaced_from = stack.num_frames;
+    auto retire_replaced = [&]() {
+      RetireNode(node);
+      for (uint32_t i = replaced_from; i < depth; ++i) {
+        RetireNode(stack.frames[i].node);
+      }
+#if ENABLE_STATS
+      // The leaf and the internal nodes above it were split, except the top
+      // one if it only took the new separator
+      uint32_t split_from = old_parent ? replaced_from + 1 : replaced_from;
+      STATS_INC(splits[0]);
+      for (uint32_t i = split_from; i < depth; ++i) {
+        STATS_INC(splits[std::min<uint32_t>(depth - i, Stats::kMaxLevels - 1)]);
+      }
+#endif
+    };
 
     top = stack.Pop();
     InternalNode *grand_parent = nullptr;
@@ -1609,34 +2468,420 @@ ReturnCode BzTree::Insert(const char *key, uint16_t key_size, uint64_t payload)
           top->node->GetMetadata(top->meta_index),
           old_parent, reinterpret_cast<InternalNode *>(*ptr_parent), pd, GetPMWCASPool());
 #endif
+      if (result.IsOk()) {
+        retire_replaced();
+      } else if (result.IsNodeFrozen()) {
+        pd->Abort();
+      } else {
+        STATS_INC(insert_mwcas_failures);
+      }
     } else {
       // No grand parent or already popped out by during split propagation
       // In case of PMDK, ptr_parent is already in PMDK offset format (done by
       // InternalNode::New).
 #ifdef PMDK
-      ChangeRoot(reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(stack.GetRoot())),
-                 *ptr_parent, pd);
+      bool success = ChangeRoot(
+          reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(stack.GetRoot())),
+          *ptr_parent, pd);
+#else
+      bool success = ChangeRoot(reinterpret_cast<uint64_t>(stack.GetRoot()), *ptr_parent, pd);
+#endif
+      if (success) {
+        retire_replaced();
+      } else {
+        STATS_INC(insert_mwcas_failures);
+      }
+    }
+  }
+}
+
+ReturnCode BzTree::BulkLoadFrom(const BulkLoadSource &source, float fill_factor) {
+  STATS_SCOPE();
+  ALWAYS_ASSERT(fill_factor > 0 && fill_factor <= 1);
+  pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+  BaseNode *old_root = GetRootNodeSafe();
+  if (!old_root->IsLeaf() || old_root->GetHeader()->GetStatus().GetRecordCount() > 0) {
+    return ReturnCode();
+  }
+  uint32_t space_limit = static_cast<uint32_t>(parameters.split_threshold * fill_factor);
+
+  // Nodes of the level being built, each with the largest key in its subtree.
+  // Keys point to the copies in the leaf nodes, so they stay valid.
+  std::vector<BulkLoadEntry> level;
+
+  // Pack the leaf level
+  LeafNode *leaf = nullptr;
+  uint64_t leaf_addr = 0;
+  const char *last_key = nullptr;
+  uint16_t last_key_size = 0;
+  auto finish_leaf = [&]() {
+#ifdef PMEM
+    pmwcas::NVRAM::Flush(leaf->GetHeader()->size, leaf);
+#endif
+    level.push_back(BulkLoadEntry{last_key, last_key_size, leaf_addr});
+  };
+
+  const char *key = nullptr;
+  uint16_t key_size = 0;
+  uint64_t payload = 0;
+  while (source(&key, &key_size, &payload)) {
+    ALWAYS_ASSERT(!last_key || BaseNode::KeyCompare(last_key, last_key_size, key, key_size) < 0);
+    if (!leaf || !leaf->AppendSorted(key, key_size, payload, space_limit)) {
+      if (leaf) {
+        finish_leaf();
+      }
+      LeafNode::New(reinterpret_cast<LeafNode **>(&leaf_addr), parameters.leaf_node_size, false);
+#ifdef PMDK
+      leaf = Allocator::Get()->GetDirect(reinterpret_cast<LeafNode *>(leaf_addr));
 #else
-      ChangeRoot(reinterpret_cast<uint64_t>(stack.GetRoot()), *ptr_parent, pd);
+      leaf = reinterpret_cast<LeafNode *>(leaf_addr);
 #endif
+      // A node always takes at least one record
+      bool appended = leaf->AppendSorted(key, key_size, payload, leaf->GetHeader()->size + 1);
+      ALWAYS_ASSERT(appended);
+    }
+    auto last_meta = leaf->GetMetadata(leaf->GetHeader()->sorted_count - 1);
+    last_key = leaf->GetKey(last_meta);
+    last_key_size = last_meta.GetKeyLength();
+  }
+  if (!leaf) {
+    return ReturnCode::Ok();
+  }
+  finish_leaf();
+
+  // Build the inner levels bottom-up until a single root remains
+  std::vector<BulkLoadEntry> upper_level;
+  while (level.size() > 1) {
+    upper_level.clear();
+    uint32_t begin = 0;
+    while (begin < level.size()) {
+      // Take as many children as fit (but at least two)
+      uint32_t node_size = sizeof(InternalNode) + sizeof(RecordMetadata) +
+          InternalNode::kKeyPrefixSize + sizeof(uint64_t);
+      uint32_t end = begin + 1;
+      while (end < level.size()) {
+        uint32_t record_size = sizeof(RecordMetadata) + InternalNode::kKeyPrefixSize +
+            sizeof(uint64_t) +
+            RecordMetadata::PadKeyLength(level[end - 1].key_size);
+        if (node_size + record_size >= space_limit && end - begin >= 2) {
+          break;
+        }
+        node_size += record_size;
+        ++end;
+      }
+      // Don't leave a single child for the last node
+      if (end == level.size() - 1) {
+        if (end - begin > 2) {
+          --end;
+        } else {
+          ++end;
+        }
+      }
+
+      InternalNode *node = nullptr;
+      InternalNode::New(level.begin() + begin, level.begin() + end, &node);
+      upper_level.push_back(BulkLoadEntry{level[end - 1].key, level[end - 1].key_size,
+                                          reinterpret_cast<uint64_t>(node)});
+      begin = end;
     }
+    level.swap(upper_level);
+  }
+
+  auto *pd = AllocateDescriptor(GetPMWCASPool());
+#ifdef PMDK
+  bool success = ChangeRoot(reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(old_root)),
+                            level[0].child_addr, pd);
+#else
+  bool success = ChangeRoot(reinterpret_cast<uint64_t>(old_root), level[0].child_addr, pd);
+#endif
+  if (!success) {
+    return ReturnCode::PMWCASFailure();
   }
+  RetireNode(old_root);
+  return ReturnCode::Ok();
+}
+
+void BzTree::ConsolidateLeaf(Stack *stack, LeafNode *node, const char *key, uint16_t key_size) {
+  assert(node->IsFrozen());
+  while (true) {
+    auto *pd = AllocateDescriptor(GetPMWCASPool(), FreeNode);
+    pd->ReserveAndAddEntry(reinterpret_cast<uint64_t *>(pmwcas::Descriptor::kAllocNullAddress),
+                           reinterpret_cast<uint64_t>(nullptr),
+                           pmwcas::Descriptor::kRecycleNewOnFailure);
+    uint64_t *ptr_new = pd->GetNewValuePtr(0);
+    node->NewConsolidated(reinterpret_cast<LeafNode **>(ptr_new), GetPMWCASPool());
+
+    // Swap the new node in through the parent, or as the new root
+#ifdef PMDK
+    auto old_addr = reinterpret_cast<uint64_t>(Allocator::Get()->GetOffset(node));
+#else
+    auto old_addr = reinterpret_cast<uint64_t>(node);
+#endif
+    auto *top = stack->Top();
+    if (top) {
+      auto rc = top->node->Update(top->node->GetMetadata(top->meta_index),
+                                  reinterpret_cast<InternalNode *>(old_addr),
+                                  reinterpret_cast<InternalNode *>(*ptr_new),
+                                  pd, GetPMWCASPool());
+      if (rc.IsOk()) {
+        STATS_INC(consolidations);
+        RetireNode(node);
+        return;
+      } else if (rc.IsNodeFrozen()) {
+        // The parent stays frozen if the split that froze it failed; leave
+        // the frozen node to be split, which replaces the parent as well
+        pd->Abort();
+        return;
+      }
+    } else if (ChangeRoot(old_addr, *ptr_new, pd)) {
+      STATS_INC(consolidations);
+      RetireNode(node);
+      return;
+    }
+
+    // The parent is being changed by a concurrent split or merge; find the
+    // new parent, unless the frozen node was replaced by someone else
+    stack->Clear();
+    if (TraverseToLeaf(stack, key, key_size) != node) {
+      return;
+    }
+  }
+}
+
+uint32_t BzTree::ConsolidateLeaves() {
+  if (parameters.max_unsorted_records == 0) {
+    return 0;
+  }
+  STATS_SCOPE();
+  thread_local Stack stack;
+  stack.tree = this;
+  stack.Clear();
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  pmwcas::EpochGuard guard(epoch);
+
+  uint32_t consolidated = 0;
+  std::string key;
+  LeafNode *node = TraverseToLeaf(&stack, "", 0);
+  while (node) {
+    if (node->GetUnsortedCount() >= parameters.max_unsorted_records) {
+      // Any visible key can be used to find the node again
+      auto count = node->GetHeader()->GetStatus().GetRecordCount();
+      key.clear();
+      for (uint32_t i = 0; i < count; ++i) {
+        auto meta = node->GetMetadata(i);
+        if (meta.IsVisible()) {
+          node->GetFullKey(meta, &key);
+          break;
+        }
+      }
+      if (!key.empty() && node->Freeze(GetPMWCASPool())) {
+        ConsolidateLeaf(&stack, node, key.data(), static_cast<uint16_t>(key.size()));
+        ++consolidated;
+        // The stack may have been rebuilt; continue from the node's position
+        stack.Clear();
+        TraverseToLeaf(&stack, key.data(), static_cast<uint16_t>(key.size()));
+      }
+    }
+    const char *fence = nullptr;
+    uint16_t fence_size = 0;
+    node = NextLeaf(&stack, &fence, &fence_size);
+  }
+  return consolidated;
+}
+
+struct MaintenanceThread {
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stop;
+  MaintenanceThread() : stop(false) {}
+};
+
+void BzTree::StartMaintenanceThread(uint32_t interval_ms) {
+  ALWAYS_ASSERT(maintenance == nullptr);
+  auto *m = new MaintenanceThread();
+  m->thread = std::thread([this, m, interval_ms]() {
+    std::unique_lock<std::mutex> lock(m->mutex);
+    while (!m->cv.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                           [m]() { return m->stop; })) {
+      lock.unlock();
+      ConsolidateLeaves();
+      if (parameters.merge_policy == ParameterSet::MergeDeferred) {
+        MergeLeaves();
+      }
+      lock.lock();
+    }
+  });
+  maintenance = m;
+}
+
+void BzTree::StopMaintenanceThread() {
+  if (maintenance == nullptr) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(maintenance->mutex);
+    maintenance->stop = true;
+  }
+  maintenance->cv.notify_one();
+  maintenance->thread.join();
+  delete maintenance;
+  maintenance = nullptr;
+}
+
+void BzTree::ResetGarbageList() {
+  static const size_t kGarbageListSize = 64 * 1024;
+  delete garbage_list;
+  garbage_list = new pmwcas::GarbageList();
+  auto status = garbage_list->Initialize(GetPMWCASPool()->GetEpoch(), kGarbageListSize);
+  ALWAYS_ASSERT(status.ok());
+}
+
+void BzTree::RetireNode(BaseNode *node) {
+  // Readers that found [node] before it was replaced are in an epoch that
+  // the garbage list waits out before freeing it. Hints that might point to
+  // it are no longer valid.
+  ++retired_nodes;
+#ifdef PMDK
+  auto status = garbage_list->Push(Allocator::Get()->GetOffset(node), FreeNode, nullptr);
+#else
+  auto status = garbage_list->Push(node, FreeNode, nullptr);
+#endif
+  ALWAYS_ASSERT(status.ok());
+}
+
+void BzTree::RetireBlob(Blob *blob) {
+  STATS_INC(blobs_retired);
+#ifdef PMDK
+  auto status = garbage_list->Push(Allocator::Get()->GetOffset(blob), FreeNode, nullptr);
+#else
+  auto status = garbage_list->Push(blob, FreeNode, nullptr);
+#endif
+  ALWAYS_ASSERT(status.ok());
+}
+
+// Leaf a thread last got to, with its fences (the leaf's key range is (low,
+// high]), so that operations on keys in the range can skip the traversal. The
+// hint is for the tree with [tree_id]. The leaf was in the tree after
+// [retired_nodes] was read from it, so it is not retired (and freed) while the
+// count stays the same. Unless leaf hints are on, only right-most leaves are
+// remembered, by inserts.
+struct LeafHint {
+  uint64_t tree_id = 0;
+  uint64_t retired_nodes = 0;
+  LeafNode *leaf = nullptr;
+  bool has_low = false;
+  bool has_high = false;
+  std::string low;
+  std::string high;
+};
+static thread_local LeafHint leaf_hint;
+
+void BzTree::InitHints() {
+  static std::atomic<uint64_t> next_hint_id(1);
+  hint_id = next_hint_id++;
+  retired_nodes = 0;
+}
+
+LeafNode *BzTree::GetHintedLeaf(const char *key, uint16_t key_size) {
+  auto &hint = leaf_hint;
+  // A leaf is frozen before it is replaced, and the hint is no longer valid
+  // once it is retired
+  if (hint.tree_id != hint_id || hint.retired_nodes != retired_nodes.load() ||
+      (hint.has_low && BaseNode::KeyCompare(key, key_size, hint.low.data(),
+                                            static_cast<uint32_t>(hint.low.size())) <= 0) ||
+      (hint.has_high && BaseNode::KeyCompare(key, key_size, hint.high.data(),
+                                             static_cast<uint32_t>(hint.high.size())) > 0) ||
+      hint.leaf->IsFrozen()) {
+    if (parameters.leaf_hints) {
+      STATS_INC(leaf_hint_misses);
+    } else {
+      STATS_INC(append_hint_misses);
+    }
+    return nullptr;
+  }
+  if (parameters.leaf_hints) {
+    STATS_INC(leaf_hint_hits);
+  } else {
+    STATS_INC(append_hint_hits);
+  }
+  return hint.leaf;
+}
+
+void BzTree::SetLeafHint(Stack &stack, LeafNode *leaf, uint64_t retired) {
+  auto &hint = leaf_hint;
+  if (hint.tree_id == hint_id && hint.retired_nodes == retired && hint.leaf == leaf) {
+    return;
+  }
+  if (!parameters.leaf_hints) {
+    // The right-most leaf is the last child of each node on the way
+    for (uint32_t i = 0; i < stack.num_frames; ++i) {
+      auto &frame = stack.frames[i];
+      if (frame.meta_index + 1 < frame.node->GetHeader()->sorted_count) {
+        return;
+      }
+    }
+  }
+  LeafNode::GetFences(stack, &hint.low, &hint.has_low, &hint.high, &hint.has_high);
+  hint.tree_id = hint_id;
+  hint.retired_nodes = retired;
+  hint.leaf = leaf;
+}
+
+LeafNode *BzTree::FindLeaf(const char *key, uint16_t key_size) {
+  if (!parameters.leaf_hints) {
+    return TraverseToLeaf(nullptr, key, key_size);
+  }
+  LeafNode *node = GetHintedLeaf(key, key_size);
+  if (node == nullptr) {
+    thread_local Stack stack;
+    stack.tree = this;
+    stack.Clear();
+    uint64_t retired = retired_nodes.load();
+    node = TraverseToLeaf(&stack, key, key_size);
+    SetLeafHint(stack, node, retired);
+  }
+  return node;
 }
 
 bool BzTree::ChangeRoot(uint64_t expected_root_addr, uint64_t new_root_addr,
                         pmwcas::Descriptor *pd) {
   // Memory policy here is "Never" because the memory was allocated in
   // PrepareForInsert/BzTree::Insert which uses a descriptor that specifies
-  // policy RecycleOnRecovery
+  // policy RecycleNewOnFailure
   pd->AddEntry(reinterpret_cast<uint64_t *>(&root), expected_root_addr, new_root_addr,
                pmwcas::Descriptor::kRecycleNever);
-  return pd->MwCAS();
+  if (!pd->MwCAS()) {
+    return false;
+  }
+  STATS_INC(root_changes);
+  return true;
+}
+
+#if ENABLE_STATS
+Stats *BzTree::GetThreadStats() {
+  static std::atomic<uint32_t> next_slot(0);
+  thread_local uint32_t slot = next_slot++ % kMaxStatsThreads;
+  return &stats_slots[slot].stats;
+}
+#endif
+
+Stats BzTree::GetStats() {
+  Stats stats;
+#if ENABLE_STATS
+  for (uint32_t i = 0; i < kMaxStatsThreads; ++i) {
+    stats += stats_slots[i].stats;
+  }
+#endif
+  return stats;
 }
 
 ReturnCode BzTree::Read(const char *key, uint16_t key_size, uint64_t *payload) {
+  STATS_SCOPE();
+  STATS_INC(reads);
   pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
 
-  LeafNode *node = TraverseToLeaf(nullptr, key, key_size);
+  LeafNode *node = FindLeaf(key, key_size);
   if (node == nullptr) {
     return ReturnCode::NotFound();
   }
@@ -1648,80 +2893,445 @@ ReturnCode BzTree::Read(const char *key, uint16_t key_size, uint64_t *payload) {
   return rc;
 }
 
-ReturnCode BzTree::Update(const char *key, uint16_t key_size, uint64_t payload) {
-  ReturnCode rc;
+ReturnCode BzTree::ReadValue(const char *key, uint16_t key_size, std::string *value) {
+  STATS_SCOPE();
+  STATS_INC(reads);
   pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
-  do {
-    LeafNode *node = TraverseToLeaf(nullptr, key, key_size, GetPMWCASPool());
-    if (node == nullptr) {
-      return ReturnCode::NotFound();
+
+  LeafNode *node = FindLeaf(key, key_size);
+  if (node == nullptr) {
+    return ReturnCode::NotFound();
+  }
+  return node->ReadValue(key, key_size, value, GetPMWCASPool());
+}
+
+uint32_t BzTree::MultiRead(const char *const *keys, const uint16_t *key_sizes, uint32_t n,
+                           uint64_t *payloads, ReturnCode *rcs) {
+  STATS_SCOPE();
+  auto *pool = GetPMWCASPool();
+  auto *epoch = pool->GetEpoch();
+  pmwcas::EpochGuard guard(epoch);
+  BaseNode *root_node = GetRootNodeSafe();
+
+  uint32_t found = 0;
+  BaseNode *nodes[kMultiReadGroupSize];
+  for (uint32_t begin = 0; begin < n; begin += kMultiReadGroupSize) {
+    uint32_t group_size = n - begin < kMultiReadGroupSize ? n - begin : kMultiReadGroupSize;
+    const char *const *group_keys = keys + begin;
+    const uint16_t *group_key_sizes = key_sizes + begin;
+    for (uint32_t i = 0; i < group_size; ++i) {
+      nodes[i] = root_node;
     }
-    rc = node->Update(key, key_size, payload, GetPMWCASPool());
-  } while (rc.IsPMWCASFailure());
+
+    // Move each key of the group down by one level per pass, prefetching the
+    // node it lands on; by the time the next pass reads that node, the
+    // prefetches for the rest of the group have been issued as well. Adjacent
+    // keys often land on the same node, which is then prefetched only once.
+    bool descended = true;
+    while (descended) {
+      descended = false;
+      for (uint32_t i = 0; i < group_size; ++i) {
+        if (nodes[i]->IsLeaf()) {
+          continue;
+        }
+        auto *parent = reinterpret_cast<InternalNode *>(nodes[i]);
+        auto meta_index = parent->GetChildIndex(group_keys[i], group_key_sizes[i]);
+        nodes[i] = parent->GetChildByMetaIndex(meta_index, epoch);
+        if (i == 0 || nodes[i] != nodes[i - 1]) {
+          PrefetchNode(nodes[i], kLookupPrefetchSize);
+        }
+        descended = true;
+      }
+    }
+
+    for (uint32_t i = 0; i < group_size; ++i) {
+      STATS_INC(reads);
+      uint64_t payload = 0;
+      auto &rc = rcs[begin + i];
+      rc = reinterpret_cast<LeafNode *>(nodes[i])->Read(group_keys[i], group_key_sizes[i],
+                                                        &payload, pool);
+      if (rc.IsOk()) {
+        payloads[begin + i] = payload;
+        ++found;
+      }
+    }
+  }
+  return found;
+}
+
+void BzTree::EncodeIntegerKeys(const uint64_t *keys, uint32_t n,
+                               const char *const **key_ptrs, const uint16_t **key_sizes) {
+  thread_local std::vector<uint64_t> encoded_keys;
+  thread_local std::vector<const char *> ptrs;
+  thread_local std::vector<uint16_t> sizes;
+  encoded_keys.resize(n);
+  ptrs.resize(n);
+  sizes.assign(n, IntegerKey::GetSize());
+  for (uint32_t i = 0; i < n; ++i) {
+    encoded_keys[i] = IntegerKey(keys[i]).encoded;
+    ptrs[i] = reinterpret_cast<const char *>(&encoded_keys[i]);
+  }
+  *key_ptrs = ptrs.data();
+  *key_sizes = sizes.data();
+}
+
+uint32_t BzTree::MultiRead(const uint64_t *keys, uint32_t n, uint64_t *payloads,
+                           ReturnCode *rcs) {
+  const char *const *key_ptrs = nullptr;
+  const uint16_t *key_sizes = nullptr;
+  EncodeIntegerKeys(keys, n, &key_ptrs, &key_sizes);
+  return MultiRead(key_ptrs, key_sizes, n, payloads, rcs);
+}
+
+inline bool BzTree::StepRead(ReadLookup *lookup, uint64_t *payload, ReturnCode *rc) {
+  if (lookup->node->IsLeaf()) {
+    STATS_INC(reads);
+    *rc = reinterpret_cast<LeafNode *>(lookup->node)->Read(lookup->key, lookup->key_size,
+                                                           payload, GetPMWCASPool());
+    return true;
+  }
+  auto *parent = reinterpret_cast<InternalNode *>(lookup->node);
+  auto meta_index = parent->GetChildIndex(lookup->key, lookup->key_size);
+  lookup->node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
+  PrefetchNode(lookup->node, kLookupPrefetchSize);
+  return false;
+}
+
+uint32_t BzTree::InterleavedRead(const char *const *keys, const uint16_t *key_sizes, uint32_t n,
+                                 uint64_t *payloads, ReturnCode *rcs, uint32_t inflight) {
+  ALWAYS_ASSERT(inflight > 0 && inflight <= kMaxInflightReads);
+  STATS_SCOPE();
+  pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+  BaseNode *root_node = GetRootNodeSafe();
+
+  // Slots [0, active) hold the lookups in flight; a finished lookup's slot
+  // takes the next key, or the last active lookup once all keys are started
+  ReadLookup lookups[kMaxInflightReads];
+  uint32_t active = 0;
+  uint32_t next = 0;
+  uint32_t found = 0;
+  while (active < inflight && next < n) {
+    lookups[active++] = ReadLookup{next, keys[next], key_sizes[next], root_node};
+    ++next;
+  }
+  while (active > 0) {
+    for (uint32_t i = 0; i < active;) {
+      auto &lookup = lookups[i];
+      uint64_t payload = 0;
+      auto &rc = rcs[lookup.index];
+      if (!StepRead(&lookup, &payload, &rc)) {
+        ++i;
+        continue;
+      }
+      if (rc.IsOk()) {
+        payloads[lookup.index] = payload;
+        ++found;
+      }
+      if (next < n) {
+        lookup = ReadLookup{next, keys[next], key_sizes[next], root_node};
+        ++next;
+        ++i;
+      } else {
+        lookup = lookups[--active];
+      }
+    }
+  }
+  return found;
+}
+
+uint32_t BzTree::InterleavedRead(const uint64_t *keys, uint32_t n, uint64_t *payloads,
+                                 ReturnCode *rcs, uint32_t inflight) {
+  const char *const *key_ptrs = nullptr;
+  const uint16_t *key_sizes = nullptr;
+  EncodeIntegerKeys(keys, n, &key_ptrs, &key_sizes);
+  return InterleavedRead(key_ptrs, key_sizes, n, payloads, rcs, inflight);
+}
+
+ReturnCode BzTree::Update(const char *key, uint16_t key_size, uint64_t payload) {
+  STATS_SCOPE();
+  STATS_INC(updates);
+  ReturnCode rc;
+  {
+    pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+    do {
+      LeafNode *node = FindLeaf(key, key_size);
+      if (node == nullptr) {
+        return ReturnCode::NotFound();
+      }
+      rc = node->Update(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
+    } while (rc.IsPMWCASFailure());
+  }
+  if (rc.IsNotEnoughSpace() || rc.IsNodeFrozen()) {
+    // A new version of the record does not fit, or the leaf is being
+    // replaced: wait for the leaf or split it like Insert
+    rc = InsertRecord(key, key_size, payload, nullptr, 0, false, UpdateOp);
+  }
   return rc;
 }
 
 ReturnCode BzTree::Upsert(const char *key, uint16_t key_size, uint64_t payload) {
-  pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+  STATS_SCOPE();
+  STATS_INC(upserts);
+  uint64_t freeze_retry = 0;
+  Backoff wait = parameters.NewBackoff();
+  while (true) {
+    ReturnCode rc;
+    {
+      pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+      LeafNode *node = FindLeaf(key, key_size);
+      rc = node->Upsert(key, key_size, payload, GetPMWCASPool(), parameters.split_threshold);
+    }
+    if (rc.IsNodeFrozen() && ++freeze_retry <= parameters.max_freeze_retry) {
+      STATS_INC(frozen_retries);
+      wait.Wait();
+      continue;
+    }
+    if (!rc.IsNotEnoughSpace() && !rc.IsNodeFrozen()) {
+      return rc;
+    }
 
-  LeafNode *node = TraverseToLeaf(nullptr, key, key_size, GetPMWCASPool());
-  // FIXME(tzwang): be more clever here to get the node this record would be
-  // landing in?
-  if (node == nullptr) {
-    return Insert(key, key_size, payload);
+    // The leaf is full, or stays frozen: split it (or take over the split)
+    // like Insert and upsert the key
+    STATS_INC(inserts);
+    return InsertRecord(key, key_size, payload, nullptr, 0, false, UpsertOp);
   }
-  uint64_t tmp_payload;
-  auto rc = node->Read(key, key_size, &tmp_payload, GetPMWCASPool());
-  if (rc.IsNotFound()) {
-    return Insert(key, key_size, payload);
-  } else if (rc.IsOk()) {
-    if (tmp_payload == payload) {
-      return ReturnCode::Ok();
+}
+
+ReturnCode BzTree::ReadModifyWrite(const char *key, uint16_t key_size,
+                                   const PayloadModifier &modify, uint64_t *old_payload) {
+  STATS_SCOPE();
+  STATS_INC(read_modify_writes);
+  uint64_t unused = 0;
+  if (old_payload == nullptr) {
+    old_payload = &unused;
+  }
+  ReturnCode rc;
+  {
+    pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
+    LeafNode *node = FindLeaf(key, key_size);
+    if (node == nullptr) {
+      return ReturnCode::NotFound();
     }
-    return Update(key, key_size, payload);
-  } else {
-    return rc;
+    rc = node->ReadModifyWrite(key, key_size, modify, old_payload, GetPMWCASPool(),
+                               parameters.split_threshold);
   }
+  if (rc.IsNotEnoughSpace() || rc.IsNodeFrozen()) {
+    // Like Update; [modify] sees the payload again. The new payload is not
+    // known yet, so size the record for one that needs the overflow word
+    rc = InsertRecord(key, key_size, LeafNode::kOverflowPayload, nullptr, 0, false, ModifyOp,
+                      &modify, old_payload);
+  }
+  return rc;
+}
+
+ReturnCode BzTree::CompareAndSwap(const char *key, uint16_t key_size, uint64_t expected,
+                                  uint64_t desired, uint64_t *actual) {
+  uint64_t found = 0;
+  auto rc = ReadModifyWrite(key, key_size, [expected, desired](uint64_t *payload) {
+    if (*payload != expected) {
+      return false;
+    }
+    *payload = desired;
+    return true;
+  }, &found);
+  if (actual) {
+    *actual = found;
+  }
+  if (rc.IsOk() && found != expected) {
+    return ReturnCode::PMWCASFailure();
+  }
+  return rc;
+}
+
+ReturnCode BzTree::FetchAdd(const char *key, uint16_t key_size, uint64_t delta,
+                            uint64_t *old_payload) {
+  return ReadModifyWrite(key, key_size, [delta](uint64_t *payload) {
+    *payload += delta;
+    return true;
+  }, old_payload);
 }
 
 ReturnCode BzTree::Delete(const char *key, uint16_t key_size) {
+  STATS_SCOPE();
+  STATS_INC(deletes);
   thread_local Stack stack;
   stack.tree = this;
   ReturnCode rc;
   auto *epoch = GetPMWCASPool()->GetEpoch();
   pmwcas::EpochGuard guard(epoch);
   LeafNode *node;
+  // Only merging needs the path to the leaf
+  bool merge = parameters.merge_policy == ParameterSet::MergeOnDelete;
+  uint64_t freeze_retry = 0;
+  Backoff wait = parameters.NewBackoff();
   do {
     stack.Clear();
-    node = TraverseToLeaf(nullptr, key, key_size, GetPMWCASPool());
+    node = merge ? TraverseToLeaf(&stack, key, key_size) : FindLeaf(key, key_size);
     if (node == nullptr) {
       return ReturnCode::NotFound();
     }
-    rc = node->Delete(key, key_size, GetPMWCASPool());
+    Blob *old_blob = nullptr;
+    rc = node->Delete(key, key_size, GetPMWCASPool(), &old_blob);
+    if (old_blob) {
+      RetireBlob(old_blob);
+    }
+    if (rc.IsNodeFrozen()) {
+      STATS_INC(frozen_retries);
+      if (++freeze_retry > parameters.max_freeze_retry) {
+        // Whoever froze the leaf may have given up replacing it, e.g., a merge
+        // that went on with the other sibling; compact it ourselves
+        stack.Clear();
+        if (TraverseToLeaf(&stack, key, key_size) == node) {
+          ConsolidateLeaf(&stack, node, key, key_size);
+        }
+      }
+      wait.Wait();
+    }
   } while (rc.IsNodeFrozen());
 
-  if (!rc.IsOk() || ENABLE_MERGE == 0) {
+  if (!rc.IsOk() || !merge) {
     // delete failed
     return rc;
   }
 
   // finished record delete, now check if we can merge siblings
+  return MergeLeaf(&stack, node, key, key_size);
+}
+
+ReturnCode BzTree::MergeLeaf(Stack *stack, LeafNode *node, const char *key, uint16_t key_size) {
   uint32_t freeze_retry = 0;
+  Backoff wait = parameters.NewBackoff();
+  ReturnCode rc;
   do {
-    rc = node->CheckMerge(&stack, key, key_size, freeze_retry < MAX_FREEZE_RETRY);
+    rc = node->CheckMerge(stack, key, key_size, freeze_retry < parameters.max_freeze_retry);
     if (rc.IsOk()) {
       return rc;
     }
-    stack.Clear();
-    node = TraverseToLeaf(&stack, key, key_size, GetPMWCASPool());
     if (rc.IsNodeFrozen()) {
       freeze_retry += 1;
+      wait.Wait();
     }
+    stack->Clear();
+    node = TraverseToLeaf(stack, key, key_size);
   } while (rc.IsNodeFrozen() || rc.IsPMWCASFailure());
   ALWAYS_ASSERT(false);
   return rc;  // Just to silence the compiler
 }
 
+uint32_t BzTree::MergeLeaves() {
+  STATS_SCOPE();
+  uint32_t merge_threshold = parameters.merge_threshold;
+  thread_local Stack stack;
+  stack.tree = this;
+  stack.Clear();
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  pmwcas::EpochGuard guard(epoch);
+
+  // A leaf may have no records left, so it is found again by the smallest key
+  // in its range, i.e., the separator to its left followed by a zero byte
+  uint32_t merged = 0;
+  std::string key;
+  LeafNode *node = TraverseToLeaf(&stack, "", 0);
+  while (node) {
+    auto status = node->GetHeader()->GetStatus();
+    if (LeafNode::GetUsedSpace(status) - status.GetDeletedSize() < merge_threshold) {
+      MergeLeaf(&stack, node, key.data(), static_cast<uint16_t>(key.size()));
+      ++merged;
+      // The stack may have been rebuilt; continue from the node's position
+      stack.Clear();
+      TraverseToLeaf(&stack, key.data(), static_cast<uint16_t>(key.size()));
+    }
+    const char *fence = nullptr;
+    uint16_t fence_size = 0;
+    node = NextLeaf(&stack, &fence, &fence_size);
+    if (node) {
+      key.assign(fence, fence_size);
+      key.push_back('\0');
+    }
+  }
+  return merged;
+}
+
+uint32_t BzTree::ScanRange(const char *begin_key, uint16_t begin_size, bool include_begin,
+                           const char *end_key, uint16_t end_size,
+                           uint32_t count, const ScanVisitor &visitor) {
+  STATS_SCOPE();
+  // Iterators continue a scan with [include_begin] false, so it counts once
+  if (include_begin) {
+    STATS_INC(scans);
+  }
+  // The visitor may start another scan, so nothing that is in use while it
+  // runs is per-thread
+  Stack stack;
+  stack.tree = this;
+  stack.Clear();
+  LeafNode::ScanBuffers buffers;
+  auto *epoch = GetPMWCASPool()->GetEpoch();
+  pmwcas::EpochGuard guard(epoch);
+
+  const char *key = begin_key;
+  uint16_t key_size = begin_size;
+  bool include_key = include_begin;
+  uint32_t scanned = 0;
+  LeafNode *node = TraverseToLeaf(&stack, key, key_size);
+  while (scanned < count) {
+    bool done = false;
+    scanned += node->Scan(key, key_size, include_key, end_key, end_size,
+                          count - scanned, visitor, &done, &buffers, epoch);
+    if (done) {
+      break;
+    }
+
+    // Continue right after this leaf's upper bound
+    node = NextLeaf(&stack, &key, &key_size);
+    if (node == nullptr) {
+      break;
+    }
+    include_key = false;
+    if (end_key && BaseNode::KeyCompare(key, key_size, end_key, end_size) >= 0) {
+      break;
+    }
+  }
+  return scanned;
+}
+
+LeafNode *BzTree::NextLeaf(Stack *stack, const char **fence, uint16_t *fence_size) {
+  // The upper bound of the leaf is the separator to the right of it in the
+  // nearest ancestor that has one; none means this is the right-most leaf
+  Stack::Frame *frame = stack->Pop();
+  while (frame && frame->meta_index + 1 >= frame->node->GetHeader()->sorted_count) {
+    frame = stack->Pop();
+  }
+  if (frame == nullptr) {
+    return nullptr;
+  }
+  InternalNode *parent = frame->node;
+  uint32_t meta_index = frame->meta_index + 1;
+  parent->GetFullKey(parent->GetMetadata(meta_index), &stack->fence);
+  *fence = stack->fence.data();
+  *fence_size = static_cast<uint16_t>(stack->fence.size());
+
+  // Children of a node that is not frozen are up to date, so the next leaf is
+  // the left-most one under the child to the right of the separator
+  while (!parent->IsFrozen()) {
+    stack->Push(parent, meta_index);
+    BaseNode *node = parent->GetChildByMetaIndex(meta_index, GetPMWCASPool()->GetEpoch());
+    if (node->IsLeaf()) {
+      if (!node->IsFrozen()) {
+        return reinterpret_cast<LeafNode *>(node);
+      }
+      break;
+    }
+    parent = reinterpret_cast<InternalNode *>(node);
+    meta_index = 0;
+  }
+
+  // Raced with a split or consolidation; find the leaf with the smallest keys
+  // greater than the separator from the root
+  stack->Clear();
+  return TraverseToLeaf(stack, *fence, *fence_size, false);
+}
+
 void BzTree::Dump() {
   std::cout << "-----------------------------" << std::endl;
   std::cout << "Dumping tree with root node: " << root << std::endl;
@@ -7,9 +7,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <list>
+#include <string>
 #include <vector>
 #include <memory>
 #include <optional>
+#include <functional>
 
 #include <pmwcas.h>
 #include <mwcas/mwcas.h>
@@ -69,12 +73,16 @@ struct ReturnCode {
 
 struct NodeHeader {
   // Header:
-  // |-------64 bits-------|---32 bits---|---32 bits---|
-  // |     status word     |     size    | sorted count|
+  // |-------64 bits-------|---32 bits---|---32 bits---|---32 bits---|
+  // |     status word     |     size    | sorted count| prefix size |
   //
   // Sorted count is actually the index into the first metadata entry for
   // unsorted records. Following the header is a growing array of record metadata
   // entries.
+  //
+  // All keys in a node may share a prefix, which the node then stores once at
+  // its end (padded to 8 bytes); records only keep the rest of their keys.
+  // Prefix size is 0 for nodes that store full keys.
 
   // 64-bit status word subdivided into five fields. Internal nodes only use the
   // first two (control and frozen) while leaf nodes use all the five.
@@ -116,7 +124,8 @@ struct NodeHeader {
   uint32_t size;
   StatusWord status;
   uint32_t sorted_count;
-  NodeHeader() : size(0), sorted_count(0) {}
+  uint32_t prefix_size;
+  NodeHeader() : size(0), sorted_count(0), prefix_size(0) {}
   inline StatusWord GetStatus() {
     auto status_val = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
         &this->status.word)->GetValueProtected();
@@ -129,16 +138,29 @@ struct RecordMetadata {
   RecordMetadata() : meta(0) {}
   explicit RecordMetadata(uint64_t meta) : meta(meta) {}
 
+  // Metadata of a finalized record. Records are blocks of 8-byte words: the
+  // padded key, the payload (a PMwCAS target) and, in leaves, an optional
+  // value padded to words whose size is the payload, or the address of a Blob
+  // if the value is longer than that. The total length is kept
+  // in words, which leaves the low byte for a fingerprint of the key. The
+  // offset is bounded by the block size in the status word.
   static const uint64_t kControlMask = uint64_t{0x7} << 61;           // Bits 64-62
   static const uint64_t kVisibleMask = uint64_t{0x1} << 60;           // Bit 61
-  static const uint64_t kOffsetMask = uint64_t{0xFFFFFFF} << 32;      // Bits 60-33
-  static const uint64_t kKeyLengthMask = uint64_t{0xFFFF} << 16;      // Bits 32-17
-  static const uint64_t kTotalLengthMask = uint64_t{0xFFFF};          // Bits 16-1
+  static const uint64_t kOffsetMask = uint64_t{0x3FFFFF} << 37;       // Bits 59-38
+  static const uint64_t kKeyLengthMask = uint64_t{0xFFFF} << 21;      // Bits 37-22
+  static const uint64_t kTotalLengthMask = uint64_t{0x1FFF} << 8;     // Bits 21-9
+  static const uint64_t kFingerprintMask = uint64_t{0xFF};            // Bits 8-1
+
+  // Longest record the total length can describe (65528 bytes)
+  static const uint32_t kMaxTotalLength = (kTotalLengthMask >> 8) * sizeof(uint64_t);
 
+  // Metadata of a record being inserted: a flag in place of the high-order bit
+  // of the offset, and the allocation epoch used for recovery.
+  static const uint64_t kAllocationFlag = uint64_t{0x1} << 59;             // Bit 60
   static const uint64_t kAllocationEpochMask = uint64_t{0x7FFFFFF} << 32;  // Bit 59-33
 
   inline bool IsVacant() { return meta == 0; }
-  inline uint16_t GetKeyLength() const { return (uint16_t) ((meta & kKeyLengthMask) >> 16); }
+  inline uint16_t GetKeyLength() const { return (uint16_t) ((meta & kKeyLengthMask) >> 21); }
 
   // Get the padded key length from accurate key length
   inline uint16_t GetPaddedKeyLength() {
@@ -149,13 +171,42 @@ struct RecordMetadata {
   static inline constexpr uint16_t PadKeyLength(uint16_t key_length) {
     return (key_length + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
   }
-  inline uint16_t GetTotalLength() { return (uint16_t) (meta & kTotalLengthMask); }
-  inline uint32_t GetOffset() { return (uint32_t) ((meta & kOffsetMask) >> 32); }
+  inline uint16_t GetTotalLength() {
+    return (uint16_t) (((meta & kTotalLengthMask) >> 8) * sizeof(uint64_t));
+  }
+  // Length of the value after the payload, 0 if the record has none
+  inline uint16_t GetPaddedValueLength() {
+    return (uint16_t) (GetTotalLength() - GetPaddedKeyLength() - sizeof(uint64_t));
+  }
+  // Values take at least one word, so that records with a value are longer
+  // than those with just a payload
+  static inline constexpr uint32_t PadValueLength(uint32_t value_size) {
+    return value_size == 0 ? sizeof(uint64_t) :
+           (value_size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+  }
+  inline uint32_t GetOffset() { return (uint32_t) ((meta & kOffsetMask) >> 37); }
   inline bool OffsetIsEpoch() {
-    return (GetOffset() >> 27) == 1;
+    return (meta & kAllocationFlag) > 0;
   }
-  inline void SetOffset(uint32_t offset) {
-    meta = (meta & (~kOffsetMask)) | (uint64_t{offset} << 32);
+  inline uint8_t GetFingerprint() { return (uint8_t) (meta & kFingerprintMask); }
+
+  // One-byte hash of a key, kept in the metadata of records appended to the
+  // unsorted field so that a linear search only reads keys that likely match.
+  static inline uint8_t Fingerprint(const char *key, uint32_t key_size) {
+    static const uint64_t kMultiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = key_size;
+    uint32_t i = 0;
+    for (; i + sizeof(uint64_t) <= key_size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, key + i, sizeof(uint64_t));
+      hash = (hash ^ word) * kMultiplier;
+    }
+    if (i < key_size) {
+      uint64_t word = 0;
+      memcpy(&word, key + i, key_size - i);
+      hash = (hash ^ word) * kMultiplier;
+    }
+    return (uint8_t) (hash >> 56);
   }
   inline bool IsVisible() { return (meta & kVisibleMask) > 0; }
   inline void SetVisible(bool visible) {
@@ -175,19 +226,25 @@ struct RecordMetadata {
     // Flip the high order bit of [offset] to indicate this field contains an
     // allocation epoch and fill in the rest offset bits with global epoch
     assert(global_epoch < (uint64_t{1} << 27));
-    meta = (uint64_t{1} << 59) | (global_epoch << 32);
+    meta = kAllocationFlag | (global_epoch << 32);
     assert(IsInserting());
   }
-  inline void FinalizeForInsert(uint64_t offset, uint64_t key_len, uint64_t total_len) {
+  inline void FinalizeForInsert(uint64_t offset, uint64_t key_len, uint64_t total_len,
+                                uint8_t fingerprint = 0) {
+    assert(offset <= (kOffsetMask >> 37));
+    assert(total_len % sizeof(uint64_t) == 0);
     // Set the actual offset, the visible bit, key/total length
     if (offset == 0) {
       // this record is duplicate inserted
       // make it invisible
-      meta = (offset << 32) | (uint64_t{0} << 60) | (key_len << 16) | total_len;
+      meta = (offset << 37) | (uint64_t{0} << 60) | (key_len << 21) |
+          ((total_len / sizeof(uint64_t)) << 8) | fingerprint;
     } else {
-      meta = (offset << 32) | kVisibleMask | (key_len << 16) | total_len;
+      meta = (offset << 37) | kVisibleMask | (key_len << 21) |
+          ((total_len / sizeof(uint64_t)) << 8) | fingerprint;
     }
     assert(GetKeyLength() == key_len);
+    assert(GetTotalLength() == total_len);
   }
   inline bool IsInserting() {
     // record is not visible
@@ -197,15 +254,99 @@ struct RecordMetadata {
   }
 };
 
-static const inline int my_memcmp(const char *key1, const char *key2, uint32_t size) {
-  for (uint32_t i = 0; i < size; i++) {
-    if (key1[i] != key2[i]) {
-      return key1[i] - key2[i];
+// Compare two byte strings in unsigned lexicographic order, i.e., the same
+// order as memcmp, eight bytes at a time. Used for short keys where calling
+// into memcmp costs more than the comparison itself.
+static inline int my_memcmp(const char *key1, const char *key2, uint32_t size) {
+  auto compare_word = [](const char *p1, const char *p2) -> int {
+    uint64_t w1, w2;
+    memcpy(&w1, p1, sizeof(uint64_t));
+    memcpy(&w2, p2, sizeof(uint64_t));
+    if (w1 == w2) {
+      return 0;
+    }
+    // Byte-swap so the first differing byte becomes the most significant one
+    w1 = __builtin_bswap64(w1);
+    w2 = __builtin_bswap64(w2);
+    return w1 < w2 ? -1 : 1;
+  };
+
+  if (size < sizeof(uint64_t)) {
+    for (uint32_t i = 0; i < size; i++) {
+      auto b1 = static_cast<uint8_t>(key1[i]);
+      auto b2 = static_cast<uint8_t>(key2[i]);
+      if (b1 != b2) {
+        return b1 < b2 ? -1 : 1;
+      }
+    }
+    return 0;
+  }
+
+  uint32_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    int cmp = compare_word(key1 + i, key2 + i);
+    if (cmp) {
+      return cmp;
     }
   }
-  return 0;
+  if (i == size) {
+    return 0;
+  }
+  // Compare the remaining bytes by re-reading the last full word; the bytes
+  // it overlaps with are known to be equal
+  return compare_word(key1 + size - sizeof(uint64_t), key2 + size - sizeof(uint64_t));
+}
+
+// Copy bytes [begin, end) of a key made of [prefix] followed by [suffix] to
+// [dst], e.g., to put a key stored in a node back together with the node's
+// prefix
+static inline void CopyKeyRange(char *dst, const char *prefix, uint32_t prefix_size,
+                                const char *suffix, uint32_t begin, uint32_t end) {
+  if (begin < prefix_size) {
+    uint32_t size = (end < prefix_size ? end : prefix_size) - begin;
+    memcpy(dst, prefix + begin, size);
+    dst += size;
+    begin += size;
+  }
+  if (begin < end) {
+    memcpy(dst, suffix + begin - prefix_size, end - begin);
+  }
 }
 
+// Fixed-width 8-byte integer key. Integers are stored in big-endian byte order
+// so that the byte-wise key order is the same as the integer order, and nodes
+// can compare 8-byte keys directly as integers (see InternalNode::GetChildIndex).
+struct IntegerKey {
+  uint64_t encoded;
+
+  explicit IntegerKey(uint64_t key) : encoded(__builtin_bswap64(key)) {}
+  inline const char *GetData() const { return reinterpret_cast<const char *>(&encoded); }
+  static constexpr uint16_t GetSize() { return sizeof(uint64_t); }
+
+  // Decode an 8-byte key stored in a node (or returned by a scan)
+  static inline uint64_t Decode(const char *key) {
+    uint64_t encoded;
+    memcpy(&encoded, key, sizeof(uint64_t));
+    return __builtin_bswap64(encoded);
+  }
+};
+
+// Bounded exponential backoff for a thread that waits on a node frozen (or
+// being changed) by another thread: each wait spins for twice as many pause
+// instructions as the previous one, up to [max_pause]. From then on waits
+// yield the CPU instead if [yield] is set. With [max_pause] 0 waits return
+// right away.
+class Backoff {
+ public:
+  Backoff(uint32_t max_pause, bool yield) : max_pause(max_pause), yield(yield), pause(1) {}
+  void Wait();
+
+ private:
+  uint32_t max_pause;
+  bool yield;
+  uint32_t pause;
+};
+
 class Stack;
 class BaseNode {
  protected:
@@ -241,6 +382,9 @@ class BaseNode {
     } else if (!key2) {
       return 1;
     }
+    // Short keys use the inlined word-at-a-time comparison; longer keys go to
+    // memcmp, which glibc dispatches at runtime to the best SSE/AVX2 variant
+    // for this CPU. Both order keys as unsigned bytes.
     int cmp;
     if (std::min(size1, size2) < 16) {
       cmp = my_memcmp(key1, key2, std::min<uint32_t>(size1, size2));
@@ -252,8 +396,63 @@ class BaseNode {
     }
     return cmp;
   }
+
+  // Number of leading bytes, in whole words and up to [max_size], that
+  // [key1] and [key2] have in common
+  static inline uint32_t GetCommonPrefixSize(const char *key1, const char *key2,
+                                             uint32_t max_size) {
+    uint32_t size = 0;
+    while (size + sizeof(uint64_t) <= max_size &&
+        memcmp(key1 + size, key2 + size, sizeof(uint64_t)) == 0) {
+      size += sizeof(uint64_t);
+    }
+    return size;
+  }
+
+  // Size of the prefix a node can store once for keys that are all in
+  // [first, last]. Keys in between start with the common prefix of the two;
+  // it is kept shorter than [first] so that no key is left empty without it.
+  static inline uint32_t ChoosePrefixSize(const char *first, uint32_t first_size,
+                                          const char *last, uint32_t last_size) {
+    if (first_size == 0) {
+      return 0;
+    }
+    uint32_t max_size = first_size - 1 < last_size ? first_size - 1 : last_size;
+    return GetCommonPrefixSize(first, last, max_size);
+  }
+
+  inline char *GetPrefix() {
+    return reinterpret_cast<char *>(this) + header.size -
+        RecordMetadata::PadKeyLength(header.prefix_size);
+  }
+  inline uint32_t GetPrefixSize() { return header.prefix_size; }
+
+  // Copy bytes [begin, end) of the full key of a record, i.e., this node's
+  // prefix followed by [key] as stored in the record, to [dst]
+  inline void CopyKey(char *dst, const char *key, uint32_t begin, uint32_t end) {
+    CopyKeyRange(dst, GetPrefix(), header.prefix_size, key, begin, end);
+  }
+  inline void GetFullKey(RecordMetadata meta, std::string *key) {
+    key->resize(header.prefix_size + meta.GetKeyLength());
+    CopyKey(&(*key)[0], GetKey(meta), 0, static_cast<uint32_t>(key->size()));
+  }
+
+  // Keys passed to a node are in its key range, so they start with its
+  // prefix; move [*key] past it
+  template <class Size>
+  inline void StripPrefix(const char **key, Size *key_size) {
+    assert(*key_size >= header.prefix_size &&
+        memcmp(*key, GetPrefix(), header.prefix_size) == 0);
+    *key += header.prefix_size;
+    *key_size -= header.prefix_size;
+  }
+
   // Set the frozen bit to prevent future modifications to the node
   bool Freeze(pmwcas::DescriptorPool *pmwcas_pool);
+  // Freeze the node unless another thread does first, waiting with [backoff]
+  // after attempts that fail on concurrent changes to the node; returns true
+  // if this thread froze the node
+  bool Freeze(pmwcas::DescriptorPool *pmwcas_pool, Backoff *backoff);
   inline RecordMetadata GetMetadata(uint32_t i) {
     // ensure the metadata is installed
     auto meta = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
@@ -324,6 +523,14 @@ class BaseNode {
   ReturnCode CheckMerge(Stack *stack, const char *key, uint32_t key_size, bool backoff);
 };
 
+// A child node to be installed in a new internal node during bulk loading,
+// along with the largest key in the child's subtree
+struct BulkLoadEntry {
+  const char *key;
+  uint16_t key_size;
+  uint64_t child_addr;
+};
+
 // Internal node: immutable once created, no free space, keys are always sorted
 // operations that might mutate the InternalNode:
 //    a. create a new node, this will set the freeze bit in status
@@ -343,17 +550,37 @@ class InternalNode : public BaseNode {
                   uint64_t left_child_addr, uint64_t right_child_addr,
                   InternalNode **mem,
                   uint64_t left_most_child_addr);
-  static void New(InternalNode **mem, uint32_t node_size);
-
-  InternalNode(uint32_t node_size, const char *key, uint16_t key_size,
-               uint64_t left_child_addr, uint64_t right_child_addr);
-  InternalNode(uint32_t node_size, InternalNode *src_node,
-               uint32_t begin_meta_idx, uint32_t nr_records,
-               const char *key, uint16_t key_size,
-               uint64_t left_child_addr, uint64_t right_child_addr,
-               uint64_t left_most_child_addr = 0);
+  static void New(std::vector<BulkLoadEntry>::iterator begin_it,
+                  std::vector<BulkLoadEntry>::iterator end_it,
+                  InternalNode **mem);
+
+  // A record of a node being built: a separator key, made of two parts that
+  // are concatenated (e.g., the prefix of a node and the rest of a key stored
+  // in it), and the child to the right of it. The first record has no key.
+  struct BuildRecord {
+    const char *prefix;
+    uint16_t prefix_size;
+    const char *suffix;
+    uint16_t suffix_size;
+    uint64_t child_addr;
+
+    inline uint32_t GetKeySize() const { return prefix_size + suffix_size; }
+    inline void CopyKey(char *dst, uint32_t begin, uint32_t end) const {
+      CopyKeyRange(dst, prefix, prefix_size, suffix, begin, end);
+    }
+  };
+
+  // Allocate a node holding [records], which are in key order, in [*mem] (a
+  // PMDK offset under PMDK). The common prefix of the keys is stored once.
+  static void New(const std::vector<BuildRecord> &records, InternalNode **mem);
+
+  InternalNode(uint32_t node_size, const std::vector<BuildRecord> &records,
+               const char *prefix, uint32_t prefix_size);
   ~InternalNode() = default;
 
+  // Append the records in [begin, end) of this node to [records]
+  void GetBuildRecords(uint32_t begin, uint32_t end, std::vector<BuildRecord> *records);
+
   bool PrepareForSplit(Stack &stack, uint32_t split_threshold,
                        const char *key, uint32_t key_size,
                        uint64_t left_child_addr, uint64_t right_child_addr,
@@ -366,8 +593,27 @@ class InternalNode : public BaseNode {
   }
   ReturnCode Update(RecordMetadata meta, InternalNode *old_child, InternalNode *new_child,
                     pmwcas::Descriptor *pd, pmwcas::DescriptorPool *pmwcas_pool);
+  // Like BaseNode::Freeze, but only while the node still points to [child] at
+  // [meta_index]; returns false as well once [child] has been replaced
+  bool FreezeWithChild(uint32_t meta_index, BaseNode *child,
+                       pmwcas::DescriptorPool *pmwcas_pool, Backoff *backoff);
   uint32_t GetChildIndex(const char *key, uint16_t key_size, bool get_le = true);
 
+  // Internal nodes keep a normalized prefix of each key as stored in the node
+  // (i.e., without the node's prefix), that is, its first eight bytes
+  // zero-padded and read as a big-endian integer, in an array following
+  // the record metadata. A search compares prefixes in contiguous memory and
+  // only reads the key itself when two prefixes are equal.
+  static const uint32_t kKeyPrefixSize = sizeof(uint64_t);
+  static inline uint64_t GetKeyPrefix(const char *key, uint32_t key_size) {
+    uint64_t prefix = 0;
+    memcpy(&prefix, key, key_size < kKeyPrefixSize ? key_size : kKeyPrefixSize);
+    return __builtin_bswap64(prefix);
+  }
+  inline uint64_t *GetKeyPrefixes() {
+    return reinterpret_cast<uint64_t *>(record_metadata + header.sorted_count);
+  }
+
   // epoch here is required: record ptr might be a desc due to UPDATE operation
   // but record_metadata don't need a epoch
   inline BaseNode *GetChildByMetaIndex(uint32_t index, pmwcas::EpochManager *epoch) {
@@ -392,6 +638,15 @@ class InternalNode : public BaseNode {
 
   static bool MergeNodes(InternalNode *left_node, InternalNode *right_node,
                          const char *key, uint32_t key_size, InternalNode **new_node);
+
+ private:
+  // Fill in the key prefix array once all records are in place
+  void BuildKeyPrefixes();
+
+  // Binary search for the child to follow; [compare] compares the search key
+  // with the key of the record at the given index
+  template <class Compare>
+  uint32_t SearchChildIndex(Compare compare, bool get_le);
 };
 
 class LeafNode;
@@ -408,6 +663,8 @@ struct Stack {
   uint32_t num_frames;
   BzTree *tree;
   BaseNode *root;
+  // Full key of the separator last returned by BzTree::NextLeaf
+  std::string fence;
 
   Stack() : num_frames(0) {}
   ~Stack() { num_frames = 0; }
@@ -431,9 +688,42 @@ struct Stack {
 
 struct Record;
 
+// Called by scans for each record in key order, with the key and payload read
+// in place from the leaf node; [key] is only valid during the call. Return
+// false to end the scan after this record. Scans keep no per-thread state
+// in use while the visitor runs, so it may call into the tree, including to
+// start another scan.
+typedef std::function<bool(const char *key, uint16_t key_size, uint64_t payload)> ScanVisitor;
+
+// Called by read-modify-write operations with the current payload of a key in
+// [*payload], to be replaced by the new payload; return false to leave the
+// record as it is. Called again with the newer payload if another thread
+// changes the record before the new payload is installed.
+typedef std::function<bool(uint64_t *payload)> PayloadModifier;
+
+// Value of a leaf record stored out of line, for values too large for the
+// leaf. The record keeps the value's size as its payload and the blob's
+// address (a PMDK offset under PMDK) in place of the value. Blobs are never
+// modified: a new version of the record gets a new blob, and the old one is
+// freed with the old version once no reader can see it.
+struct Blob {
+  uint64_t size;
+  char data[0];
+
+  // Allocate a blob with a copy of [value] in [*mem], the new value of a
+  // PMwCAS word, so that it is freed if the PMwCAS fails or is rolled back
+  static void New(Blob **mem, const char *value, uint32_t value_size);
+};
+
 class LeafNode : public BaseNode {
  public:
-  static void New(LeafNode **mem, uint32_t node_size);
+  // Payloads are PMwCAS target words, whose top three bits are PMwCAS control
+  // bits. A payload with any of its top four bits set is kept in a one-word
+  // value after the payload word, which is set to this flag instead; such a
+  // record is never updated in place, only replaced by a new version.
+  static const uint64_t kOverflowPayload = uint64_t{1} << 60;
+
+  static void New(LeafNode **mem, uint32_t node_size, bool persist = true);
 
   static inline uint32_t GetUsedSpace(NodeHeader::StatusWord status) {
     return sizeof(LeafNode) + status.GetBlockSize() +
@@ -445,7 +735,18 @@ class LeafNode : public BaseNode {
 
   ReturnCode Insert(const char *key, uint16_t key_size, uint64_t payload,
                     pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold);
+  // Insert a record with a [value_size]-byte value stored in the node after
+  // the payload, which is set to [value_size], or in a new Blob if [blob]
+  ReturnCode InsertValue(const char *key, uint16_t key_size,
+                         const char *value, uint32_t value_size,
+                         pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                         bool blob = false);
+  // Split the node for the insert of [key] (nullptr if none). The records are
+  // divided evenly, unless [key] goes after all keys of the right-most leaf:
+  // the left leaf then keeps ParameterSet::append_split_fill of them. If no
+  // visible record is left to divide, [key] becomes the separator.
   bool PrepareForSplit(Stack &stack, uint32_t split_threshold,
+                       const char *key, uint32_t key_size,
                        pmwcas::Descriptor *pd,
                        pmwcas::DescriptorPool *pmwcas_pool,
                        LeafNode **left, LeafNode **right,
@@ -453,7 +754,16 @@ class LeafNode : public BaseNode {
 
   // merge two nodes into a new one
   // copy the meta/data to the new node
-  static bool MergeNodes(LeafNode *left_node, LeafNode *right_node, LeafNode **new_node);
+  // Returns false, without allocating, if the visible records of both nodes
+  // do not fit in a node of [node_size] bytes
+  static bool MergeNodes(LeafNode *left_node, LeafNode *right_node, uint32_t node_size,
+                         LeafNode **new_node);
+
+  // Size of the node that merging the visible records of [left_node] and
+  // [right_node] makes; their keys keep only the common part of the two
+  // prefixes, which goes to [*prefix_size]
+  static uint32_t GetMergedSize(LeafNode *left_node, LeafNode *right_node,
+                                uint32_t *prefix_size);
 
   // Initialize new, empty node with a list of records; no concurrency control;
   // only useful before any inserts to the node. For now the only users are split
@@ -462,19 +772,70 @@ class LeafNode : public BaseNode {
   // The list of records to be inserted is specified through iterators of a
   // record metadata vector. Recods covered by [begin_it, end_it) will be
   // inserted to the node. Note end_it is non-inclusive.
+  //
+  // The first [prefix_size] bytes of the keys, which all keys in the new
+  // node's key range share, become the node's prefix. Records are appended to
+  // those already copied, so a node can be filled from several nodes with the
+  // same [prefix_size].
   void CopyFrom(LeafNode *node,
                 std::vector<RecordMetadata>::iterator begin_it,
                 std::vector<RecordMetadata>::iterator end_it,
+                uint32_t prefix_size,
                 pmwcas::EpochManager *epoch);
 
+  // Update [key]'s payload in place, or by appending a new version of its
+  // record if the old or the new payload overflows, which may return
+  // NotEnoughSpace like Insert. Returns Invalid if the record has a value
+  // (see BzTree::InsertValue), whose size the payload word holds.
   ReturnCode Update(const char *key, uint16_t key_size, uint64_t payload,
-                    pmwcas::DescriptorPool *pmwcas_pool);
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold);
+
+  // Update [key]'s payload if it is in this node, otherwise insert it, with a
+  // single search of the node. Returns NotEnoughSpace like Insert, and
+  // Invalid like Update.
+  ReturnCode Upsert(const char *key, uint16_t key_size, uint64_t payload,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold);
 
-  ReturnCode Delete(const char *key, uint16_t key_size, pmwcas::DescriptorPool *pmwcas_pool);
+  // Set [key]'s payload to the one [modify] derives from it, atomically: the
+  // PMwCAS that installs the new payload checks that the payload is still the
+  // one [modify] saw (the last one goes to [*old_payload]), or calls [modify]
+  // again. Returns what Update returns, and Ok if [modify] returns false.
+  ReturnCode ReadModifyWrite(const char *key, uint16_t key_size, const PayloadModifier &modify,
+                             uint64_t *old_payload, pmwcas::DescriptorPool *pmwcas_pool,
+                             uint32_t split_threshold);
+
+  // Delete [key]; the blob of the deleted record, if any, goes to [*old_blob]
+  // for the caller to retire
+  ReturnCode Delete(const char *key, uint16_t key_size, pmwcas::DescriptorPool *pmwcas_pool,
+                    Blob **old_blob = nullptr);
 
   ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload,
                   pmwcas::DescriptorPool *pmwcas_pool);
 
+  // Replace the value of [key] by appending a new version of its record,
+  // which is made visible by the same PMwCAS that deletes the old one.
+  // Returns NotEnoughSpace like Insert. The blob of the old version, if any,
+  // goes to [*old_blob] for the caller to retire.
+  ReturnCode UpdateValue(const char *key, uint16_t key_size,
+                         const char *value, uint32_t value_size,
+                         pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                         bool blob = false, Blob **old_blob = nullptr);
+
+  // UpdateValue if [key] is in this node, otherwise InsertValue
+  ReturnCode UpsertValue(const char *key, uint16_t key_size,
+                         const char *value, uint32_t value_size,
+                         pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                         bool blob = false, Blob **old_blob = nullptr);
+
+  // Copy the value of [key] to [*value]; the value of a record with just a
+  // payload is the payload's 8 bytes
+  ReturnCode ReadValue(const char *key, uint16_t key_size, std::string *value,
+                       pmwcas::DescriptorPool *pmwcas_pool);
+
+  // The blob that holds the value of record [meta], or nullptr if the value
+  // (if any) is in the node
+  Blob *GetBlob(RecordMetadata meta);
+
   ReturnCode RangeScanByKey(const char *key1,
                             uint32_t size1,
                             const char *key2,
@@ -488,16 +849,61 @@ class LeafNode : public BaseNode {
                              std::list<std::unique_ptr<Record>> *result,
                              pmwcas::DescriptorPool *pmwcas_pool);
 
+  // Scratch space of a scan, owned by the caller so that it can be reused
+  // across leaves, and is not shared with scans that the visitor starts
+  struct ScanBuffers {
+    std::string full_key;
+    std::vector<RecordMetadata> unsorted;
+  };
+
+  // Pass visible records with keys in [key1, key2] (or (key1, key2] if
+  // [include_key1] is false) to [visitor] in key order, up to [to_scan]
+  // records; key2 == nullptr means no upper bound. Records are not copied.
+  // Returns the number of records visited and sets [*done] if the visitor or
+  // the upper bound ended the scan. The caller must be protected by an epoch.
+  uint32_t Scan(const char *key1, uint32_t size1, bool include_key1,
+                const char *key2, uint32_t size2, uint32_t to_scan,
+                const ScanVisitor &visitor, bool *done, ScanBuffers *buffers,
+                pmwcas::EpochManager *epoch);
+
   // Consolidate all records in sorted order
   LeafNode *Consolidate(pmwcas::DescriptorPool *pmwcas_pool);
 
-  // Specialized GetRawRecord for leaf node only (key can't be nullptr)
+  // Allocate a new node in [*mem] (a PMDK offset under PMDK) and fill it with
+  // the visible records of this node in sorted order. The node must be frozen.
+  void NewConsolidated(LeafNode **mem, pmwcas::DescriptorPool *pmwcas_pool);
+
+  // Space this node would use after consolidation, i.e., without deleted
+  // records. The node must be frozen for the result to be stable.
+  uint32_t GetConsolidatedSpace();
+
+  inline uint32_t GetUnsortedCount() {
+    return header.GetStatus().GetRecordCount() - header.sorted_count;
+  }
+
+  // Append a record to a node that is being bulk loaded and is not visible to
+  // other threads yet. Records must be appended in key order; the record
+  // becomes part of the sorted field. Returns false if the node would then
+  // use [space_limit] bytes or more. The node keeps full keys.
+  bool AppendSorted(const char *key, uint16_t key_size, uint64_t payload,
+                    uint32_t space_limit);
+
+  // Specialized GetRawRecord for leaf node only (key can't be nullptr); the
+  // payload is the payload word, see LoadPayload
   inline bool GetRawRecord(RecordMetadata meta, char **key,
                            uint64_t *payload, pmwcas::EpochManager *epoch = nullptr) {
     char *unused = nullptr;
     return BaseNode::GetRawRecord(meta, &unused, key, payload, epoch);
   }
 
+  // The payload of a record whose payload word at [payload_addr] is [word]
+  static inline uint64_t LoadPayload(const char *payload_addr, uint64_t word) {
+    if (word & kOverflowPayload) {
+      return *reinterpret_cast<const uint64_t *>(payload_addr + sizeof(uint64_t));
+    }
+    return word;
+  }
+
   inline uint32_t GetFreeSpace() {
     auto status = header.GetStatus();
     assert(header.size >= GetUsedSpace(status));
@@ -510,12 +916,69 @@ class LeafNode : public BaseNode {
                              pmwcas::EpochManager *epoch);
   void Dump(pmwcas::EpochManager *epoch);
 
+  // Get the fences of the leaf that [stack] leads to, i.e., its key range is
+  // (low, high]; the left-most and the right-most leaf miss a fence
+  static void GetFences(Stack &stack, std::string *low, bool *has_low,
+                        std::string *high, bool *has_high);
+
  private:
   enum Uniqueness { IsUnique, Duplicate, ReCheck, NodeFrozen };
+
+  // Get the shortest key in [left, right), which separates the left leaf,
+  // whose largest key is [left], from the right leaf, which starts at [right]
+  static void GetSeparator(const char *left, uint32_t left_size,
+                           const char *right, uint32_t right_size,
+                           std::string *separator);
+
   Uniqueness CheckUnique(const char *key, uint32_t key_size, pmwcas::EpochManager *epoch);
   Uniqueness RecheckUnique(const char *key,
                            uint32_t key_size,
                            uint32_t end_pos);
+
+  ReturnCode InsertRecord(const char *key, uint16_t key_size, uint64_t payload,
+                          const char *value, uint32_t value_size, bool blob,
+                          pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold);
+
+  // Append a new record for [key], with [value] after the payload (or in a
+  // blob if [blob]) if not nullptr, which the search found to be [uniqueness]
+  // (not Duplicate) when the node had [expected_status]. Returns
+  // PMWCASFailure if the status changed before the space was reserved (search
+  // again and retry), or KeyExists if a concurrent insert of [key] won. With
+  // [replaced], the record is a new version of the visible record of [key]
+  // there, which is deleted when the new one becomes visible, and whose blob
+  // goes to [*old_blob]; if [key] is deleted first, the result is NotFound.
+  // With [replaced_payload], only that version is replaced, and only while
+  // its payload word is [*replaced_payload]; otherwise the result is
+  // PMWCASFailure.
+  ReturnCode Append(const char *key, uint16_t key_size, uint64_t payload,
+                    const char *value, uint32_t value_size, bool blob,
+                    pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                    NodeHeader::StatusWord expected_status, Uniqueness uniqueness,
+                    RecordMetadata *replaced = nullptr, Blob **old_blob = nullptr,
+                    const uint64_t *replaced_payload = nullptr);
+
+  // Address of the payload word of record [meta]
+  inline uint64_t *GetPayloadPtr(RecordMetadata meta) {
+    return reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(this) + meta.GetOffset() +
+        meta.GetPaddedKeyLength());
+  }
+
+  // Address of the value of record [meta], right after the payload
+  inline char *GetValue(RecordMetadata meta) {
+    return reinterpret_cast<char *>(this) + meta.GetOffset() + meta.GetPaddedKeyLength() +
+        sizeof(uint64_t);
+  }
+
+  // Replace the payload of [key]'s visible record [metadata] at [meta_ptr],
+  // found when the node had [expected_status]. Returns PMWCASFailure if the
+  // record or the node changed in the meantime, or if the payload word is not
+  // [*expected_payload] (if given), Invalid if the record has a value, and
+  // otherwise what Append returns if the record has to be replaced.
+  ReturnCode UpdatePayload(const char *key, uint16_t key_size,
+                           RecordMetadata metadata, RecordMetadata *meta_ptr, uint64_t payload,
+                           pmwcas::DescriptorPool *pmwcas_pool, uint32_t split_threshold,
+                           NodeHeader::StatusWord expected_status,
+                           const uint64_t *expected_payload = nullptr);
 };
 
 struct Record {
@@ -528,18 +991,29 @@ struct Record {
       return nullptr;
     }
 
-    Record *r = reinterpret_cast<Record *>(malloc(meta.GetTotalLength() + sizeof(meta)));
-    memset(r, 0, meta.GetTotalLength() + sizeof(Record));
-    new(r) Record(meta);
-
     // Key will never be changed and it will not be a pmwcas descriptor
     // but payload is fixed length 8-byte value, can be updated by pmwcas
-    memcpy(r->data, reinterpret_cast<char *>(node) + meta.GetOffset(), meta.GetPaddedKeyLength());
-
+    thread_local std::string key;
+    node->GetFullKey(meta, &key);
     auto source_addr = (reinterpret_cast<char *>(node) + meta.GetOffset());
+    auto payload_addr = source_addr + meta.GetPaddedKeyLength();
     auto payload = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
-        source_addr + meta.GetPaddedKeyLength())->GetValueProtected();
-    memcpy(r->data + meta.GetPaddedKeyLength(), &payload, sizeof(payload));
+        payload_addr)->GetValueProtected();
+    return New(key.data(), static_cast<uint16_t>(key.size()),
+               LeafNode::LoadPayload(payload_addr, payload));
+  }
+
+  // Copy a record handed out by a scan
+  static inline Record *New(const char *key, uint16_t key_size, uint64_t payload) {
+    RecordMetadata meta;
+    auto padded_key_size = RecordMetadata::PadKeyLength(key_size);
+    meta.FinalizeForInsert(sizeof(Record), key_size, padded_key_size + sizeof(payload));
+
+    Record *r = reinterpret_cast<Record *>(malloc(meta.GetTotalLength() + sizeof(Record)));
+    memset(r, 0, meta.GetTotalLength() + sizeof(Record));
+    new(r) Record(meta);
+    memcpy(r->data, key, key_size);
+    memcpy(r->data + padded_key_size, &payload, sizeof(payload));
     return r;
   }
 
@@ -553,25 +1027,137 @@ struct Record {
     return cmp < 0;
   }
 };
+// Counters of a tree's operations and structure modifications, kept per
+// thread and summed by BzTree::GetStats. Counting is compiled in with
+// ENABLE_STATS=1; otherwise all counters stay zero.
+struct Stats {
+  static const uint32_t kMaxLevels = 8;
+
+  // Operations by type; an upsert that has to split a leaf also counts an
+  // insert
+  uint64_t inserts;
+  uint64_t reads;
+  uint64_t updates;
+  uint64_t upserts;
+  uint64_t deletes;
+  uint64_t scans;
+  // ReadModifyWrite, CompareAndSwap and FetchAdd
+  uint64_t read_modify_writes;
+
+  // Operations retried because they ran into a frozen node
+  uint64_t frozen_retries;
+  // Pause instructions and yields spent waiting before such retries and
+  // between attempts to freeze a node (see Backoff)
+  uint64_t backoff_pauses;
+  uint64_t backoff_yields;
+
+  // Failed PMwCAS operations that had to be retried
+  uint64_t insert_mwcas_failures;
+  uint64_t update_mwcas_failures;
+  uint64_t delete_mwcas_failures;
+
+  // Node splits by level (0 for leaves); higher levels count in the last one
+  uint64_t splits[kMaxLevels];
+
+  // Operations that went to the leaf of the thread's leaf hint directly, and
+  // those that checked the hint but had to traverse the tree (with
+  // [leaf_hints] on only)
+  uint64_t leaf_hint_hits;
+  uint64_t leaf_hint_misses;
+
+  // The same for inserts checking the right-most leaf hint with [leaf_hints]
+  // off
+  uint64_t append_hint_hits;
+  uint64_t append_hint_misses;
+
+  uint64_t consolidations;
+  uint64_t merges;
+  uint64_t root_changes;
+  uint64_t descriptors;
+
+  // Blobs of deleted or replaced versions handed to the garbage list
+  uint64_t blobs_retired;
+
+  Stats() { memset(this, 0, sizeof(Stats)); }
+  Stats &operator+=(const Stats &other);
+};
+
 class Iterator;
+struct MaintenanceThread;
 class BzTree {
  public:
   struct ParameterSet {
     const uint32_t split_threshold;
     const uint32_t merge_threshold;
     const uint32_t leaf_node_size;
-    ParameterSet() : split_threshold(3072), merge_threshold(1024), leaf_node_size(4096) {}
+    // Consolidation policy. A full leaf is consolidated instead of split if,
+    // without its deleted records and with the new record, it would use at
+    // most [consolidate_fill] of the split threshold. A leaf is also
+    // consolidated once [max_unsorted_records] records are in its unsorted
+    // field (0 to disable), as reads search the unsorted field linearly. This
+    // is on by default: unless a maintenance thread runs, the insert that
+    // fills the unsorted field consolidates the leaf inline.
+    float consolidate_fill;
+    uint32_t max_unsorted_records;
+    // Merge policy. A leaf with less than [merge_threshold] live data is
+    // merged with a sibling that is also below it: never, by the Delete that
+    // shrinks it (MergeOnDelete), or later by MergeLeaves (MergeDeferred),
+    // which the maintenance thread runs if started. Deferring takes the merge
+    // off the delete path.
+    enum MergePolicy { MergeNever, MergeOnDelete, MergeDeferred };
+    MergePolicy merge_policy;
+    // Freeze backoff. An operation that runs into a node frozen by another
+    // thread retries up to [max_freeze_retry] times before it competes in the
+    // change. It waits before each retry, and after failed attempts to freeze
+    // a node, as a Backoff with [backoff_max_pause] and [backoff_yield].
+    uint32_t max_freeze_retry;
+    uint32_t backoff_max_pause;
+    bool backoff_yield;
+    // Share of the records the left leaf keeps when the right-most leaf is
+    // split by a key past all of its keys, likely one of a run of increasing
+    // keys that will all go to the right leaf (0.5 to split it evenly)
+    float append_split_fill;
+    // Finger search. Each thread remembers the leaf it last inserted into if
+    // it is the right-most one, and with [leaf_hints] the leaf any operation
+    // last went to. Reads, updates, upserts, inserts and deletes (unless they
+    // merge on delete) of keys in the leaf's key range then go to it without
+    // traversing the tree, which pays off when threads access nearby keys.
+    bool leaf_hints;
+    // Values of up to [max_inline_value] bytes are stored in the leaf if the
+    // record fits in a quarter of the split threshold and in the total length
+    // of its metadata (RecordMetadata::kMaxTotalLength); others go to blobs.
+    // Large inline values spread the keys a leaf search reads over more
+    // cache lines.
+    uint32_t max_inline_value;
+    ParameterSet() : split_threshold(3072), merge_threshold(1024), leaf_node_size(4096),
+                     consolidate_fill(0.75), max_unsorted_records(32),
+                     merge_policy(MergeNever), max_freeze_retry(1), backoff_max_pause(256),
+                     backoff_yield(false), append_split_fill(0.9), leaf_hints(false),
+                     max_inline_value(256) {}
     ParameterSet(uint32_t split_threshold, uint32_t merge_threshold, uint32_t leaf_node_size = 4096)
         : split_threshold(split_threshold),
           merge_threshold(merge_threshold),
-          leaf_node_size(leaf_node_size) {}
+          leaf_node_size(leaf_node_size),
+          consolidate_fill(0.75),
+          max_unsorted_records(32),
+          merge_policy(MergeNever),
+          max_freeze_retry(1),
+          backoff_max_pause(256),
+          backoff_yield(false),
+          append_split_fill(0.9),
+          leaf_hints(false),
+          max_inline_value(256) {}
+    inline Backoff NewBackoff() const { return Backoff(backoff_max_pause, backoff_yield); }
     ~ParameterSet() {}
   };
 
   // init a new tree
   BzTree(const ParameterSet &param, pmwcas::DescriptorPool *pool, uint64_t pmdk_addr = 0)
-      : parameters(param), root(nullptr), pmdk_addr(pmdk_addr), index_epoch(0) {
+      : parameters(param), root(nullptr), pmdk_addr(pmdk_addr), index_epoch(0),
+        garbage_list(nullptr), maintenance(nullptr) {
     global_epoch = index_epoch;
+    InitStats();
+    InitHints();
     SetPMWCASPool(pool);
     pmwcas::EpochGuard guard(GetPMWCASPool()->GetEpoch());
     auto *pd = pool->AllocateDescriptor();
@@ -590,13 +1176,26 @@ class BzTree {
     if (global_epoch != index_epoch) {
       global_epoch = index_epoch;
     }
+    maintenance = nullptr;
+    garbage_list = nullptr;
+    InitStats();
+    InitHints();
     pmwcas::DescriptorPool *pool = GetPMWCASPool();
     pool->Recovery(false);
+    ResetGarbageList();
 
     pmwcas::NVRAM::Flush(sizeof(bztree::BzTree), this);
   }
 #endif
 
+  ~BzTree() {
+    StopMaintenanceThread();
+    delete garbage_list;
+#if ENABLE_STATS
+    delete[] stats_slots;
+#endif
+  }
+
   void Dump();
 
   inline static BzTree *New(const ParameterSet &param, pmwcas::DescriptorPool *pool) {
@@ -606,20 +1205,208 @@ class BzTree {
     return tree;
   }
 
+  // Payloads can be any 64-bit value; see LeafNode::kOverflowPayload for the
+  // cost of those with any of the top four bits set
   ReturnCode Insert(const char *key, uint16_t key_size, uint64_t payload);
   ReturnCode Read(const char *key, uint16_t key_size, uint64_t *payload);
   ReturnCode Update(const char *key, uint16_t key_size, uint64_t payload);
   ReturnCode Upsert(const char *key, uint16_t key_size, uint64_t payload);
   ReturnCode Delete(const char *key, uint16_t key_size);
 
+  // Atomic read-modify-write operations on payloads, built on the PMwCAS of
+  // Update with the old payload as the expected value of the payload word.
+  // Each attempt traverses the tree once; a failed PMwCAS is retried on the
+  // same leaf. ReadModifyWrite sets [key]'s payload to what [modify] derives
+  // from it (see PayloadModifier); the payload [modify] saw last goes to
+  // [*old_payload].
+  ReturnCode ReadModifyWrite(const char *key, uint16_t key_size, const PayloadModifier &modify,
+                             uint64_t *old_payload = nullptr);
+  // Set [key]'s payload to [desired] if it is [expected], otherwise return
+  // PMWCASFailure; the payload found goes to [*actual]
+  ReturnCode CompareAndSwap(const char *key, uint16_t key_size, uint64_t expected,
+                            uint64_t desired, uint64_t *actual = nullptr);
+  // Add [delta] to [key]'s payload (modulo 2^64); the old payload goes to
+  // [*old_payload]
+  ReturnCode FetchAdd(const char *key, uint16_t key_size, uint64_t delta,
+                      uint64_t *old_payload = nullptr);
+
+  // Records with variable-length values, stored inline in the leaf so that a
+  // read needs no other memory access, or in a Blob if they are larger than
+  // ParameterSet::max_inline_value. The payload of such a record is the
+  // value's size: Update, Upsert and the read-modify-write operations return
+  // Invalid for them instead of dropping the value. Values are updated by appending a new version of the record to
+  // the leaf, and deleted with Delete; blobs of old versions are freed once
+  // no reader can see them. Keys too long to leave room for a value return
+  // NotEnoughSpace.
+  ReturnCode InsertValue(const char *key, uint16_t key_size,
+                         const char *value, uint32_t value_size);
+  ReturnCode ReadValue(const char *key, uint16_t key_size, std::string *value);
+  ReturnCode UpdateValue(const char *key, uint16_t key_size,
+                         const char *value, uint32_t value_size);
+  ReturnCode UpsertValue(const char *key, uint16_t key_size,
+                         const char *value, uint32_t value_size);
+
+  // Look up [n] keys at once and return how many were found. The result of
+  // keys[i] goes to rcs[i] and, if found, its payload to payloads[i]. Keys are
+  // looked up in groups that descend the tree together one level at a time,
+  // prefetching each key's next node, so that the cache misses of different
+  // keys overlap instead of forming one chain per key. The whole batch runs
+  // in one epoch.
+  uint32_t MultiRead(const char *const *keys, const uint16_t *key_sizes, uint32_t n,
+                     uint64_t *payloads, ReturnCode *rcs);
+  uint32_t MultiRead(const uint64_t *keys, uint32_t n, uint64_t *payloads, ReturnCode *rcs);
+
+  // Like MultiRead, but each key is looked up by a resumable lookup (a
+  // stackless version of TraverseToLeaf and LeafNode::Read) that suspends
+  // after prefetching the next node on its path. Up to [inflight] lookups are
+  // interleaved round-robin, and a finished lookup is immediately replaced
+  // by the next key, so lookups never wait for each other.
+  static const uint32_t kMaxInflightReads = 32;
+  uint32_t InterleavedRead(const char *const *keys, const uint16_t *key_sizes, uint32_t n,
+                           uint64_t *payloads, ReturnCode *rcs, uint32_t inflight = 8);
+  uint32_t InterleavedRead(const uint64_t *keys, uint32_t n, uint64_t *payloads,
+                           ReturnCode *rcs, uint32_t inflight = 8);
+
+  // Bulk-load records into an empty tree, bypassing PMwCAS: leaf nodes are
+  // packed directly, inner levels are built bottom-up, and the new root is
+  // installed with a single ChangeRoot. Each element of [begin, end) is a
+  // std::pair of a key (anything with data() and size(), e.g., std::string)
+  // and its payload; keys must be unique and in ascending order. Nodes are
+  // filled up to [fill_factor] of the split threshold, in (0, 1].
+  //
+  // The tree must not be accessed by other threads during bulk loading.
+  // Returns Invalid if the tree is not empty. Nodes are persisted without a
+  // PMwCAS descriptor, so a crash before the root is installed leaks them.
+  typedef std::function<bool(const char **key, uint16_t *key_size, uint64_t *payload)>
+      BulkLoadSource;
+  template <class RecordIterator>
+  inline ReturnCode BulkLoad(RecordIterator begin, RecordIterator end, float fill_factor = 1.0) {
+    auto source = [&begin, &end](const char **key, uint16_t *key_size, uint64_t *payload) {
+      if (begin == end) {
+        return false;
+      }
+      *key = begin->first.data();
+      *key_size = static_cast<uint16_t>(begin->first.size());
+      *payload = begin->second;
+      ++begin;
+      return true;
+    };
+    return BulkLoadFrom(source, fill_factor);
+  }
+  ReturnCode BulkLoadFrom(const BulkLoadSource &source, float fill_factor);
+
+  // Fixed-width integer key variants; keys are encoded by IntegerKey. Trees
+  // should not mix integer keys with other 8-byte keys.
+  inline ReturnCode Insert(uint64_t key, uint64_t payload) {
+    IntegerKey k(key);
+    return Insert(k.GetData(), k.GetSize(), payload);
+  }
+  inline ReturnCode Read(uint64_t key, uint64_t *payload) {
+    IntegerKey k(key);
+    return Read(k.GetData(), k.GetSize(), payload);
+  }
+  inline ReturnCode Update(uint64_t key, uint64_t payload) {
+    IntegerKey k(key);
+    return Update(k.GetData(), k.GetSize(), payload);
+  }
+  inline ReturnCode Upsert(uint64_t key, uint64_t payload) {
+    IntegerKey k(key);
+    return Upsert(k.GetData(), k.GetSize(), payload);
+  }
+  inline ReturnCode Delete(uint64_t key) {
+    IntegerKey k(key);
+    return Delete(k.GetData(), k.GetSize());
+  }
+  inline ReturnCode ReadModifyWrite(uint64_t key, const PayloadModifier &modify,
+                                    uint64_t *old_payload = nullptr) {
+    IntegerKey k(key);
+    return ReadModifyWrite(k.GetData(), k.GetSize(), modify, old_payload);
+  }
+  inline ReturnCode CompareAndSwap(uint64_t key, uint64_t expected, uint64_t desired,
+                                   uint64_t *actual = nullptr) {
+    IntegerKey k(key);
+    return CompareAndSwap(k.GetData(), k.GetSize(), expected, desired, actual);
+  }
+  inline ReturnCode FetchAdd(uint64_t key, uint64_t delta, uint64_t *old_payload = nullptr) {
+    IntegerKey k(key);
+    return FetchAdd(k.GetData(), k.GetSize(), delta, old_payload);
+  }
+  inline ReturnCode InsertValue(uint64_t key, const char *value, uint32_t value_size) {
+    IntegerKey k(key);
+    return InsertValue(k.GetData(), k.GetSize(), value, value_size);
+  }
+  inline ReturnCode ReadValue(uint64_t key, std::string *value) {
+    IntegerKey k(key);
+    return ReadValue(k.GetData(), k.GetSize(), value);
+  }
+  inline ReturnCode UpdateValue(uint64_t key, const char *value, uint32_t value_size) {
+    IntegerKey k(key);
+    return UpdateValue(k.GetData(), k.GetSize(), value, value_size);
+  }
+  inline ReturnCode UpsertValue(uint64_t key, const char *value, uint32_t value_size) {
+    IntegerKey k(key);
+    return UpsertValue(k.GetData(), k.GetSize(), value, value_size);
+  }
+
+  // Sum of the counters of all threads; approximate while other threads are
+  // operating on the tree
+  Stats GetStats();
+
+  // Consolidate all leaves that have at least [max_unsorted_records] records
+  // in their unsorted field; returns the number of leaves consolidated. Can
+  // run concurrently with other operations.
+  uint32_t ConsolidateLeaves();
+
+  // Merge each leaf that has less than [merge_threshold] live data with a
+  // sibling, if one is also below it; returns the number of such leaves
+  // found. Can run concurrently with other operations.
+  uint32_t MergeLeaves();
+
+  // Run ConsolidateLeaves, and MergeLeaves with the MergeDeferred policy, in a
+  // background thread every [interval_ms] milliseconds until stopped. While
+  // the thread runs, inserts leave consolidating leaves with long unsorted
+  // fields to it.
+  void StartMaintenanceThread(uint32_t interval_ms);
+  void StopMaintenanceThread();
+
+  // Zero-copy scans: pass records in key order straight from the leaf nodes to
+  // [visitor] under a single epoch, without allocating per record. Returns the
+  // number of records visited. The first variant visits up to [count] records
+  // with keys >= [begin_key], the second visits keys in [begin_key, end_key].
+  inline uint32_t Scan(const char *begin_key, uint16_t begin_size, uint32_t count,
+                       const ScanVisitor &visitor) {
+    return ScanRange(begin_key, begin_size, true, nullptr, 0, count, visitor);
+  }
+  inline uint32_t Scan(const char *begin_key, uint16_t begin_size,
+                       const char *end_key, uint16_t end_size, const ScanVisitor &visitor) {
+    return ScanRange(begin_key, begin_size, true, end_key, end_size, (uint32_t) -1, visitor);
+  }
+  inline uint32_t Scan(uint64_t begin_key, uint32_t count, const ScanVisitor &visitor) {
+    IntegerKey k(begin_key);
+    return Scan(k.GetData(), k.GetSize(), count, visitor);
+  }
+
   inline std::unique_ptr<Iterator> RangeScanBySize(const char *key1, uint16_t size1,
                                                    uint32_t scan_size) {
     return std::make_unique<Iterator>(this, key1, size1, scan_size);
   }
+  // Scan with an integer start key; the iterator must not outlive [key1]
+  inline std::unique_ptr<Iterator> RangeScanBySize(const IntegerKey &key1, uint32_t scan_size) {
+    return std::make_unique<Iterator>(this, key1.GetData(), key1.GetSize(), scan_size);
+  }
 
   LeafNode *TraverseToLeaf(Stack *stack, const char *key,
                            uint16_t key_size,
                            bool le_child = true);
+  // Move [stack], which leads to a leaf, to the leaf right after it: pop up to
+  // the nearest ancestor with a child to the right of the path and follow the
+  // left-most children down from there, which costs O(1) amortized over a
+  // scan. [*fence] is set to the separator between the two leaves, which
+  // stays valid until the next call with [stack]. If a node
+  // on the way is frozen (being replaced by a split or a consolidation), the
+  // leaf is looked up from the root by the separator instead. Returns nullptr
+  // if the leaf was the right-most one. Must be called in an epoch.
+  LeafNode *NextLeaf(Stack *stack, const char **fence, uint16_t *fence_size);
   BaseNode *TraverseToNode(bztree::Stack *stack,
                            const char *key, uint16_t key_size,
                            bztree::BaseNode *stop_at = nullptr,
@@ -631,8 +1418,15 @@ class BzTree {
 #else
     this->pmwcas_pool = pool;
 #endif
+    ResetGarbageList();
   }
 
+  // Free [node], which has been replaced in the tree, once no thread can be
+  // reading it any more
+  void RetireNode(BaseNode *node);
+  // Same for the blob of a deleted or replaced record
+  void RetireBlob(Blob *blob);
+
   inline pmwcas::DescriptorPool *GetPMWCASPool() {
 #ifdef PMDK
     return Allocator::Get()->GetDirect(pmwcas_pool);
@@ -658,6 +1452,119 @@ class BzTree {
   uint64_t pmdk_addr;
   uint64_t index_epoch;
 
+  // Nodes retired by RetireNode, protected by the PMwCAS pool's epoch
+  // manager. Like the maintenance thread this is volatile state, so a tree
+  // reopened from PM gets a new list.
+  pmwcas::GarbageList *garbage_list;
+  void ResetGarbageList();
+
+  // Volatile state of the maintenance thread, if any
+  MaintenanceThread *maintenance;
+
+  // Leaf hints (see LeafHint in bztree.cc) are volatile state too: a number
+  // unique to this tree object, and a count of the nodes it retired, bumped
+  // before each is retired
+  uint64_t hint_id;
+  std::atomic<uint64_t> retired_nodes;
+  void InitHints();
+  // The leaf [key] goes to from the calling thread's leaf hint, or nullptr if
+  // the hint is not valid, does not cover [key] or the leaf is frozen
+  LeafNode *GetHintedLeaf(const char *key, uint16_t key_size);
+  // Remember [leaf], which [stack] leads to, in the calling thread's leaf
+  // hint (only if it is the right-most leaf, unless leaf hints are on);
+  // [retired_nodes] is the count of retired nodes read before the traversal
+  void SetLeafHint(Stack &stack, LeafNode *leaf, uint64_t retired_nodes);
+  // The leaf [key] goes to, for operations that need no path to it: from the
+  // calling thread's leaf hint if possible and leaf hints are on
+  LeafNode *FindLeaf(const char *key, uint16_t key_size);
+
+  // Insert a record, or append a new version of the record of [key] for
+  // updates, upserts and read-modify-writes ([op]), splitting the leaf as
+  // needed. [value] is nullptr for records with just a payload; it goes to a
+  // blob if [blob]. ModifyOp takes the payload from [modify] instead, and
+  // [payload] only sizes the new record, so it has to be the largest one.
+  enum RecordOp { InsertOp, UpdateOp, UpsertOp, ModifyOp };
+  ReturnCode InsertRecord(const char *key, uint16_t key_size, uint64_t payload,
+                          const char *value, uint32_t value_size, bool blob, RecordOp op,
+                          const PayloadModifier *modify = nullptr,
+                          uint64_t *old_payload = nullptr);
+  // InsertRecord for a record with a value, in the leaf or in a blob
+  ReturnCode WriteValue(const char *key, uint16_t key_size,
+                        const char *value, uint32_t value_size, RecordOp op);
+  // Whether a record with a [value_size]-byte value fits in a leaf: in a
+  // quarter of the split threshold, so that splitting a leaf always makes room
+  // for it, and in the total length of its metadata. The padded key is summed
+  // in 64 bits, as PadKeyLength wraps for keys within a word of 64 KB.
+  inline bool RecordFits(uint16_t key_size, uint32_t value_size) {
+    uint64_t padded_key_size = (uint64_t{key_size} + sizeof(uint64_t) - 1) /
+        sizeof(uint64_t) * sizeof(uint64_t);
+    uint64_t record_size = padded_key_size + sizeof(uint64_t) +
+        RecordMetadata::PadValueLength(value_size);
+    return value_size <= parameters.split_threshold &&
+        record_size <= parameters.split_threshold / 4 &&
+        record_size <= RecordMetadata::kMaxTotalLength;
+  }
+
+  // Merge [node], which [stack] leads to and [key] routes to, with a sibling
+  // if both are too small, retrying on concurrent changes
+  ReturnCode MergeLeaf(Stack *stack, LeafNode *node, const char *key, uint16_t key_size);
+
+#if ENABLE_STATS
+  // Volatile per-thread counters. Threads are assigned slots round-robin, so
+  // beyond kMaxStatsThreads threads some share a slot and may lose counts.
+  static const uint32_t kMaxStatsThreads = 128;
+  // Each slot on its own cache lines; new[] aligns it as of C++17
+  struct alignas(64) StatsSlot {
+    Stats stats;
+  };
+  StatsSlot *stats_slots;
+  inline void InitStats() { stats_slots = new StatsSlot[kMaxStatsThreads]; }
+  // Counters of the calling thread
+  Stats *GetThreadStats();
+#else
+  inline void InitStats() {}
+#endif
+
+  friend class Iterator;
+  // Replace frozen leaf [node], which [key] leads to, with a consolidated
+  // copy; [stack] is the path to [node]
+  void ConsolidateLeaf(Stack *stack, LeafNode *node, const char *key, uint16_t key_size);
+
+  uint32_t ScanRange(const char *begin_key, uint16_t begin_size, bool include_begin,
+                     const char *end_key, uint16_t end_size,
+                     uint32_t count, const ScanVisitor &visitor);
+
+  // Number of keys a MultiRead traverses the tree with at a time; the nodes
+  // prefetched for a group should stay in cache until the group gets to them
+  static const uint32_t kMultiReadGroupSize = 16;
+  // Batched lookups prefetch only the header and the first record metadata
+  // entries of each node: prefetching whole nodes for many keys at once
+  // saturates memory bandwidth instead of hiding latency
+  static const uint32_t kLookupPrefetchSize = 512;
+
+  // State of a lookup run by InterleavedRead
+  struct ReadLookup {
+    uint32_t index;  // position of the key in the batch
+    const char *key;
+    uint16_t key_size;
+    BaseNode *node;  // next node to search, already prefetched
+  };
+  // Search [lookup]'s current node; returns true if it was the leaf, with the
+  // result in [*rc] and [*payload], or moves on to the child and prefetches it
+  inline bool StepRead(ReadLookup *lookup, uint64_t *payload, ReturnCode *rc);
+
+  // Encode integer keys for the batched lookups; valid until the next call
+  static void EncodeIntegerKeys(const uint64_t *keys, uint32_t n,
+                                const char *const **key_ptrs, const uint16_t **key_sizes);
+
+  // Prefetch the first [size] bytes of [node] for reading
+  inline void PrefetchNode(BaseNode *node, uint32_t size) {
+    static const uint32_t kCacheLineSize = 64;
+    for (uint32_t i = 0; i < size / kCacheLineSize; ++i) {
+      __builtin_prefetch(reinterpret_cast<const char *>(node) + i * kCacheLineSize, 0, 3);
+    }
+  }
+
   inline BaseNode *GetRootNodeSafe() {
     auto root_node = reinterpret_cast<pmwcas::MwcTargetField<uint64_t> *>(
         &root)->GetValueProtected();
@@ -672,62 +1579,61 @@ class BzTree {
 class Iterator {
  public:
   explicit Iterator(BzTree *tree, const char *begin_key, uint16_t begin_size, uint32_t scan_size) :
-      key(begin_key), size(begin_size), tree(tree), remaining_size(scan_size) {
-    node = this->tree->TraverseToLeaf(nullptr, begin_key, begin_size);
-    node->RangeScanBySize(begin_key, begin_size, scan_size, &item_vec, tree->GetPMWCASPool());
+      last_key(begin_key, begin_size), include_last_key(true), tree(tree),
+      remaining_size(scan_size) {
+    Refill();
   }
 
   ~Iterator() = default;
 
   inline std::unique_ptr<Record> GetNext() {
-    if (item_vec.empty() || remaining_size == 0) {
-      return nullptr;
-    }
-
-    remaining_size -= 1;
-    // we have more than one record
-    if (item_vec.size() > 1) {
-      auto front = std::move(item_vec.front());
-      item_vec.pop_front();
-      return front;
+    if (item_vec.empty()) {
+      Refill();
+      if (item_vec.empty()) {
+        return nullptr;
+      }
     }
-
-    // there's only one record in the vector
-    auto last_record = std::move(item_vec.front());
+    auto front = std::move(item_vec.front());
     item_vec.pop_front();
+    return front;
+  }
 
-    node = this->tree->TraverseToLeaf(nullptr,
-                                      last_record->GetKey(),
-                                      last_record->meta.GetKeyLength(),
-                                      false);
-    if (node == nullptr) {
-      return nullptr;
+ private:
+  // Records are fetched in batches that may span several leaves; within a
+  // batch the scan moves between leaves with BzTree::NextLeaf, and each batch
+  // starts from the root right after the last key returned, so no node
+  // pointers are kept between batches
+  static const uint32_t kBatchSize = 256;
+
+  inline void Refill() {
+    if (remaining_size == 0) {
+      return;
     }
-    item_vec.clear();
-    const char *last_key = last_record->GetKey();
-    uint32_t last_len = last_record->meta.GetKeyLength();
-    node->RangeScanBySize(last_key, last_len, remaining_size, &item_vec, tree->GetPMWCASPool());
-
-    // FIXME(hao): this a temp workaround
-    // should fix traverse to leaf instead
-    // check if we hit the same record
-    if (!item_vec.empty()) {
-      auto new_front = item_vec.front().get();
-      if (BaseNode::KeyCompare(new_front->GetKey(), new_front->meta.GetKeyLength(),
-                               last_record->GetKey(), last_record->meta.GetKeyLength()) == 0) {
-        item_vec.clear();
-        return last_record;
-      }
+    uint32_t to_scan = remaining_size < kBatchSize ? remaining_size : kBatchSize;
+    auto scanned = tree->ScanRange(
+        last_key.data(), static_cast<uint16_t>(last_key.size()), include_last_key,
+        nullptr, 0, to_scan,
+        [this](const char *key, uint16_t key_size, uint64_t payload) {
+          item_vec.emplace_back(Record::New(key, key_size, payload));
+          return true;
+        });
+    if (scanned < to_scan) {
+      // Reached the end of the tree
+      remaining_size = 0;
+    } else {
+      remaining_size -= scanned;
+    }
+    if (scanned > 0) {
+      auto &last = item_vec.back();
+      last_key.assign(last->GetKey(), last->meta.GetKeyLength());
+      include_last_key = false;
     }
-    return last_record;
   }
 
- private:
-  const char *key;
-  uint16_t size;
+  std::string last_key;
+  bool include_last_key;
   uint32_t remaining_size;
   BzTree *tree;
-  LeafNode *node;
   std::list<std::unique_ptr<Record>> item_vec;
 };
 
@@ -0,0 +1,543 @@
+// Copyright (c) Simon Fraser University. All rights reserved.
+// Licensed under the MIT license.
+//
+// Authors:
+// Xiangpeng Hao <xiangpeng_hao@sfu.ca>
+// Tianzheng Wang <tzwang@sfu.ca>
+//
+// Single-threaded microbenchmarks. Usage: bztree_bench [benchmark name]; runs
+// all benchmarks if no name is given.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../bztree.h"
+
+namespace {
+
+static const uint32_t kLeafNodeSize = 4096;
+static const uint32_t kReadsPerRound = 1000000;
+static const uint32_t kKeyLength = 12;
+
+pmwcas::DescriptorPool *pool = nullptr;
+
+inline double NanosPerOp(std::chrono::steady_clock::time_point start, uint64_t ops) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+}
+
+// Fixed-width, zero-padded keys so that all records have the same size
+inline std::string MakeKey(uint64_t i) {
+  auto str = std::to_string(i);
+  return std::string(kKeyLength - str.length(), '0') + str;
+}
+
+// Point-read latency on a single leaf node as a function of how full it is.
+// Half of the records live in the sorted field and the other half in the
+// unsorted field, which is what a leaf looks like between consolidations.
+void LeafReadByFill() {
+  std::cout << "== leaf_read: point-read latency vs. leaf fill" << std::endl;
+  std::cout << "fill(%)\trecords\tsorted\tns/read" << std::endl;
+
+  // Each record has a padded key, an 8-byte payload and its metadata entry
+  uint32_t record_size = sizeof(bztree::RecordMetadata) +
+      bztree::RecordMetadata::PadKeyLength(kKeyLength) + sizeof(uint64_t);
+  uint32_t max_records = (kLeafNodeSize - sizeof(bztree::LeafNode)) / record_size;
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  for (uint32_t fill = 10; fill <= 100; fill += 10) {
+    uint32_t nrecords = max_records * fill / 100;
+    bztree::LeafNode *node = nullptr;
+    bztree::LeafNode::New(&node, kLeafNodeSize);
+
+    // Insert a random half of the keys and consolidate to get them sorted,
+    // then put the other half in the unsorted field
+    std::vector<std::string> keys;
+    for (uint32_t i = 0; i < nrecords; ++i) {
+      keys.emplace_back(MakeKey(i));
+    }
+    std::mt19937 rng(fill);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    uint32_t nsorted = nrecords / 2;
+    for (uint32_t i = 0; i < nsorted; ++i) {
+      node->Insert(keys[i].c_str(), keys[i].length(), i, pool, kLeafNodeSize + 1);
+    }
+    auto *sorted_node = node->Consolidate(pool);
+    for (uint32_t i = nsorted; i < nrecords; ++i) {
+      sorted_node->Insert(keys[i].c_str(), keys[i].length(), i, pool, kLeafNodeSize + 1);
+    }
+
+    std::vector<uint32_t> order(kReadsPerRound);
+    for (auto &o : order) {
+      o = rng() % nrecords;
+    }
+
+    uint64_t payload = 0;
+    uint64_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto o : order) {
+      found += sorted_node->Read(keys[o].c_str(), keys[o].length(), &payload, pool).IsOk();
+    }
+    double ns = NanosPerOp(start, kReadsPerRound);
+    ALWAYS_ASSERT(found == kReadsPerRound);
+    std::cout << fill << "\t" << nrecords << "\t" << nsorted << "\t" << ns << std::endl;
+
+    pmwcas::Allocator::Get()->Free(node);
+    pmwcas::Allocator::Get()->Free(sorted_node);
+  }
+}
+
+// Load sorted integer keys into an empty tree with Insert vs. BulkLoad
+void BulkLoadVsInsert() {
+  static const uint32_t kRecords = 1000000;
+  std::cout << "== bulk_load: loading " << kRecords << " sorted integer keys" << std::endl;
+  std::vector<std::pair<std::string, uint64_t>> records;
+  for (uint64_t i = 0; i < kRecords; ++i) {
+    bztree::IntegerKey key(i);
+    records.emplace_back(std::string(key.GetData(), key.GetSize()), i);
+  }
+
+  bztree::BzTree::ParameterSet param;
+  auto *tree = bztree::BzTree::New(param, pool);
+  auto start = std::chrono::steady_clock::now();
+  for (auto &r : records) {
+    tree->Insert(r.first.data(), r.first.size(), r.second);
+  }
+  std::cout << "insert:\t" << NanosPerOp(start, kRecords) << " ns/record" << std::endl;
+
+  tree = bztree::BzTree::New(param, pool);
+  start = std::chrono::steady_clock::now();
+  ALWAYS_ASSERT(tree->BulkLoad(records.begin(), records.end()).IsOk());
+  std::cout << "bulk load:\t" << NanosPerOp(start, kRecords) << " ns/record" << std::endl;
+}
+
+// Short range scans (100 records from a random start key) with the copying
+// Iterator vs. the visitor-based Scan
+void IteratorVsScan() {
+  static const uint32_t kRecords = 1000000;
+  static const uint32_t kScans = 100000;
+  static const uint32_t kScanSize = 100;
+  std::cout << "== scan: " << kScans << " scans of " << kScanSize << " records" << std::endl;
+  bztree::BzTree::ParameterSet param;
+  auto *tree = bztree::BzTree::New(param, pool);
+  std::vector<uint64_t> keys(kRecords);
+  for (uint64_t i = 0; i < kRecords; ++i) {
+    keys[i] = i;
+  }
+  std::mt19937 rng(0);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  for (auto k : keys) {
+    tree->Insert(k, k);
+  }
+
+  std::vector<uint64_t> starts(kScans);
+  for (auto &s : starts) {
+    s = rng() % (kRecords - kScanSize);
+  }
+
+  uint64_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (auto s : starts) {
+    bztree::IntegerKey key(s);
+    auto iter = tree->RangeScanBySize(key, kScanSize);
+    while (auto r = iter->GetNext()) {
+      sum += r->GetPayload();
+    }
+  }
+  std::cout << "iterator:\t" << NanosPerOp(start, kScans) << " ns/scan" << std::endl;
+
+  uint64_t visitor_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (auto s : starts) {
+    tree->Scan(s, kScanSize, [&visitor_sum](const char *, uint16_t, uint64_t payload) {
+      visitor_sum += payload;
+      return true;
+    });
+  }
+  std::cout << "visitor:\t" << NanosPerOp(start, kScans) << " ns/scan" << std::endl;
+  ALWAYS_ASSERT(visitor_sum == sum);
+}
+
+// Batches of random point reads with MultiRead and InterleavedRead vs. a loop
+// of Read calls
+void MultiReadVsRead() {
+  static const uint32_t kRecords = 1000000;
+  static const uint32_t kReads = 1000000;
+  std::cout << "== multi_read: " << kReads << " random reads on " << kRecords << " records"
+            << std::endl;
+  std::vector<std::pair<std::string, uint64_t>> records;
+  for (uint64_t i = 0; i < kRecords; ++i) {
+    bztree::IntegerKey key(i);
+    records.emplace_back(std::string(key.GetData(), key.GetSize()), i);
+  }
+  bztree::BzTree::ParameterSet param;
+  auto *tree = bztree::BzTree::New(param, pool);
+  ALWAYS_ASSERT(tree->BulkLoad(records.begin(), records.end(), 0.75).IsOk());
+
+  std::mt19937 rng(0);
+  std::vector<uint64_t> keys(kReads);
+  for (auto &k : keys) {
+    k = rng() % kRecords;
+  }
+  std::vector<uint64_t> payloads(kReads);
+  std::vector<bztree::ReturnCode> rcs(kReads);
+
+  uint64_t found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < kReads; ++i) {
+    found += tree->Read(keys[i], &payloads[i]).IsOk();
+  }
+  std::cout << "read:\t" << NanosPerOp(start, kReads) << " ns/key" << std::endl;
+  ALWAYS_ASSERT(found == kReads);
+
+  std::cout << "batch\tns/key" << std::endl;
+  for (uint32_t batch : {8, 32, 128, 256}) {
+    found = 0;
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i + batch <= kReads; i += batch) {
+      found += tree->MultiRead(&keys[i], batch, &payloads[i], &rcs[i]);
+    }
+    std::cout << batch << "\t" << NanosPerOp(start, found) << std::endl;
+    ALWAYS_ASSERT(found == kReads / batch * batch);
+  }
+
+  std::cout << "interleaved (batch 256)" << std::endl;
+  std::cout << "inflight\tns/key" << std::endl;
+  static const uint32_t kBatch = 256;
+  for (uint32_t inflight : {4, 8, 16, 32}) {
+    found = 0;
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i + kBatch <= kReads; i += kBatch) {
+      found += tree->InterleavedRead(&keys[i], kBatch, &payloads[i], &rcs[i], inflight);
+    }
+    std::cout << inflight << "\t" << NanosPerOp(start, found) << std::endl;
+    ALWAYS_ASSERT(found == kReads / kBatch * kBatch);
+  }
+}
+
+// Random point reads on trees with small nodes, i.e., 4-5 levels deep, where
+// most of the time goes to searching internal nodes
+void DeepTreeRead() {
+  static const uint32_t kRecords = 1000000;
+  static const uint32_t kReads = 1000000;
+  static const uint32_t kNodeSize = 1024;
+  std::cout << "== deep_read: " << kReads << " random reads on " << kRecords
+            << " records, " << kNodeSize << "-byte nodes" << std::endl;
+  std::cout << "keys	levels	ns/read" << std::endl;
+  std::mt19937_64 rng(0);
+  for (uint32_t key_size : {8, 16}) {
+    // 8-byte integer keys, or random 16-digit keys
+    std::vector<std::pair<std::string, uint64_t>> records;
+    for (uint64_t i = 0; i < kRecords; ++i) {
+      if (key_size == 8) {
+        bztree::IntegerKey key(i);
+        records.emplace_back(std::string(key.GetData(), key.GetSize()), i);
+      } else {
+        auto str = std::to_string(rng() % 10000000000000000ull);
+        records.emplace_back(std::string(key_size - str.length(), '0') + str, i);
+      }
+    }
+    std::sort(records.begin(), records.end());
+    records.erase(std::unique(records.begin(), records.end(),
+                              [](const std::pair<std::string, uint64_t> &r1,
+                                 const std::pair<std::string, uint64_t> &r2) {
+                                return r1.first == r2.first;
+                              }), records.end());
+
+    bztree::BzTree::ParameterSet param(kNodeSize, 0, kNodeSize);
+    auto *tree = bztree::BzTree::New(param, pool);
+    ALWAYS_ASSERT(tree->BulkLoad(records.begin(), records.end(), 0.75).IsOk());
+    bztree::Stack stack;
+    {
+      pmwcas::EpochGuard guard(pool->GetEpoch());
+      tree->TraverseToLeaf(&stack, records[0].first.data(), key_size);
+    }
+
+    std::vector<uint32_t> order(kReads);
+    for (auto &o : order) {
+      o = rng() % records.size();
+    }
+    uint64_t payload = 0;
+    uint64_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto o : order) {
+      found += tree->Read(records[o].first.data(), key_size, &payload).IsOk();
+    }
+    double ns = NanosPerOp(start, kReads);
+    ALWAYS_ASSERT(found == kReads);
+    std::cout << key_size << " B\t" << stack.num_frames + 1 << "\t" << ns << std::endl;
+  }
+}
+
+// Inserts of increasing keys (e.g., timestamps) vs. the same keys in random
+// order, and the leaves they leave behind with right-most leaves split 90/10
+// or evenly
+void AppendInsert() {
+  static const uint32_t kRecords = 1000000;
+  std::cout << "== append: inserting " << kRecords << " integer keys" << std::endl;
+  std::cout << "order\tsplit\tns/insert\tleaves\tleaf MB\trecords/leaf" << std::endl;
+  std::vector<uint64_t> keys(kRecords);
+  for (uint32_t i = 0; i < kRecords; ++i) {
+    keys[i] = i;
+  }
+  for (bool sequential : {true, false}) {
+    if (!sequential) {
+      std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+    }
+    for (float fill : {0.9f, 0.5f}) {
+      bztree::BzTree::ParameterSet param;
+      param.append_split_fill = fill;
+      auto *tree = bztree::BzTree::New(param, pool);
+      auto start = std::chrono::steady_clock::now();
+      for (auto k : keys) {
+        tree->Insert(k, k);
+      }
+      double ns = NanosPerOp(start, kRecords);
+
+      uint64_t leaves = 0;
+      uint64_t leaf_bytes = 0;
+      {
+        pmwcas::EpochGuard guard(pool->GetEpoch());
+        bztree::Stack stack;
+        const char *fence = nullptr;
+        uint16_t fence_size = 0;
+        auto *leaf = tree->TraverseToLeaf(&stack, "", 0);
+        for (; leaf; leaf = tree->NextLeaf(&stack, &fence, &fence_size)) {
+          ++leaves;
+          leaf_bytes += leaf->GetHeader()->size;
+        }
+      }
+      std::cout << (sequential ? "seq" : "random") << "\t"
+                << static_cast<uint32_t>(fill * 100) << "/"
+                << static_cast<uint32_t>(100 - fill * 100) << "\t" << ns << "\t"
+                << leaves << "\t" << leaf_bytes / 1048576.0 << "\t"
+                << static_cast<double>(kRecords) / leaves << std::endl;
+    }
+  }
+}
+
+// Point reads that revisit the same leaves: in key order, in runs of 64
+// consecutive keys from random starting points, and at random, with and
+// without per-thread leaf hints
+void LeafHintRead() {
+  static const uint32_t kRecords = 1000000;
+  static const uint32_t kReads = 1000000;
+  static const uint32_t kRun = 64;
+  static const uint32_t kNodeSize = 1024;
+  std::cout << "== leaf_hints: " << kReads << " reads on " << kRecords
+            << " integer keys, " << kNodeSize << "-byte nodes" << std::endl;
+  std::cout << "order\thints\tns/read\thit %" << std::endl;
+  std::vector<std::pair<std::string, uint64_t>> records;
+  for (uint64_t i = 0; i < kRecords; ++i) {
+    bztree::IntegerKey key(i);
+    records.emplace_back(std::string(key.GetData(), key.GetSize()), i);
+  }
+  std::mt19937_64 rng(0);
+  for (const char *pattern : {"seq", "runs", "random"}) {
+    std::vector<uint64_t> order(kReads);
+    for (uint32_t i = 0; i < kReads; ++i) {
+      if (pattern[0] == 's') {
+        order[i] = i % kRecords;
+      } else if (pattern[0] == 'r' && pattern[1] == 'u') {
+        order[i] = i % kRun ? (order[i - 1] + 1) % kRecords : rng() % kRecords;
+      } else {
+        order[i] = rng() % kRecords;
+      }
+    }
+    for (bool hints : {false, true}) {
+      bztree::BzTree::ParameterSet param(kNodeSize, 0, kNodeSize);
+      param.leaf_hints = hints;
+      auto *tree = bztree::BzTree::New(param, pool);
+      ALWAYS_ASSERT(tree->BulkLoad(records.begin(), records.end(), 0.75).IsOk());
+      uint64_t payload = 0;
+      uint64_t found = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (auto o : order) {
+        found += tree->Read(o, &payload).IsOk();
+      }
+      double ns = NanosPerOp(start, kReads);
+      ALWAYS_ASSERT(found == kReads);
+      auto stats = tree->GetStats();
+      uint64_t lookups = stats.leaf_hint_hits + stats.leaf_hint_misses;
+      std::cout << pattern << "\t" << (hints ? "on" : "off") << "\t" << ns << "\t";
+      if (lookups) {
+        std::cout << 100.0 * stats.leaf_hint_hits / lookups << std::endl;
+      } else {
+        std::cout << "-" << std::endl;
+      }
+    }
+  }
+}
+
+// Random reads of values stored inline in the leaves vs. values in a side
+// heap, whose addresses are the payloads, for values of different sizes.
+// Inline values save the access to the heap, but larger ones spread the keys
+// a leaf search reads over more cache lines, and over more leaves.
+void InlineValueRead() {
+  static const uint32_t kRecords = 200000;
+  static const uint32_t kReads = 1000000;
+  std::cout << "== values: " << kReads << " random reads of " << kRecords
+            << " values" << std::endl;
+  std::cout << "size\tvalues\tns/insert\tns/read" << std::endl;
+  std::mt19937_64 rng(0);
+  std::vector<uint64_t> keys(kRecords);
+  for (uint32_t i = 0; i < kRecords; ++i) {
+    keys[i] = i;
+  }
+  std::shuffle(keys.begin(), keys.end(), rng);
+  std::vector<uint64_t> order(kReads);
+  for (auto &o : order) {
+    o = rng() % kRecords;
+  }
+  for (uint32_t size : {16, 64, 256, 1024}) {
+    std::string value(size, 'v');
+    for (bool inline_values : {false, true}) {
+      bztree::BzTree::ParameterSet param;
+      // Values over max_inline_value go to blobs
+      auto *tree = bztree::BzTree::New(param, pool);
+      std::vector<char *> heap;
+      auto start = std::chrono::steady_clock::now();
+      for (auto k : keys) {
+        if (inline_values) {
+          tree->InsertValue(k, value.data(), size);
+        } else {
+          auto *v = static_cast<char *>(malloc(size));
+          memcpy(v, value.data(), size);
+          heap.push_back(v);
+          tree->Insert(k, reinterpret_cast<uint64_t>(v));
+        }
+      }
+      double insert_ns = NanosPerOp(start, kRecords);
+
+      std::string out;
+      uint64_t bytes = 0;
+      start = std::chrono::steady_clock::now();
+      for (auto o : order) {
+        if (inline_values) {
+          tree->ReadValue(o, &out);
+        } else {
+          uint64_t payload = 0;
+          tree->Read(o, &payload);
+          out.assign(reinterpret_cast<char *>(payload), size);
+        }
+        bytes += out.size();
+      }
+      double read_ns = NanosPerOp(start, kReads);
+      ALWAYS_ASSERT(bytes == uint64_t{kReads} * size);
+      std::cout << size << " B\t"
+                << (!inline_values ? "heap" : size > param.max_inline_value ? "blob" : "inline")
+                << "\t" << insert_ns << "\t" << read_ns << std::endl;
+      for (auto *v : heap) {
+        free(v);
+      }
+    }
+  }
+}
+
+// Cost of payloads that use the top four bits, which go to a word after the
+// payload word and make every update append a new version of the record,
+// compared with payloads below 2^60 that are updated in place
+void FullPayloadOps() {
+  static const uint32_t kRecords = 200000;
+  static const uint32_t kOps = 1000000;
+  std::cout << "== full_payloads: " << kOps << " random reads and updates of " << kRecords
+            << " records" << std::endl;
+  std::cout << "payloads\tns/insert\tns/read\tns/update\tns/scan" << std::endl;
+  std::mt19937_64 rng(0);
+  std::vector<uint64_t> keys(kRecords);
+  for (uint32_t i = 0; i < kRecords; ++i) {
+    keys[i] = i;
+  }
+  std::shuffle(keys.begin(), keys.end(), rng);
+  std::vector<uint64_t> order(kOps);
+  for (auto &o : order) {
+    o = rng() % kRecords;
+  }
+  for (bool full : {false, true}) {
+    // Hashes of the keys, with the top four bits cleared or set
+    auto make_payload = [full](uint64_t k) {
+      uint64_t hash = (k + 1) * 0x9E3779B97F4A7C15ull;
+      return full ? hash | (uint64_t{0xF} << 60) : hash >> 4;
+    };
+    bztree::BzTree::ParameterSet param;
+    auto *tree = bztree::BzTree::New(param, pool);
+    auto start = std::chrono::steady_clock::now();
+    for (auto k : keys) {
+      tree->Insert(k, make_payload(k));
+    }
+    double insert_ns = NanosPerOp(start, kRecords);
+
+    uint64_t payload = 0;
+    uint64_t sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (auto o : order) {
+      tree->Read(o, &payload);
+      sum += payload;
+    }
+    double read_ns = NanosPerOp(start, kOps);
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < kOps; ++i) {
+      tree->Update(order[i], make_payload(order[i] + i));
+    }
+    double update_ns = NanosPerOp(start, kOps);
+
+    start = std::chrono::steady_clock::now();
+    auto scanned = tree->Scan(uint64_t{0}, kRecords,
+                              [&sum](const char *, uint16_t, uint64_t p) {
+                                sum += p;
+                                return true;
+                              });
+    double scan_ns = NanosPerOp(start, scanned);
+    ALWAYS_ASSERT(scanned == kRecords && sum != 0);
+    std::cout << (full ? "64-bit" : "60-bit") << "\t" << insert_ns << "\t" << read_ns << "\t"
+              << update_ns << "\t" << scan_ns << std::endl;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  pmwcas::InitLibrary(pmwcas::DefaultAllocator::Create,
+                      pmwcas::DefaultAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+  pool = new pmwcas::DescriptorPool(10000, 1, false);
+
+  std::string which = argc > 1 ? argv[1] : "";
+  if (which.empty() || which == "leaf_read") {
+    LeafReadByFill();
+  }
+  if (which.empty() || which == "bulk_load") {
+    BulkLoadVsInsert();
+  }
+  if (which.empty() || which == "scan") {
+    IteratorVsScan();
+  }
+  if (which.empty() || which == "multi_read") {
+    MultiReadVsRead();
+  }
+  if (which.empty() || which == "deep_read") {
+    DeepTreeRead();
+  }
+  if (which.empty() || which == "append") {
+    AppendInsert();
+  }
+  if (which.empty() || which == "leaf_hints") {
+    LeafHintRead();
+  }
+  if (which.empty() || which == "values") {
+    InlineValueRead();
+  }
+  if (which.empty() || which == "full_payloads") {
+    FullPayloadOps();
+  }
+
+  delete pool;
+  pmwcas::Thread::ClearRegistry();
+  return 0;
+}
@@ -7,6 +7,7 @@
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <atomic>
 #include <random>
 
 #include "util/performance_test.h"
@@ -91,6 +92,38 @@ struct MultiThreadInsertTest : public pmwcas::PerformanceTest {
   }
 };
 
+// All threads append increasing integer keys, taken from a shared counter, to
+// the right-most leaf
+struct MultiThreadAppendTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t total_records;
+  std::atomic<uint32_t> next_key;
+  MultiThreadAppendTest(uint32_t total_records, bztree::BzTree *tree)
+      : tree(tree), total_records(total_records), next_key(0) {}
+
+  void SanityCheck() {
+    uint64_t payload;
+    for (uint32_t i = 0; i < total_records; ++i) {
+      ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+      ASSERT_EQ(payload, i);
+    }
+    uint32_t next = 0;
+    auto visitor = [&next](const char *key, uint16_t, uint64_t payload) {
+      EXPECT_EQ(payload, next);
+      ++next;
+      return true;
+    };
+    ASSERT_EQ(tree->Scan(uint64_t{0}, total_records + 1, visitor), total_records);
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    for (uint32_t i = next_key++; i < total_records; i = next_key++) {
+      ASSERT_TRUE(tree->Insert(i, i).IsOk());
+    }
+  }
+};
+
 struct MultiThreadUpsertTest : public pmwcas::PerformanceTest {
   bztree::BzTree *tree;
   uint32_t item_per_thread;
@@ -175,6 +208,23 @@ GTEST_TEST(BztreeTest, MultiThreadInsertSplitTest) {
   pmwcas::Thread::ClearRegistry(true);
 }
 
+GTEST_TEST(BztreeTest, MultiThreadInsertMaintenanceTest) {
+  uint32_t thread_count = 10;
+  uint32_t item_per_thread = 3000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param;
+  param.max_unsorted_records = 8;
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->StartMaintenanceThread(1);
+  MultiThreadInsertTest t(item_per_thread, thread_count, tree.get());
+  t.Run(thread_count);
+  tree->StopMaintenanceThread();
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
 GTEST_TEST(BztreeTest, MultiThreadInsertInternalSplitTest) {
   uint32_t thread_count = 50;
   uint32_t item_per_thread = 10000;
@@ -189,6 +239,41 @@ GTEST_TEST(BztreeTest, MultiThreadInsertInternalSplitTest) {
   pmwcas::Thread::ClearRegistry(true);
 }
 
+GTEST_TEST(BztreeTest, MultiThreadInsertBackoffTest) {
+  uint32_t thread_count = 50;
+  uint32_t item_per_thread = 2000;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  param.max_freeze_retry = 3;
+  param.backoff_max_pause = 64;
+  param.backoff_yield = true;
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadInsertTest t(item_per_thread, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+#if ENABLE_STATS
+  // Every retry on a frozen node waits first
+  auto stats = tree->GetStats();
+  ASSERT_GE(stats.backoff_pauses + stats.backoff_yields, stats.frozen_retries);
+#endif
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+GTEST_TEST(BztreeTest, MultiThreadAppendTest) {
+  uint32_t thread_count = 10;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadAppendTest t(100000, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
 GTEST_TEST(BztreeTest, MiltiUpsertTest) {
   uint32_t thread_count = 50;
   uint32_t item_per_thread = 1000;
@@ -202,6 +287,64 @@ GTEST_TEST(BztreeTest, MiltiUpsertTest) {
   t.SanityCheck();
   pmwcas::Thread::ClearRegistry(true);
 }
+// Even keys are loaded up front; half of the threads insert the odd keys,
+// splitting and consolidating leaves, while the other half scan
+struct MultiThreadScanTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint32_t total_records;
+  uint32_t thread_count;
+  std::atomic<uint32_t> inserters_done;
+  MultiThreadScanTest(uint32_t total_records, uint32_t thread_count, bztree::BzTree *tree)
+      : tree(tree), total_records(total_records), thread_count(thread_count),
+        inserters_done(0) {
+    for (uint64_t i = 0; i < total_records; i += 2) {
+      ALWAYS_ASSERT(tree->Insert(i, i).IsOk());
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    if (thread_index % 2 == 0) {
+      for (uint64_t i = thread_index + 1; i < total_records; i += thread_count) {
+        ASSERT_TRUE(tree->Insert(i, i).IsOk());
+      }
+      ++inserters_done;
+      return;
+    }
+
+    std::mt19937 rng(thread_index);
+    while (inserters_done < thread_count / 2) {
+      uint64_t begin = rng() % total_records;
+      uint64_t prev = begin;
+      uint32_t evens = 0;
+      bool first = true;
+      tree->Scan(begin, 300, [&](const char *key, uint16_t key_size, uint64_t payload) {
+        uint64_t k = bztree::IntegerKey::Decode(key);
+        EXPECT_EQ(k, payload);
+        EXPECT_TRUE(first ? k >= prev : k > prev);
+        first = false;
+        prev = k;
+        evens += k % 2 == 0;
+        return true;
+      });
+      // No preloaded key can be skipped
+      ASSERT_EQ(evens, prev / 2 - (begin + 1) / 2 + 1);
+    }
+  }
+};
+
+GTEST_TEST(BztreeTest, MultiThreadScanTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadScanTest t(100000, thread_count, tree.get());
+  t.Run(thread_count);
+  pmwcas::Thread::ClearRegistry(true);
+}
+
 struct MultiThreadDeleteTest : public pmwcas::PerformanceTest {
   bztree::BzTree *tree;
   uint32_t item_per_thread;
@@ -273,6 +416,329 @@ GTEST_TEST(MultiThreadDeleteTest, MultiLevelDeleteTest) {
   t.SanityCheck();
   pmwcas::Thread::ClearRegistry(true);
 }
+GTEST_TEST(MultiThreadDeleteTest, MergeOnDeleteTest) {
+  uint32_t thread_count = 30;
+  uint32_t item_per_thread = 100;
+  uint32_t total_record = 3200;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  param.merge_policy = bztree::BzTree::ParameterSet::MergeOnDelete;
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadDeleteTest t(item_per_thread, thread_count, total_record, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+#if ENABLE_STATS
+  ASSERT_GT(tree->GetStats().merges, 0);
+#endif
+  pmwcas::Thread::ClearRegistry(true);
+}
+GTEST_TEST(MultiThreadDeleteTest, DeferredMergeTest) {
+  uint32_t thread_count = 30;
+  uint32_t item_per_thread = 100;
+  uint32_t total_record = 3200;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  param.merge_policy = bztree::BzTree::ParameterSet::MergeDeferred;
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->StartMaintenanceThread(1);
+  MultiThreadDeleteTest t(item_per_thread, thread_count, total_record, tree.get());
+  t.Run(thread_count);
+  tree->StopMaintenanceThread();
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+
+// Threads insert and delete their own keys in rounds, so that leaves are split
+// and merged concurrently; every 16th key of the last round stays
+struct MultiThreadInsertDeleteTest : public pmwcas::PerformanceTest {
+  bztree::BzTree *tree;
+  uint64_t item_per_thread;
+  uint64_t thread_count;
+  static const uint32_t kRounds = 4;
+  MultiThreadInsertDeleteTest(uint64_t item_per_thread, uint64_t thread_count,
+                              bztree::BzTree *tree)
+      : tree(tree), item_per_thread(item_per_thread), thread_count(thread_count) {}
+
+  void SanityCheck() {
+    uint64_t payload;
+    for (uint64_t i = 0; i < item_per_thread * thread_count; ++i) {
+      ASSERT_EQ(tree->Read(i, &payload).IsOk(), i / thread_count % 16 == 0);
+    }
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    for (uint32_t round = 0; round < kRounds; ++round) {
+      for (uint64_t i = 0; i < item_per_thread; ++i) {
+        uint64_t key = i * thread_count + thread_index;
+        ASSERT_TRUE(tree->Insert(key, key).IsOk());
+      }
+      for (uint64_t i = 0; i < item_per_thread; ++i) {
+        uint64_t key = i * thread_count + thread_index;
+        if (round + 1 < kRounds || i % 16 != 0) {
+          ASSERT_TRUE(tree->Delete(key).IsOk());
+        }
+      }
+    }
+  }
+};
+GTEST_TEST(MultiThreadDeleteTest, MergeWithSplitsTest) {
+  uint32_t thread_count = 8;
+  for (auto policy : {bztree::BzTree::ParameterSet::MergeOnDelete,
+                      bztree::BzTree::ParameterSet::MergeDeferred}) {
+    std::unique_ptr<pmwcas::DescriptorPool> pool(
+        new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+    );
+    bztree::BzTree::ParameterSet param(1024, 512, 1024);
+    param.merge_policy = policy;
+    std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+    if (policy == bztree::BzTree::ParameterSet::MergeDeferred) {
+      tree->StartMaintenanceThread(1);
+    }
+    MultiThreadInsertDeleteTest t(4000, thread_count, tree.get());
+    t.Run(thread_count);
+    if (policy == bztree::BzTree::ParameterSet::MergeDeferred) {
+      tree->StopMaintenanceThread();
+    }
+    t.SanityCheck();
+#if ENABLE_STATS
+    ASSERT_GT(tree->GetStats().merges, 0);
+#endif
+    pmwcas::Thread::ClearRegistry(true);
+  }
+}
+GTEST_TEST(MultiThreadDeleteTest, LeafHintsTest) {
+  // Cached leaves are frozen and replaced by splits and merges under the
+  // threads that still hint at them
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 512, 1024);
+  param.merge_policy = bztree::BzTree::ParameterSet::MergeDeferred;
+  param.leaf_hints = true;
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  tree->StartMaintenanceThread(1);
+  MultiThreadInsertDeleteTest t(4000, thread_count, tree.get());
+  t.Run(thread_count);
+  tree->StopMaintenanceThread();
+  t.SanityCheck();
+#if ENABLE_STATS
+  ASSERT_GT(tree->GetStats().leaf_hint_hits, 0);
+#endif
+  pmwcas::Thread::ClearRegistry(true);
+}
+// Threads insert values for their own keys and replace the values of shared
+// keys, reading shared keys in between. A value is one byte repeated a number
+// of times that depends on the byte, so torn reads or lost versions show.
+struct MultiThreadValueTest : public pmwcas::PerformanceTest {
+  static const uint64_t kSharedKeys = 64;
+  bztree::BzTree *tree;
+  uint64_t item_per_thread;
+  uint64_t thread_count;
+  MultiThreadValueTest(uint64_t item_per_thread, uint64_t thread_count, bztree::BzTree *tree)
+      : tree(tree), item_per_thread(item_per_thread), thread_count(thread_count) {
+    for (uint64_t i = 0; i < kSharedKeys; ++i) {
+      auto v = MakeValue(i);
+      ALWAYS_ASSERT(tree->InsertValue(i, v.data(), static_cast<uint32_t>(v.size())).IsOk());
+    }
+  }
+
+  static std::string MakeValue(uint64_t n) {
+    return std::string(n % 40, static_cast<char>('a' + n % 40 % 26));
+  }
+  static bool IsValue(const std::string &v) {
+    return v == MakeValue(v.size());
+  }
+
+  void SanityCheck() {
+    std::string value;
+    for (uint64_t i = 0; i < kSharedKeys + item_per_thread * thread_count; ++i) {
+      ASSERT_TRUE(tree->ReadValue(i, &value).IsOk());
+      ASSERT_TRUE(i < kSharedKeys ? IsValue(value) : value == MakeValue(i));
+    }
+    // Only the latest version of each record is visible
+    auto scanned = tree->Scan(uint64_t{0}, (uint32_t) -1,
+                              [](const char *, uint16_t, uint64_t) { return true; });
+    ASSERT_EQ(scanned, kSharedKeys + item_per_thread * thread_count);
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    std::string value;
+    for (uint64_t i = 0; i < item_per_thread; ++i) {
+      uint64_t n = i * thread_count + thread_index;
+      auto v = MakeValue(kSharedKeys + n);
+      ASSERT_TRUE(tree->InsertValue(kSharedKeys + n, v.data(),
+                                    static_cast<uint32_t>(v.size())).IsOk());
+      v = MakeValue(n);
+      ASSERT_TRUE(tree->UpdateValue(n % kSharedKeys, v.data(),
+                                    static_cast<uint32_t>(v.size())).IsOk());
+      ASSERT_TRUE(tree->ReadValue(n * 7 % kSharedKeys, &value).IsOk());
+      ASSERT_TRUE(IsValue(value));
+    }
+  }
+};
+GTEST_TEST(BztreeTest, MultiThreadValueTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadValueTest t(2000, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+GTEST_TEST(BztreeTest, MultiThreadBlobTest) {
+  // Values longer than 16 bytes go to blobs, so versions of shared keys move
+  // between blobs and inline values and old blobs are retired concurrently
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  param.max_inline_value = 16;
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadValueTest t(2000, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+#if ENABLE_STATS
+  ASSERT_GT(tree->GetStats().blobs_retired, 0);
+#endif
+  pmwcas::Thread::ClearRegistry(true);
+}
+// Threads upsert their own keys and update shared keys, reading shared keys
+// in between. Payloads of odd numbers have their top four bits set, so
+// records switch between overflowing and plain payloads; a payload is valid if
+// its top four bits match the parity of the rest.
+struct MultiThreadFullPayloadTest : public pmwcas::PerformanceTest {
+  static const uint64_t kSharedKeys = 64;
+  static const uint64_t kTopBits = uint64_t{0xF} << 60;
+  bztree::BzTree *tree;
+  uint64_t item_per_thread;
+  uint64_t thread_count;
+  MultiThreadFullPayloadTest(uint64_t item_per_thread, uint64_t thread_count,
+                             bztree::BzTree *tree)
+      : tree(tree), item_per_thread(item_per_thread), thread_count(thread_count) {
+    for (uint64_t i = 0; i < kSharedKeys; ++i) {
+      ALWAYS_ASSERT(tree->Insert(i, MakePayload(i)).IsOk());
+    }
+  }
+
+  static uint64_t MakePayload(uint64_t n) {
+    return n % 2 ? n | kTopBits : n;
+  }
+  static bool IsPayload(uint64_t p) {
+    return p == MakePayload(p & ~kTopBits);
+  }
+
+  void SanityCheck() {
+    uint64_t payload = 0;
+    for (uint64_t i = 0; i < kSharedKeys + item_per_thread * thread_count; ++i) {
+      ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+      ASSERT_TRUE(i < kSharedKeys ? IsPayload(payload) : payload == MakePayload(i));
+    }
+    auto scanned = tree->Scan(uint64_t{0}, (uint32_t) -1,
+                              [](const char *, uint16_t, uint64_t payload) {
+                                EXPECT_TRUE(IsPayload(payload));
+                                return true;
+                              });
+    ASSERT_EQ(scanned, kSharedKeys + item_per_thread * thread_count);
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    uint64_t payload = 0;
+    for (uint64_t i = 0; i < item_per_thread; ++i) {
+      uint64_t n = i * thread_count + thread_index;
+      ASSERT_TRUE(tree->Upsert(kSharedKeys + n, MakePayload(kSharedKeys + n)).IsOk());
+      ASSERT_TRUE(tree->Update(n % kSharedKeys, MakePayload(n)).IsOk());
+      ASSERT_TRUE(tree->Read(n * 7 % kSharedKeys, &payload).IsOk());
+      ASSERT_TRUE(IsPayload(payload));
+    }
+  }
+};
+GTEST_TEST(BztreeTest, MultiThreadFullPayloadTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadFullPayloadTest t(2000, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
+// Threads add to shared counters, with FetchAdd and with CompareAndSwap
+// loops; no increment may be lost. Half of the counters start right below
+// 2^60 and soon overflow, so their increments replace records instead of
+// updating them in place.
+struct MultiThreadReadModifyWriteTest : public pmwcas::PerformanceTest {
+  static const uint64_t kCounters = 16;
+  bztree::BzTree *tree;
+  uint64_t item_per_thread;
+  uint64_t thread_count;
+  MultiThreadReadModifyWriteTest(uint64_t item_per_thread, uint64_t thread_count,
+                                 bztree::BzTree *tree)
+      : tree(tree), item_per_thread(item_per_thread), thread_count(thread_count) {
+    for (uint64_t i = 0; i < kCounters; ++i) {
+      ALWAYS_ASSERT(tree->Insert(i, InitialValue(i)).IsOk());
+    }
+  }
+
+  static uint64_t InitialValue(uint64_t counter) {
+    return counter % 2 ? bztree::LeafNode::kOverflowPayload - 100 : 0;
+  }
+
+  void SanityCheck() {
+    uint64_t payload = 0;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < kCounters; ++i) {
+      ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+      total += payload - InitialValue(i);
+    }
+    ASSERT_EQ(total, item_per_thread * thread_count);
+  }
+
+  void Entry(size_t thread_index) override {
+    WaitForStart();
+    for (uint64_t i = 0; i < item_per_thread; ++i) {
+      uint64_t counter = (i * thread_count + thread_index) % kCounters;
+      if (i % 2) {
+        ASSERT_TRUE(tree->FetchAdd(counter, 1).IsOk());
+        continue;
+      }
+      uint64_t payload = 0;
+      ASSERT_TRUE(tree->Read(counter, &payload).IsOk());
+      while (true) {
+        auto rc = tree->CompareAndSwap(counter, payload, payload + 1, &payload);
+        if (rc.IsOk()) {
+          break;
+        }
+        ASSERT_TRUE(rc.IsPMWCASFailure());
+      }
+    }
+  }
+};
+GTEST_TEST(BztreeTest, MultiThreadReadModifyWriteTest) {
+  uint32_t thread_count = 8;
+  std::unique_ptr<pmwcas::DescriptorPool> pool(
+      new pmwcas::DescriptorPool(descriptor_pool_size, thread_count, false)
+  );
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  std::unique_ptr<bztree::BzTree> tree = std::make_unique<bztree::BzTree>(param, pool.get());
+  MultiThreadReadModifyWriteTest t(5000, thread_count, tree.get());
+  t.Run(thread_count);
+  t.SanityCheck();
+  pmwcas::Thread::ClearRegistry(true);
+}
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   pmwcas::InitLibrary(pmwcas::DefaultAllocator::Create,
@@ -78,64 +78,59 @@ bztree_wrapper::~bztree_wrapper() { pmwcas::Thread::ClearRegistry(); }
 
 bool bztree_wrapper::find(const char *key, size_t key_sz, char *value_out) {
   // FIXME(tzwang): for now only support 8-byte values
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
-  return tree_
-      ->Read(reinterpret_cast<const char *>(&k), key_sz, (uint64_t *)value_out)
-      .IsOk();
+  assert(key_sz == sizeof(uint64_t));
+  uint64_t k = *reinterpret_cast<const uint64_t *>(key);
+  return tree_->Read(k, (uint64_t *)value_out).IsOk();
 }
 
 bool bztree_wrapper::insert(const char *key, size_t key_sz, const char *value,
                             size_t value_sz) {
   // FIXME(tzwang): for now only support 8-byte values
+  assert(key_sz == sizeof(uint64_t));
   assert(value_sz == sizeof(uint64_t));
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
+  uint64_t k = *reinterpret_cast<const uint64_t *>(key);
   uint64_t v = *reinterpret_cast<uint64_t *>(const_cast<char *>(value));
 
   // Mask out the 3 MSBs
   v &= 0x1FFFFFFFFFFFFFFF;
-  return tree_->Insert(reinterpret_cast<const char *>(&k), key_sz, v).IsOk();
+  return tree_->Insert(k, v).IsOk();
 }
 
 bool bztree_wrapper::update(const char *key, size_t key_sz, const char *value,
                             size_t value_sz) {
   // FIXME(tzwang): for now only support 8-byte values
+  assert(key_sz == sizeof(uint64_t));
   assert(value_sz == sizeof(uint64_t));
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
+  uint64_t k = *reinterpret_cast<const uint64_t *>(key);
   uint64_t v = *reinterpret_cast<uint64_t *>(const_cast<char *>(value));
 
   // Mask out the 3 MSBs
   v &= 0x1FFFFFFFFFFFFFFF;
-  return tree_->Update(reinterpret_cast<const char *>(&k), key_sz, v).IsOk();
+  return tree_->Update(k, v).IsOk();
 }
 
 bool bztree_wrapper::remove(const char *key, size_t key_sz) {
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
-  return tree_->Delete(reinterpret_cast<const char *>(&k), key_sz).IsOk();
+  assert(key_sz == sizeof(uint64_t));
+  uint64_t k = *reinterpret_cast<const uint64_t *>(key);
+  return tree_->Delete(k).IsOk();
 }
 
 int bztree_wrapper::scan(const char *key, size_t key_sz, int scan_sz,
                          char *&values_out) {
   static thread_local std::array<char, (1 << 20)> results;
-  uint64_t k = __builtin_bswap64(*reinterpret_cast<const uint64_t *>(key));
+  assert(key_sz == sizeof(uint64_t));
+  bztree::IntegerKey k(*reinterpret_cast<const uint64_t *>(key));
 
-  int scanned = 0;
   char *dst = results.data();
-
-  auto iter = tree_->RangeScanBySize(reinterpret_cast<const char *>(&k), key_sz,
-                                     scan_sz);
-  for (scanned = 0; (scanned < scan_sz); ++scanned) {
-    auto record = iter->GetNext();
-    if (record == nullptr) break;
-
-    uint64_t result_key = __builtin_bswap64(
-        *reinterpret_cast<const uint64_t *>(record->GetKey()));
+  auto copy = [&dst](const char *key, uint16_t key_size, uint64_t payload) {
+    uint64_t result_key = bztree::IntegerKey::Decode(key);
     memcpy(dst, &result_key, sizeof(uint64_t));
     dst += sizeof(uint64_t);
-
-    auto payload = record->GetPayload();
     memcpy(dst, &payload, sizeof(uint64_t));
     dst += sizeof(uint64_t);
-  }
+    return true;
+  };
+  int scanned = tree_->Scan(k.GetData(), k.GetSize(), scan_sz, copy);
   values_out = results.data();
   return scanned;
 }
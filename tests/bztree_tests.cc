@@ -7,6 +7,7 @@
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <random>
 
 #include "../bztree.h"
 
@@ -124,6 +125,24 @@ TEST_F(LeafNodeFixtures, Delete) {
   ASSERT_TRUE(new_node->Read("200", 3, &payload, pool).IsNotFound());
 }
 
+TEST_F(LeafNodeFixtures, DeleteAndReinsertSorted) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  uint64_t payload;
+  ASSERT_TRUE(node->Delete("0", 1, pool).IsOk());
+  ASSERT_TRUE(node->Delete("90", 2, pool).IsOk());
+  ASSERT_TRUE(node->Read("0", 1, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Read("90", 2, &payload, pool).IsNotFound());
+  ASSERT_READ(node, "10", 2, 10);
+  ASSERT_READ(node, "80", 2, 80);
+
+  // Re-inserted keys land in the unsorted field
+  ASSERT_TRUE(node->Insert("90", 2, 91, pool, node_size).IsOk());
+  ASSERT_READ(node, "90", 2, 91);
+  ASSERT_TRUE(node->Insert("90", 2, 92, pool, node_size).IsKeyExists());
+  ASSERT_TRUE(node->Read("0", 1, &payload, pool).IsNotFound());
+}
+
 TEST_F(LeafNodeFixtures, SplitPrep) {
   pmwcas::EpochGuard guard(pool->GetEpoch());
   InsertDummy();
@@ -141,22 +160,266 @@ TEST_F(LeafNodeFixtures, SplitPrep) {
   bztree::LeafNode *right = nullptr;
   node->Freeze(pool);
   bztree::InternalNode *parent = nullptr;
-  node->PrepareForSplit(stack, 3000, pool->AllocateDescriptor(),
+  node->PrepareForSplit(stack, 3000, nullptr, 0, pool->AllocateDescriptor(),
                         pool, &left, &right, &parent, true);
   ASSERT_NE(parent, nullptr);
   ASSERT_NE(left, nullptr);
   ASSERT_NE(right, nullptr);
+
+  // The separator is the shortest key between the two leaves
+  std::string separator;
+  parent->GetFullKey(parent->GetMetadata(1), &separator);
+  std::string left_max;
+  std::string right_min;
+  left->GetFullKey(left->GetMetadata(left->GetHeader()->sorted_count - 1), &left_max);
+  right->GetFullKey(right->GetMetadata(0), &right_min);
+  ASSERT_LE(left_max, separator);
+  ASSERT_LT(separator, right_min);
+  ASSERT_LE(separator.size(), 2);
 }
 TEST_F(LeafNodeFixtures, Update) {
   pmwcas::EpochGuard guard(pool->GetEpoch());
   InsertDummy();
   ASSERT_READ(node, "10", 2, 10);
-  ASSERT_TRUE(node->Update("10", 2, 11, pool).IsOk());
+  ASSERT_TRUE(node->Update("10", 2, 11, pool, node_size).IsOk());
   ASSERT_READ(node, "10", 2, 11);
 
   ASSERT_READ(node, "200", 3, 200);
-  ASSERT_TRUE(node->Update("200", 3, 201, pool).IsOk());
+  ASSERT_TRUE(node->Update("200", 3, 201, pool, node_size).IsOk());
+  ASSERT_READ(node, "200", 3, 201);
+}
+
+TEST_F(LeafNodeFixtures, Upsert) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  auto record_count = node->GetHeader()->GetStatus().GetRecordCount();
+
+  // Existing records in both fields are updated in place
+  ASSERT_TRUE(node->Upsert("10", 2, 11, pool, node_size).IsOk());
+  ASSERT_READ(node, "10", 2, 11);
+  ASSERT_TRUE(node->Upsert("200", 3, 201, pool, node_size).IsOk());
   ASSERT_READ(node, "200", 3, 201);
+  ASSERT_EQ(node->GetHeader()->GetStatus().GetRecordCount(), record_count);
+
+  // New keys are appended
+  ASSERT_TRUE(node->Upsert("15", 2, 15, pool, node_size).IsOk());
+  ASSERT_READ(node, "15", 2, 15);
+  ASSERT_EQ(node->GetHeader()->GetStatus().GetRecordCount(), record_count + 1);
+
+  // A full node leaves the split to the caller
+  auto used = bztree::LeafNode::GetUsedSpace(node->GetHeader()->GetStatus());
+  ASSERT_TRUE(node->Upsert("16", 2, 16, pool, used).IsNotEnoughSpace());
+  ASSERT_TRUE(node->Upsert("15", 2, 16, pool, used).IsOk());
+  ASSERT_READ(node, "15", 2, 16);
+}
+
+TEST_F(LeafNodeFixtures, ReadModifyWrite) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  uint64_t old_payload = 0;
+  auto add = [](uint64_t delta) {
+    return [delta](uint64_t *payload) {
+      *payload += delta;
+      return true;
+    };
+  };
+  ASSERT_TRUE(node->ReadModifyWrite("10", 2, add(5), &old_payload, pool, node_size).IsOk());
+  ASSERT_EQ(old_payload, 10);
+  ASSERT_READ(node, "10", 2, 15);
+  // Declining leaves the payload as it is
+  ASSERT_TRUE(node->ReadModifyWrite("10", 2, [](uint64_t *) { return false; }, &old_payload,
+                                    pool, node_size).IsOk());
+  ASSERT_EQ(old_payload, 15);
+  ASSERT_READ(node, "10", 2, 15);
+  ASSERT_TRUE(node->ReadModifyWrite("11", 2, add(1), &old_payload, pool, node_size).IsNotFound());
+
+  // Into and out of overflowing payloads, which replace the record
+  const uint64_t flag = bztree::LeafNode::kOverflowPayload;
+  ASSERT_TRUE(node->Update("20", 2, flag - 1, pool, node_size).IsOk());
+  ASSERT_TRUE(node->ReadModifyWrite("20", 2, add(2), &old_payload, pool, node_size).IsOk());
+  ASSERT_READ(node, "20", 2, flag + 1);
+  ASSERT_TRUE(node->ReadModifyWrite("20", 2, add(-2), &old_payload, pool, node_size).IsOk());
+  ASSERT_EQ(old_payload, flag + 1);
+  ASSERT_READ(node, "20", 2, flag - 1);
+}
+
+TEST_F(LeafNodeFixtures, Values) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  std::string value;
+  // A record with just a payload reads as the payload's bytes
+  uint64_t payload = 10;
+  ASSERT_TRUE(node->ReadValue("10", 2, &value, pool).IsOk());
+  ASSERT_EQ(value, std::string(reinterpret_cast<char *>(&payload), sizeof(payload)));
+
+  std::string v1(100, 'a');
+  ASSERT_TRUE(node->InsertValue("abc", 3, v1.data(), v1.size(), pool, node_size).IsOk());
+  ASSERT_TRUE(node->InsertValue("abc", 3, "x", 1, pool, node_size).IsKeyExists());
+  ASSERT_TRUE(node->InsertValue("empty", 5, "", 0, pool, node_size).IsOk());
+  ASSERT_TRUE(node->ReadValue("abc", 3, &value, pool).IsOk());
+  ASSERT_EQ(value, v1);
+  ASSERT_TRUE(node->ReadValue("empty", 5, &value, pool).IsOk());
+  ASSERT_EQ(value, "");
+  // The payload is the value's size
+  ASSERT_READ(node, "abc", 3, v1.size());
+
+  // Updates append new versions, replacing records in both fields
+  auto record_count = node->GetHeader()->GetStatus().GetRecordCount();
+  std::string v2(13, 'b');
+  ASSERT_TRUE(node->UpdateValue("abc", 3, v2.data(), v2.size(), pool, node_size).IsOk());
+  ASSERT_TRUE(node->UpdateValue("20", 2, v1.data(), v1.size(), pool, node_size).IsOk());
+  ASSERT_TRUE(node->UpdateValue("abd", 3, v1.data(), v1.size(), pool, node_size).IsNotFound());
+  ASSERT_EQ(node->GetHeader()->GetStatus().GetRecordCount(), record_count + 2);
+  ASSERT_TRUE(node->ReadValue("abc", 3, &value, pool).IsOk());
+  ASSERT_EQ(value, v2);
+  ASSERT_TRUE(node->ReadValue("20", 2, &value, pool).IsOk());
+  ASSERT_EQ(value, v1);
+
+  // Consolidation keeps only the latest versions
+  auto *new_node = node->Consolidate(pool);
+  delete node;
+  node = new_node;
+  ASSERT_EQ(node->GetHeader()->GetStatus().GetRecordCount(), record_count);
+  ASSERT_TRUE(node->ReadValue("abc", 3, &value, pool).IsOk());
+  ASSERT_EQ(value, v2);
+  ASSERT_TRUE(node->ReadValue("20", 2, &value, pool).IsOk());
+  ASSERT_EQ(value, v1);
+  ASSERT_TRUE(node->ReadValue("empty", 5, &value, pool).IsOk());
+  ASSERT_EQ(value, "");
+  ASSERT_READ(node, "10", 2, 10);
+
+  ASSERT_TRUE(node->Delete("abc", 3, pool).IsOk());
+  ASSERT_TRUE(node->ReadValue("abc", 3, &value, pool).IsNotFound());
+  ASSERT_TRUE(node->UpdateValue("abc", 3, v1.data(), v1.size(), pool, node_size).IsNotFound());
+}
+
+TEST_F(LeafNodeFixtures, Blobs) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  std::string value;
+  std::string v1(5000, 'a');
+  ASSERT_TRUE(node->InsertValue("abc", 3, v1.data(), v1.size(), pool, node_size, true).IsOk());
+  ASSERT_TRUE(node->ReadValue("abc", 3, &value, pool).IsOk());
+  ASSERT_EQ(value, v1);
+  ASSERT_READ(node, "abc", 3, v1.size());
+  bztree::RecordMetadata *meta_ptr = nullptr;
+  auto meta = node->SearchRecordMeta(pool->GetEpoch(), "abc", 3, &meta_ptr);
+  auto *blob = node->GetBlob(meta);
+  ASSERT_NE(blob, nullptr);
+  ASSERT_EQ(blob->size, v1.size());
+  // The record only keeps the blob's address
+  ASSERT_EQ(meta.GetPaddedValueLength(), sizeof(uint64_t));
+  ASSERT_EQ(node->GetBlob(node->SearchRecordMeta(pool->GetEpoch(), "10", 2, &meta_ptr)),
+            nullptr);
+
+  // Consolidation moves the blob with the record
+  auto *new_node = node->Consolidate(pool);
+  delete node;
+  node = new_node;
+  meta = node->SearchRecordMeta(pool->GetEpoch(), "abc", 3, &meta_ptr);
+  ASSERT_EQ(node->GetBlob(meta), blob);
+
+  // Replacing or deleting a version hands its blob over to the caller
+  bztree::Blob *old_blob = nullptr;
+  std::string v2(3000, 'b');
+  ASSERT_TRUE(node->UpdateValue("abc", 3, v2.data(), v2.size(), pool, node_size, true,
+                                &old_blob).IsOk());
+  ASSERT_EQ(old_blob, blob);
+  ASSERT_TRUE(node->ReadValue("abc", 3, &value, pool).IsOk());
+  ASSERT_EQ(value, v2);
+  old_blob = nullptr;
+  ASSERT_TRUE(node->UpsertValue("abc", 3, "inline", 6, pool, node_size, false,
+                                &old_blob).IsOk());
+  ASSERT_NE(old_blob, nullptr);
+  ASSERT_EQ(old_blob->size, v2.size());
+  old_blob = nullptr;
+  ASSERT_TRUE(node->Delete("abc", 3, pool, &old_blob).IsOk());
+  ASSERT_EQ(old_blob, nullptr);
+}
+
+TEST_F(LeafNodeFixtures, FullPayloads) {
+  // Payloads that use the PMwCAS control bits (and the overflow flag) round
+  // trip through inserts, updates in both directions and consolidation
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  InsertDummy();
+  const uint64_t big = ~uint64_t{0};
+  const uint64_t flag = bztree::LeafNode::kOverflowPayload;
+  ASSERT_TRUE(node->Insert("abc", 3, big, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Insert("abd", 3, flag, pool, node_size).IsOk());
+  ASSERT_READ(node, "abc", 3, big);
+  ASSERT_READ(node, "abd", 3, flag);
+  auto record_count = node->GetHeader()->GetStatus().GetRecordCount();
+  ASSERT_TRUE(node->Update("10", 2, big - 1, pool, node_size).IsOk());
+  ASSERT_READ(node, "10", 2, big - 1);
+  ASSERT_TRUE(node->Update("10", 2, big - 1, pool, node_size).IsOk());
+  ASSERT_TRUE(node->Upsert("abc", 3, flag + 1, pool, node_size).IsOk());
+  ASSERT_READ(node, "abc", 3, flag + 1);
+  ASSERT_TRUE(node->Upsert("abd", 3, 7, pool, node_size).IsOk());
+  ASSERT_READ(node, "abd", 3, 7);
+  // Each change to or from an overflowing payload is a new version
+  ASSERT_EQ(node->GetHeader()->GetStatus().GetRecordCount(), record_count + 3);
+  ASSERT_TRUE(node->Upsert("abe", 3, big, pool, node_size).IsOk());
+  ASSERT_READ(node, "abe", 3, big);
+
+  std::string value;
+  ASSERT_TRUE(node->ReadValue("10", 2, &value, pool).IsOk());
+  ASSERT_EQ(value, std::string(8, '\xff').replace(0, 1, 1, '\xfe'));
+  bztree::RecordMetadata *meta_ptr = nullptr;
+  ASSERT_EQ(node->GetBlob(node->SearchRecordMeta(pool->GetEpoch(), "10", 2, &meta_ptr)),
+            nullptr);
+
+  auto *new_node = node->Consolidate(pool);
+  delete node;
+  node = new_node;
+  ASSERT_READ(node, "10", 2, big - 1);
+  ASSERT_READ(node, "abc", 3, flag + 1);
+  ASSERT_READ(node, "abd", 3, 7);
+  std::vector<bztree::Record *> result;
+  ASSERT_TRUE(node->RangeScanByKey("abc", 3, "abe", 3, &result, pool).IsOk());
+  ASSERT_EQ(result.size(), 3);
+  ASSERT_EQ(result[0]->GetPayload(), flag + 1);
+  ASSERT_EQ(result[2]->GetPayload(), big);
+  for (auto *r : result) {
+    free(r);
+  }
+  ASSERT_TRUE(node->Delete("10", 2, pool).IsOk());
+  ASSERT_TRUE(node->Update("10", 2, big, pool, node_size).IsNotFound());
+}
+
+TEST_F(LeafNodeFixtures, Fingerprint) {
+  pmwcas::EpochGuard guard(pool->GetEpoch());
+  bztree::RecordMetadata meta;
+  meta.FinalizeForInsert(0x3FFFF8, 0xFFFF, 0xFFF8, 0xAB);
+  ASSERT_TRUE(meta.IsVisible());
+  ASSERT_EQ(meta.GetOffset(), 0x3FFFF8u);
+  ASSERT_EQ(meta.GetKeyLength(), 0xFFFF);
+  ASSERT_EQ(meta.GetTotalLength(), 0xFFF8);
+  ASSERT_EQ(meta.GetFingerprint(), 0xAB);
+  ASSERT_FALSE(meta.OffsetIsEpoch());
+
+  // Records appended to the unsorted field carry the fingerprint of their key
+  InsertDummy();
+  auto record_count = node->GetHeader()->GetStatus().GetRecordCount();
+  for (uint32_t i = node->GetHeader()->sorted_count; i < record_count; ++i) {
+    auto md = node->GetMetadata(i);
+    ASSERT_EQ(md.GetFingerprint(),
+              bztree::RecordMetadata::Fingerprint(node->GetKey(md), md.GetKeyLength()));
+  }
+
+  // Keys with the same length and fingerprint are still told apart
+  auto fingerprint = bztree::RecordMetadata::Fingerprint("200", 3);
+  std::string collision;
+  for (uint32_t i = 300; collision.empty(); ++i) {
+    auto str = std::to_string(i);
+    if (bztree::RecordMetadata::Fingerprint(str.c_str(), 3) == fingerprint) {
+      collision = str;
+    }
+  }
+  uint64_t payload;
+  ASSERT_TRUE(node->Read(collision.c_str(), 3, &payload, pool).IsNotFound());
+  ASSERT_TRUE(node->Insert(collision.c_str(), 3, 1, pool, node_size).IsOk());
+  ASSERT_READ(node, collision.c_str(), 3, 1);
+  ASSERT_READ(node, "200", 3, 200);
 }
 
 TEST_F(LeafNodeFixtures, RangeScanByKey) {
@@ -177,6 +440,174 @@ TEST_F(LeafNodeFixtures, RangeScanByKey) {
   pool->GetEpoch()->Unprotect();
 }
 
+TEST_F(LeafNodeFixtures, RangeScanBySize) {
+  pool->GetEpoch()->Protect();
+  InsertDummy();
+  std::list<std::unique_ptr<bztree::Record>> result;
+  ASSERT_TRUE(node->RangeScanBySize("15", 2, 5, &result, pool).IsOk());
+  std::vector<uint64_t> payloads;
+  for (auto &r : result) {
+    payloads.push_back(r->GetPayload());
+  }
+  ASSERT_EQ(payloads, std::vector<uint64_t>({20, 200, 210, 220, 230}));
+
+  result.clear();
+  ASSERT_TRUE(node->RangeScanBySize("25", 2, 1, &result, pool).IsOk());
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(result.front()->GetPayload(), 250);
+
+  result.clear();
+  ASSERT_TRUE(node->RangeScanBySize("85", 2, 10, &result, pool).IsOk());
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(result.front()->GetPayload(), 90);
+  pool->GetEpoch()->Unprotect();
+}
+
+// The signed byte-at-a-time comparison used before keys were compared as
+// unsigned bytes
+static int SignedMemcmp(const char *key1, const char *key2, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    if (key1[i] != key2[i]) {
+      return key1[i] - key2[i];
+    }
+  }
+  return 0;
+}
+
+static int Sign(int v) { return (v > 0) - (v < 0); }
+
+TEST(KeyCompareTest, MatchesMemcmp) {
+  std::mt19937 rng(42);
+  for (uint32_t round = 0; round < 100000; ++round) {
+    uint32_t size = rng() % 40;
+    std::string k1(size, 0), k2(size, 0);
+    for (uint32_t i = 0; i < size; ++i) {
+      k1[i] = static_cast<char>(rng());
+      k2[i] = k1[i];
+    }
+    // Make the keys differ in at most one (random) position
+    if (size > 0 && rng() % 4) {
+      k2[rng() % size] = static_cast<char>(rng());
+    }
+    ASSERT_EQ(Sign(bztree::my_memcmp(k1.data(), k2.data(), size)),
+              Sign(memcmp(k1.data(), k2.data(), size)));
+    ASSERT_EQ(Sign(bztree::BaseNode::KeyCompare(k1.data(), size, k2.data(), size)),
+              Sign(memcmp(k1.data(), k2.data(), size)));
+
+    // Ordering of 7-bit keys is the same as with the old signed comparison
+    for (uint32_t i = 0; i < size; ++i) {
+      k1[i] &= 0x7F;
+      k2[i] &= 0x7F;
+    }
+    ASSERT_EQ(Sign(bztree::my_memcmp(k1.data(), k2.data(), size)),
+              Sign(SignedMemcmp(k1.data(), k2.data(), size)));
+  }
+
+  // Bytes above 0x7F sort after the ones below
+  const char low[] = {0x01, 0x7F};
+  const char high[] = {0x01, static_cast<char>(0x80)};
+  ASSERT_LT(bztree::BaseNode::KeyCompare(low, 2, high, 2), 0);
+  ASSERT_GT(bztree::BaseNode::KeyCompare(high, 2, low, 2), 0);
+
+  // A prefix sorts before the longer key
+  ASSERT_LT(bztree::BaseNode::KeyCompare("abcdefghij", 9, "abcdefghij", 10), 0);
+  ASSERT_EQ(bztree::BaseNode::KeyCompare("abcdefghij", 10, "abcdefghij", 10), 0);
+}
+
+TEST(InternalNodeTest, KeyPrefixSearch) {
+  pmwcas::InitLibrary(pmwcas::DefaultAllocator::Create,
+                      pmwcas::DefaultAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+  // Keys over a small alphabet (including zero bytes), half of them sharing
+  // an 8-byte prefix, so that prefixes often tie
+  std::mt19937 rng(7);
+  const char alphabet[] = {0x00, 'a', static_cast<char>(0xFF)};
+  auto random_key = [&]() {
+    std::string key = rng() % 2 ? "prefix__" : "";
+    uint32_t size = rng() % 12;
+    for (uint32_t i = 0; i < size; ++i) {
+      key.push_back(alphabet[rng() % 3]);
+    }
+    return key;
+  };
+  auto less = [](const std::string &k1, const std::string &k2) {
+    return bztree::BaseNode::KeyCompare(k1.data(), k1.size(), k2.data(), k2.size()) < 0;
+  };
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < 200; ++i) {
+    keys.push_back(random_key());
+  }
+  std::sort(keys.begin(), keys.end(), less);
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  keys.erase(keys.begin());  // Leave out the empty key
+
+  // Child i is to the left of separator keys[i]
+  std::vector<bztree::BulkLoadEntry> entries;
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    entries.push_back(bztree::BulkLoadEntry{keys[i].data(), static_cast<uint16_t>(keys[i].size()),
+                                            i + 1});
+  }
+  bztree::InternalNode *node = nullptr;
+  bztree::InternalNode::New(entries.begin(), entries.end(), &node);
+
+  std::vector<std::string> probes = keys;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    probes.push_back(random_key());
+  }
+  for (auto &probe : probes) {
+    uint32_t less_count = 0, less_equal_count = 0;
+    for (uint32_t i = 0; i + 1 < keys.size(); ++i) {
+      less_count += less(keys[i], probe);
+      less_equal_count += !less(probe, keys[i]);
+    }
+    ASSERT_EQ(node->GetChildIndex(probe.data(), probe.size()), less_count);
+    ASSERT_EQ(node->GetChildIndex(probe.data(), probe.size(), false), less_equal_count);
+  }
+  pmwcas::Allocator::Get()->Free(node);
+}
+
+TEST(InternalNodeTest, CommonPrefix) {
+  pmwcas::InitLibrary(pmwcas::DefaultAllocator::Create,
+                      pmwcas::DefaultAllocator::Destroy,
+                      pmwcas::LinuxEnvironment::Create,
+                      pmwcas::LinuxEnvironment::Destroy);
+  // Separators share "tenant01/table01/" and part of the row number
+  std::vector<std::string> keys;
+  for (uint32_t i = 100; i < 200; i += 3) {
+    keys.push_back("tenant01/table01/row" + std::to_string(i));
+  }
+  std::vector<bztree::BulkLoadEntry> entries;
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    entries.push_back(bztree::BulkLoadEntry{keys[i].data(), static_cast<uint16_t>(keys[i].size()),
+                                            i + 1});
+  }
+  bztree::InternalNode *node = nullptr;
+  bztree::InternalNode::New(entries.begin(), entries.end(), &node);
+  ASSERT_EQ(node->GetPrefixSize(), 16);
+  ASSERT_EQ(std::string(node->GetPrefix(), 16), "tenant01/table01");
+
+  // Keys that do not start with the prefix go to either end
+  std::vector<std::string> probes = keys;
+  for (auto probe : {"", "tenant01", "tenant01/table0", "tenant01/table01", "tenant01/table00/x",
+                     "tenant01/table02", "tenant00/table01/row150", "tenant02", "u"}) {
+    probes.push_back(probe);
+  }
+  for (uint32_t i = 90; i < 210; ++i) {
+    probes.push_back("tenant01/table01/row" + std::to_string(i));
+  }
+  for (auto &probe : probes) {
+    uint32_t less_count = 0, less_equal_count = 0;
+    for (uint32_t i = 0; i + 1 < keys.size(); ++i) {
+      less_count += keys[i] < probe;
+      less_equal_count += keys[i] <= probe;
+    }
+    ASSERT_EQ(node->GetChildIndex(probe.data(), probe.size()), less_count);
+    ASSERT_EQ(node->GetChildIndex(probe.data(), probe.size(), false), less_equal_count);
+  }
+  pmwcas::Allocator::Get()->Free(node);
+}
+
 class BzTreeTest : public ::testing::Test {
  protected:
   pmwcas::DescriptorPool *pool;
@@ -205,6 +636,19 @@ class BzTreeTest : public ::testing::Test {
     delete pool;
     pmwcas::Thread::ClearRegistry();
   }
+
+  // Call [func] on each leaf node of [t] from left to right
+  template <class Func>
+  void ForEachLeaf(bztree::BzTree *t, Func func) {
+    pmwcas::EpochGuard guard(pool->GetEpoch());
+    bztree::Stack stack;
+    const char *fence = nullptr;
+    uint16_t fence_size = 0;
+    auto *leaf = t->TraverseToLeaf(&stack, "", 0);
+    for (; leaf; leaf = t->NextLeaf(&stack, &fence, &fence_size)) {
+      func(leaf);
+    }
+  }
 };
 
 TEST_F(BzTreeTest, Insert) {
@@ -268,6 +712,309 @@ TEST_F(BzTreeTest, Upsert) {
   ASSERT_EQ(payload, 21);
 }
 
+TEST_F(BzTreeTest, UpsertSplit) {
+  // Upserts of new keys fill leaves up and split them, mixed with updates
+  static const uint32_t kKeys = 2000;
+  uint64_t payload = 0;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Upsert(i, i).IsOk());
+    ASSERT_TRUE(tree->Upsert(i / 2, i).IsOk());
+  }
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+    ASSERT_EQ(payload, i < kKeys / 2 ? 2 * i + 1 : i);
+  }
+#if ENABLE_STATS
+  auto stats = tree->GetStats();
+  ASSERT_EQ(stats.upserts, 2 * kKeys);
+  ASSERT_GT(stats.splits[0], 0);
+  // Only upserts that found their leaf full went through Insert
+  ASSERT_EQ(stats.inserts, stats.splits[0]);
+#endif
+}
+
+TEST_F(BzTreeTest, Values) {
+  // Values of different sizes fill leaves up and split them, and are then
+  // replaced by values of other sizes
+  static const uint32_t kKeys = 500;
+  auto make_value = [](uint64_t i, uint32_t version) {
+    return std::string((i + version) % 41, static_cast<char>('a' + version));
+  };
+  std::string value;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    auto v = make_value(i, 0);
+    ASSERT_TRUE(tree->InsertValue(i, v.data(), v.size()).IsOk());
+  }
+  ASSERT_TRUE(tree->InsertValue(uint64_t{0}, "x", 1).IsKeyExists());
+  for (uint32_t version = 1; version <= 3; ++version) {
+    for (uint64_t i = 0; i < kKeys; i += version) {
+      auto v = make_value(i, version);
+      ASSERT_TRUE(tree->UpdateValue(i, v.data(), v.size()).IsOk());
+    }
+  }
+  for (uint64_t i = 0; i < kKeys; i += 7) {
+    ASSERT_TRUE(tree->Delete(i).IsOk());
+  }
+  ASSERT_TRUE(tree->UpdateValue(uint64_t{0}, "x", 1).IsNotFound());
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    auto rc = tree->ReadValue(i, &value);
+    if (i % 7 == 0) {
+      ASSERT_TRUE(rc.IsNotFound());
+    } else {
+      ASSERT_TRUE(rc.IsOk());
+      ASSERT_EQ(value, make_value(i, i % 3 == 0 ? 3 : (i % 2 == 0 ? 2 : 1)));
+    }
+  }
+
+  // Records take at most a quarter of the 256-byte split threshold in the
+  // leaf; longer values go to blobs
+  std::string big(49, 'z');
+  ASSERT_TRUE(tree->InsertValue(kKeys, big.data(), big.size() - 1).IsOk());
+  ASSERT_TRUE(tree->InsertValue(kKeys + 1, big.data(), big.size()).IsOk());
+  ASSERT_TRUE(tree->ReadValue(kKeys, &value).IsOk());
+  ASSERT_EQ(value, big.substr(1));
+  ASSERT_TRUE(tree->ReadValue(kKeys + 1, &value).IsOk());
+  ASSERT_EQ(value, big);
+  // Keys that leave no room for a value do not fit
+  std::string long_key(56, 'k');
+  ASSERT_TRUE(tree->InsertValue(long_key.data(), long_key.size(), "x", 1).IsNotEnoughSpace());
+#if ENABLE_STATS
+  ASSERT_GT(tree->GetStats().splits[0], 0);
+  ASSERT_EQ(tree->GetStats().blobs_retired, 0);
+#endif
+}
+
+TEST_F(BzTreeTest, Blobs) {
+  // Values of KBs are stored in blobs; versions switch between blobs and
+  // inline values, and the blobs of old versions are retired
+  static const uint32_t kKeys = 200;
+  auto make_value = [](uint64_t i, uint32_t version) {
+    uint32_t size = (i + version) % 4 == 0 ? 16 : 1000 * ((i + version) % 4);
+    return std::string(size, static_cast<char>('a' + version));
+  };
+  auto is_blob = [](const std::string &v) { return v.size() > 16; };
+  std::string value;
+  uint64_t retired = 0;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    auto v = make_value(i, 0);
+    ASSERT_TRUE(tree->InsertValue(i, v.data(), v.size()).IsOk());
+  }
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    auto v = make_value(i, 1);
+    ASSERT_TRUE(tree->UpdateValue(i, v.data(), v.size()).IsOk());
+    retired += is_blob(make_value(i, 0));
+  }
+  for (uint64_t i = 0; i < kKeys * 2; i += 2) {
+    auto v = make_value(i, 2);
+    ASSERT_TRUE(tree->UpsertValue(i, v.data(), v.size()).IsOk());
+    if (i < kKeys) {
+      retired += is_blob(make_value(i, 1));
+    }
+  }
+  for (uint64_t i = 0; i < kKeys; i += 3) {
+    ASSERT_TRUE(tree->Delete(i).IsOk());
+    retired += is_blob(make_value(i, i % 2 == 0 ? 2 : 1));
+  }
+  for (uint64_t i = 0; i < kKeys * 2; ++i) {
+    auto rc = tree->ReadValue(i, &value);
+    if (i < kKeys && i % 3 == 0) {
+      ASSERT_TRUE(rc.IsNotFound());
+    } else if (i % 2 == 0) {
+      ASSERT_TRUE(rc.IsOk());
+      ASSERT_EQ(value, make_value(i, 2));
+    } else if (i < kKeys) {
+      ASSERT_TRUE(rc.IsOk());
+      ASSERT_EQ(value, make_value(i, 1));
+    } else {
+      ASSERT_TRUE(rc.IsNotFound());
+    }
+  }
+#if ENABLE_STATS
+  ASSERT_EQ(tree->GetStats().blobs_retired, retired);
+#endif
+}
+
+TEST_F(BzTreeTest, LargeInlineValues) {
+  // With 1 MB leaves and no inline limit, records still stay within the 64 KB
+  // their metadata can describe; longer values go to blobs
+  static const uint32_t kMB = 1024 * 1024;
+  bztree::BzTree::ParameterSet param(kMB, 0, kMB);
+  param.max_inline_value = kMB;
+  std::unique_ptr<bztree::BzTree> large(new bztree::BzTree(param, pool));
+  uint32_t max_value = bztree::RecordMetadata::kMaxTotalLength - 2 * sizeof(uint64_t);
+  std::string value;
+  for (uint32_t size : {max_value, max_value + 1, 2 * max_value}) {
+    std::string v(size, static_cast<char>('a' + size % 26));
+    ASSERT_TRUE(large->InsertValue(uint64_t{size}, v.data(), v.size()).IsOk());
+    ASSERT_TRUE(large->ReadValue(uint64_t{size}, &value).IsOk());
+    ASSERT_EQ(value, v);
+  }
+  // Replacing the values retires the blobs of the two longer ones only
+  for (uint32_t size : {max_value, max_value + 1, 2 * max_value}) {
+    ASSERT_TRUE(large->UpdateValue(uint64_t{size}, "x", 1).IsOk());
+    ASSERT_TRUE(large->ReadValue(uint64_t{size}, &value).IsOk());
+    ASSERT_EQ(value, "x");
+  }
+#if ENABLE_STATS
+  ASSERT_EQ(large->GetStats().blobs_retired, 2);
+#endif
+}
+
+TEST_F(BzTreeTest, FullPayloads) {
+  // Any 64-bit payload reads back the same through every path, in a tree
+  // whose leaves split and consolidate
+  static const uint32_t kKeys = 2000;
+  auto hash = [](uint64_t i, uint64_t version) {
+    return (i + version) * 0x9E3779B97F4A7C15ull;
+  };
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Insert(i, hash(i, 0)).IsOk());
+  }
+  for (uint64_t i = 0; i < kKeys; i += 2) {
+    ASSERT_TRUE(tree->Update(i, hash(i, 1)).IsOk());
+    ASSERT_TRUE(tree->Upsert(i + 1, i % 4 ? i : hash(i, 1)).IsOk());
+  }
+  auto expected = [&](uint64_t i) {
+    return i % 2 == 0 ? hash(i, 1) : i % 4 == 3 ? i - 1 : hash(i - 1, 1);
+  };
+  uint64_t payload = 0;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+    ASSERT_EQ(payload, expected(i));
+  }
+  uint64_t next = 0;
+  auto scanned = tree->Scan(uint64_t{0}, kKeys, [&](const char *, uint16_t, uint64_t p) {
+    EXPECT_EQ(p, expected(next++));
+    return true;
+  });
+  ASSERT_EQ(scanned, kKeys);
+  auto iter = tree->RangeScanBySize("", 0, kKeys);
+  next = 0;
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(r->GetPayload(), expected(next++));
+  }
+  ASSERT_EQ(next, kKeys);
+  std::vector<uint64_t> keys(kKeys);
+  std::vector<uint64_t> payloads(kKeys);
+  std::vector<bztree::ReturnCode> rcs(kKeys);
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    keys[i] = kKeys - 1 - i;
+  }
+  ASSERT_EQ(tree->MultiRead(keys.data(), kKeys, payloads.data(), rcs.data()), kKeys);
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(payloads[i], expected(keys[i]));
+  }
+
+  // The payload of a record with a blob is not updated, and the blob kept
+  std::string big(1000, 'b');
+  std::string value;
+  ASSERT_TRUE(tree->UpdateValue(1, big.data(), big.size()).IsOk());
+  ASSERT_TRUE(tree->Update(1, hash(1, 2)).IsInvalid());
+  ASSERT_TRUE(tree->ReadValue(1, &value).IsOk());
+  ASSERT_EQ(value, big);
+#if ENABLE_STATS
+  ASSERT_EQ(tree->GetStats().blobs_retired, 0);
+#endif
+
+  // Bulk loading keeps overflowing payloads as well
+  std::unique_ptr<bztree::BzTree> loaded(new bztree::BzTree(tree->parameters, pool));
+  std::vector<std::pair<std::string, uint64_t>> records;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    auto key = std::to_string(i);
+    records.emplace_back(std::string(8 - key.length(), '0') + key, hash(i, 0));
+  }
+  ASSERT_TRUE(loaded->BulkLoad(records.begin(), records.end()).IsOk());
+  for (auto &r : records) {
+    ASSERT_TRUE(loaded->Read(r.first.c_str(), r.first.length(), &payload).IsOk());
+    ASSERT_EQ(payload, r.second);
+  }
+}
+
+TEST_F(BzTreeTest, ReadModifyWrite) {
+  static const uint32_t kKeys = 1000;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Insert(i, i).IsOk());
+  }
+  uint64_t payload = 0;
+  ASSERT_TRUE(tree->CompareAndSwap(1, 1, 100).IsOk());
+  ASSERT_TRUE(tree->CompareAndSwap(1, 1, 200, &payload).IsPMWCASFailure());
+  ASSERT_EQ(payload, 100);
+  ASSERT_TRUE(tree->CompareAndSwap(kKeys, 0, 1).IsNotFound());
+  ASSERT_TRUE(tree->FetchAdd(2, 40, &payload).IsOk());
+  ASSERT_EQ(payload, 2);
+  ASSERT_TRUE(tree->Read(2, &payload).IsOk());
+  ASSERT_EQ(payload, 42);
+
+  // Counters that cross into overflowing payloads get new versions of their
+  // records, which fill leaves up and split them
+  const uint64_t base = bztree::LeafNode::kOverflowPayload - 2;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Update(i, base).IsOk());
+  }
+  for (uint32_t round = 0; round < 4; ++round) {
+    for (uint64_t i = 0; i < kKeys; ++i) {
+      ASSERT_TRUE(tree->FetchAdd(i, i % 2 + 1).IsOk());
+    }
+  }
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+    ASSERT_EQ(payload, base + 4 * (i % 2 + 1));
+  }
+  ASSERT_TRUE(tree->ReadModifyWrite(3, [](uint64_t *p) {
+    *p = ~*p;
+    return true;
+  }).IsOk());
+  ASSERT_TRUE(tree->Read(3, &payload).IsOk());
+  ASSERT_EQ(payload, ~(base + 8));
+#if ENABLE_STATS
+  auto stats = tree->GetStats();
+  ASSERT_EQ(stats.read_modify_writes, 4 + 4 * kKeys + 1);
+  ASSERT_GT(stats.splits[0], 0);
+#endif
+}
+
+TEST_F(BzTreeTest, PayloadsOfValues) {
+  // The payload operations leave records with inline and blob values as they
+  // are, among records that use the payload
+  static const uint32_t kKeys = 300;
+  auto make_value = [](uint64_t i) {
+    return std::string(i % 3 == 1 ? 20 : 1000, static_cast<char>('a' + i % 26));
+  };
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    if (i % 3 == 0) {
+      ASSERT_TRUE(tree->Insert(i, i).IsOk());
+    } else {
+      auto v = make_value(i);
+      ASSERT_TRUE(tree->InsertValue(i, v.data(), v.size()).IsOk());
+    }
+  }
+  uint64_t payload = 0;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    bool has_value = i % 3 != 0;
+    ASSERT_EQ(tree->Update(i, i + 1).IsInvalid(), has_value);
+    ASSERT_EQ(tree->Upsert(i, i + 2).IsInvalid(), has_value);
+    ASSERT_EQ(tree->FetchAdd(i, 1).IsInvalid(), has_value);
+    ASSERT_EQ(tree->CompareAndSwap(i, i + 3, 0).IsInvalid(), has_value);
+    ASSERT_EQ(tree->ReadModifyWrite(i, [](uint64_t *p) {
+      *p = ~uint64_t{0};
+      return true;
+    }).IsInvalid(), has_value);
+  }
+  std::string value;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    if (i % 3 == 0) {
+      ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+      ASSERT_EQ(payload, ~uint64_t{0});
+    } else {
+      ASSERT_TRUE(tree->ReadValue(i, &value).IsOk());
+      ASSERT_EQ(value, make_value(i));
+    }
+  }
+#if ENABLE_STATS
+  ASSERT_EQ(tree->GetStats().blobs_retired, 0);
+#endif
+}
+
 TEST_F(BzTreeTest, Delete) {
   for (uint64_t i = 0; i < 50; i++) {
     std::string key = std::to_string(i);
@@ -289,6 +1036,308 @@ TEST_F(BzTreeTest, Delete) {
 }
 
 
+TEST_F(BzTreeTest, IntegerKeys) {
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < 3000; ++i) {
+    // Spread the keys over the whole 64-bit range, including the upper half
+    keys.push_back(i * (~uint64_t{0} / 3000));
+  }
+  std::mt19937 rng(7);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  for (auto k : keys) {
+    ASSERT_TRUE(tree->Insert(k, k >> 3).IsOk());
+  }
+  ASSERT_TRUE(tree->Insert(keys[0], 0).IsKeyExists());
+
+  uint64_t payload = 0;
+  for (auto k : keys) {
+    ASSERT_TRUE(tree->Read(k, &payload).IsOk());
+    ASSERT_EQ(payload, k >> 3);
+  }
+  ASSERT_TRUE(tree->Read(uint64_t{1}, &payload).IsNotFound());
+
+  ASSERT_TRUE(tree->Update(keys[1], 42).IsOk());
+  ASSERT_TRUE(tree->Read(keys[1], &payload).IsOk());
+  ASSERT_EQ(payload, 42);
+  ASSERT_TRUE(tree->Delete(keys[2]).IsOk());
+  ASSERT_TRUE(tree->Read(keys[2], &payload).IsNotFound());
+  ASSERT_TRUE(tree->Upsert(keys[2], 43).IsOk());
+  ASSERT_TRUE(tree->Read(keys[2], &payload).IsOk());
+  ASSERT_EQ(payload, 43);
+
+  // Scans return keys in integer order
+  std::sort(keys.begin(), keys.end());
+  uint64_t first = *std::lower_bound(keys.begin(), keys.end(), 0x8000000000000000ULL);
+  bztree::IntegerKey start(first);
+  auto iter = tree->RangeScanBySize(start, 100);
+  uint64_t prev = first;
+  uint32_t count = 0;
+  while (auto r = iter->GetNext()) {
+    uint64_t k = bztree::IntegerKey::Decode(r->GetKey());
+    ASSERT_GE(k, prev);
+    prev = k;
+    ++count;
+  }
+  ASSERT_EQ(count, 100);
+}
+
+TEST_F(BzTreeTest, BulkLoad) {
+  static const uint32_t kMaxKey = 20000;
+  std::vector<std::pair<std::string, uint64_t>> records;
+  for (uint32_t i = 0; i < kMaxKey; i += 2) {
+    // Zero-padded so that the string order is the same as the numeric order
+    auto key = std::to_string(i);
+    records.emplace_back(std::string(8 - key.length(), '0') + key, i);
+  }
+  ASSERT_TRUE(tree->BulkLoad(records.begin(), records.end(), 0.8).IsOk());
+  ASSERT_TRUE(tree->BulkLoad(records.begin(), records.end()).IsInvalid());
+
+  uint64_t payload = 0;
+  for (auto &r : records) {
+    ASSERT_TRUE(tree->Read(r.first.c_str(), r.first.length(), &payload).IsOk());
+    ASSERT_EQ(payload, r.second);
+  }
+
+  // The loaded tree accepts regular inserts, including ones that split nodes
+  for (uint32_t i = 1; i < kMaxKey; i += 2) {
+    auto key = std::to_string(i);
+    key = std::string(8 - key.length(), '0') + key;
+    ASSERT_TRUE(tree->Insert(key.c_str(), key.length(), i).IsOk());
+  }
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    auto key = std::to_string(i);
+    key = std::string(8 - key.length(), '0') + key;
+    ASSERT_TRUE(tree->Read(key.c_str(), key.length(), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+
+  auto iter = tree->RangeScanBySize("00010000", 8, 500);
+  uint32_t count = 0;
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(r->GetPayload(), 10000 + count);
+    ++count;
+  }
+  ASSERT_EQ(count, 500);
+}
+
+TEST_F(BzTreeTest, ConsolidateInsteadOfSplit) {
+  static const uint32_t kMaxKey = 1000;
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  uint32_t leaves = 0;
+  ForEachLeaf(tree, [&leaves](bztree::LeafNode *) { ++leaves; });
+
+  // Deleted records fill up leaves, which get compacted instead of split
+  for (uint32_t round = 1; round <= 10; ++round) {
+    for (uint32_t i = 0; i < kMaxKey; ++i) {
+      auto key = std::to_string(i);
+      ASSERT_TRUE(tree->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+      ASSERT_TRUE(tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()),
+                               round * kMaxKey + i).IsOk());
+    }
+  }
+  uint32_t new_leaves = 0;
+  ForEachLeaf(tree, [&new_leaves](bztree::LeafNode *) { ++new_leaves; });
+  // Only leaves with more than [consolidate_fill] live data still split
+  ASSERT_LE(new_leaves, leaves + leaves / 4);
+
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kMaxKey; ++i) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Read(key.c_str(), static_cast<uint16_t>(key.length()), &payload).IsOk());
+    ASSERT_EQ(payload, 10 * kMaxKey + i);
+  }
+}
+
+TEST_F(BzTreeTest, ConsolidateUnsorted) {
+  bztree::BzTree::ParameterSet param;
+  param.max_unsorted_records = 8;
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  std::vector<uint64_t> keys(5000);
+  for (uint64_t i = 0; i < keys.size(); ++i) {
+    keys[i] = i;
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+  for (auto k : keys) {
+    ASSERT_TRUE(t->Insert(k, k).IsOk());
+  }
+  ForEachLeaf(t.get(), [](bztree::LeafNode *leaf) {
+    ASSERT_LT(leaf->GetUnsortedCount(), 8);
+  });
+
+  // Leave it to a maintenance pass instead
+  t->parameters.max_unsorted_records = 0;
+  for (auto k : keys) {
+    ASSERT_TRUE(t->Upsert(k + keys.size(), k).IsOk());
+  }
+  t->parameters.max_unsorted_records = 8;
+  ASSERT_GT(t->ConsolidateLeaves(), 0);
+  ForEachLeaf(t.get(), [](bztree::LeafNode *leaf) {
+    ASSERT_LT(leaf->GetUnsortedCount(), 8);
+  });
+  uint64_t payload = 0;
+  for (auto k : keys) {
+    ASSERT_TRUE(t->Read(k + keys.size(), &payload).IsOk());
+    ASSERT_EQ(payload, k);
+  }
+}
+
+TEST_F(BzTreeTest, Append) {
+  // Increasing keys fill the leaves they leave behind, unless right-most
+  // leaves are split evenly
+  static const uint32_t kKeys = 20000;
+  uint32_t leaves[2] = {0, 0};
+  uint32_t records[2] = {0, 0};
+  for (uint32_t i = 0; i < 2; ++i) {
+    bztree::BzTree::ParameterSet param(1024, 0, 1024);
+    param.append_split_fill = i == 0 ? 0.9 : 0.5;
+    std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+    for (uint32_t k = 0; k < kKeys; ++k) {
+      ASSERT_TRUE(t->Insert(k, k).IsOk());
+    }
+    ASSERT_TRUE(t->Insert(kKeys / 2, 0).IsKeyExists());
+    ForEachLeaf(t.get(), [&](bztree::LeafNode *leaf) {
+      ++leaves[i];
+      records[i] = std::max<uint32_t>(records[i], leaf->GetHeader()->GetStatus().GetRecordCount());
+    });
+
+    uint64_t payload = 0;
+    for (uint32_t k = 0; k < kKeys; ++k) {
+      ASSERT_TRUE(t->Read(k, &payload).IsOk());
+      ASSERT_EQ(payload, k);
+    }
+    uint32_t next = 0;
+    ASSERT_EQ(t->Scan(uint64_t{0}, kKeys, [&next](const char *key, uint16_t, uint64_t payload) {
+      EXPECT_EQ(bztree::IntegerKey::Decode(key), next);
+      EXPECT_EQ(payload, next);
+      ++next;
+      return true;
+    }), kKeys);
+  }
+  // Leaves are about 90% instead of 50% full
+  ASSERT_GT(leaves[1], leaves[0] * 3 / 2);
+  ASSERT_GE(leaves[0], kKeys / records[0]);
+  ASSERT_LT(leaves[0], kKeys / records[0] * 6 / 5);
+}
+
+TEST_F(BzTreeTest, LeafHints) {
+  // Even keys in random order, so that most leaves are not the right-most one
+  static const uint32_t kKeys = 10000;
+  bztree::BzTree::ParameterSet param(1024, 0, 1024);
+  param.leaf_hints = true;
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  std::vector<uint64_t> keys;
+  for (uint64_t k = 0; k < kKeys; ++k) {
+    keys.push_back(k * 2);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+  for (auto k : keys) {
+    ASSERT_TRUE(t->Insert(k, k).IsOk());
+  }
+
+  // Nearby keys, present or not, are found through the leaf of the previous
+  // one, also after it was split by inserts of the odd keys
+  auto reads_before = t->GetStats();
+  uint64_t payload = 0;
+  for (uint64_t k = 0; k < kKeys * 2; ++k) {
+    auto rc = t->Read(k, &payload);
+    ASSERT_EQ(rc.IsOk(), k % 2 == 0);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, k);
+    }
+  }
+  auto reads_after = t->GetStats();
+  for (uint64_t k = 0; k < kKeys * 2; ++k) {
+    if (k % 2 == 0) {
+      ASSERT_TRUE(t->Update(k, k + 1).IsOk());
+    } else {
+      ASSERT_TRUE(t->Insert(k, k + 1).IsOk());
+    }
+    if (k % 4 == 3) {
+      ASSERT_TRUE(t->Delete(k - 1).IsOk());
+    }
+  }
+  ASSERT_TRUE(t->Upsert(kKeys * 2, 0).IsOk());
+
+  // Hints are per tree: the other tree has none of the keys
+  std::unique_ptr<bztree::BzTree> other(new bztree::BzTree(param, pool));
+  for (uint64_t k = 0; k <= kKeys * 2; ++k) {
+    ASSERT_TRUE(other->Read(k, &payload).IsNotFound());
+    auto rc = t->Read(k, &payload);
+    ASSERT_EQ(rc.IsOk(), k % 4 != 2);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, k == kKeys * 2 ? 0 : k + 1);
+    }
+  }
+
+#if ENABLE_STATS
+  uint64_t hits = reads_after.leaf_hint_hits - reads_before.leaf_hint_hits;
+  uint64_t misses = reads_after.leaf_hint_misses - reads_before.leaf_hint_misses;
+  ASSERT_EQ(hits + misses, kKeys * 2);
+  ASSERT_GT(hits, misses * 10);
+#endif
+}
+
+TEST_F(BzTreeTest, MergePolicy) {
+  static const uint32_t kKeys = 3000;
+  auto count_leaves = [this](bztree::BzTree *t) {
+    uint32_t leaves = 0;
+    ForEachLeaf(t, [&leaves](bztree::LeafNode *) { ++leaves; });
+    return leaves;
+  };
+  for (auto policy : {bztree::BzTree::ParameterSet::MergeNever,
+                      bztree::BzTree::ParameterSet::MergeOnDelete,
+                      bztree::BzTree::ParameterSet::MergeDeferred}) {
+    bztree::BzTree::ParameterSet param(1024, 512, 1024);
+    param.merge_policy = policy;
+    std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      ASSERT_TRUE(t->Insert(i, i).IsOk());
+    }
+    uint32_t leaves = count_leaves(t.get());
+
+    // Keep one key in 20
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      if (i % 20) {
+        ASSERT_TRUE(t->Delete(i).IsOk());
+      }
+    }
+    uint32_t new_leaves = count_leaves(t.get());
+    if (policy == bztree::BzTree::ParameterSet::MergeOnDelete) {
+      ASSERT_LT(new_leaves, leaves / 2);
+    } else {
+      ASSERT_EQ(new_leaves, leaves);
+    }
+    if (policy == bztree::BzTree::ParameterSet::MergeDeferred) {
+      ASSERT_GT(t->MergeLeaves(), 0);
+      ASSERT_LT(count_leaves(t.get()), leaves / 2);
+    }
+#if ENABLE_STATS
+    ASSERT_EQ(t->GetStats().merges > 0, policy != bztree::BzTree::ParameterSet::MergeNever);
+#endif
+
+    uint64_t payload = 0;
+    for (uint32_t i = 0; i < kKeys; ++i) {
+      auto rc = t->Read(i, &payload);
+      if (i % 20) {
+        ASSERT_TRUE(rc.IsNotFound());
+      } else {
+        ASSERT_TRUE(rc.IsOk());
+        ASSERT_EQ(payload, i);
+      }
+    }
+    uint32_t next = 0;
+    auto visitor = [&next](const char *key, uint16_t key_size, uint64_t payload) {
+      EXPECT_EQ(payload, next);
+      next += 20;
+      return true;
+    };
+    ASSERT_EQ(t->Scan(uint64_t{0}, kKeys, visitor), kKeys / 20);
+  }
+}
+
 TEST_F(BzTreeTest, RangeScanBySize) {
   static const uint32_t kMaxKey = 9999;
   for (uint32_t i = 1000; i <= kMaxKey; i++) {
@@ -322,6 +1371,442 @@ TEST_F(BzTreeTest, RangeScanBySize) {
   ASSERT_EQ(count, 1000);
 }
 
+TEST_F(BzTreeTest, Scan) {
+  // Even keys only, with some of them deleted afterwards, over many leaves
+  static const uint32_t kMaxKey = 9998;
+  for (uint32_t i = 1000; i <= kMaxKey; i += 2) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Insert(key.c_str(), static_cast<uint16_t>(key.length()), i).IsOk());
+  }
+  for (uint32_t i = 5000; i < 6000; i += 4) {
+    auto key = std::to_string(i);
+    ASSERT_TRUE(tree->Delete(key.c_str(), static_cast<uint16_t>(key.length())).IsOk());
+  }
+  auto expected_next = [](uint32_t k) {
+    k += 2;
+    if (k >= 5000 && k < 6000 && k % 4 == 0) {
+      k += 2;
+    }
+    return k;
+  };
+
+  // Start key is not in the tree; scan across leaves in key order
+  uint32_t prev = 1000;
+  auto visitor = [&](const char *key, uint16_t key_size, uint64_t payload) {
+    EXPECT_EQ(std::to_string(payload), std::string(key, key_size));
+    EXPECT_EQ(payload, expected_next(prev));
+    prev = payload;
+    return true;
+  };
+  ASSERT_EQ(tree->Scan("1001", 4, 3000, visitor), 3000);
+  ASSERT_EQ(prev, 7500);
+
+  // Whole tree
+  prev = 998;
+  ASSERT_EQ(tree->Scan("", 0, 10000, visitor), 4250);
+  ASSERT_EQ(prev, kMaxKey);
+
+  // Inclusive end key
+  prev = 4998;
+  ASSERT_EQ(tree->Scan("5000", 4, "6000", 4, visitor), 251);
+  ASSERT_EQ(prev, 6000);
+
+  // Iterators continue across leaves also when the start key is past the
+  // last record in its leaf
+  auto iter = tree->RangeScanBySize("4999", 4, 10000);
+  prev = 4998;
+  uint32_t count = 0;
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(r->GetPayload(), expected_next(prev));
+    prev = r->GetPayload();
+    ++count;
+  }
+  ASSERT_EQ(count, 2250);
+  ASSERT_EQ(prev, kMaxKey);
+
+  // The visitor can stop the scan
+  uint32_t visited = 0;
+  ASSERT_EQ(tree->Scan("9000", 4, 100, [&visited](const char *, uint16_t, uint64_t) {
+    return ++visited < 10;
+  }), 10);
+  ASSERT_EQ(visited, 10);
+}
+
+TEST_F(BzTreeTest, NestedScans) {
+  // Keys with a common prefix in consolidated leaves, so that scans hand out
+  // keys they assemble and move between leaves while other scans run
+  bztree::BzTree::ParameterSet param(1024, 256, 1024);
+  param.max_unsorted_records = 1;
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  static const uint32_t kKeys = 2000;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    char key[32];
+    snprintf(key, sizeof(key), "tenant00/row%06u", i);
+    keys.push_back(key);
+  }
+  std::vector<uint32_t> order(kKeys);
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(0));
+  for (auto i : order) {
+    ASSERT_TRUE(t->Insert(keys[i].data(), static_cast<uint16_t>(keys[i].size()), i).IsOk());
+  }
+
+  // Each visit scans a few records elsewhere in the tree and reads one
+  uint32_t next = 0;
+  auto inner_visitor = [&](uint32_t begin) {
+    return [&keys, begin, n = begin](const char *key, uint16_t key_size,
+                                     uint64_t payload) mutable {
+      EXPECT_EQ(std::string(key, key_size), keys[n]);
+      EXPECT_EQ(payload, n);
+      ++n;
+      return true;
+    };
+  };
+  auto visitor = [&](const char *key, uint16_t key_size, uint64_t payload) {
+    EXPECT_EQ(std::string(key, key_size), keys[next]);
+    EXPECT_EQ(payload, next);
+    uint32_t begin = next * 7 % (kKeys - 10);
+    EXPECT_EQ(t->Scan(keys[begin].data(), static_cast<uint16_t>(keys[begin].size()), 10,
+                      inner_visitor(begin)), 10);
+    uint64_t read_payload = 0;
+    EXPECT_TRUE(t->Read(keys[begin].data(), static_cast<uint16_t>(keys[begin].size()),
+                        &read_payload).IsOk());
+    EXPECT_EQ(read_payload, begin);
+    ++next;
+    return true;
+  };
+  ASSERT_EQ(t->Scan("", 0, kKeys, visitor), kKeys);
+  ASSERT_EQ(next, kKeys);
+}
+
+TEST_F(BzTreeTest, NestedScansOfUnsortedRecords) {
+  // Leaves are never consolidated, so short scans pick their records from
+  // long unsorted fields while the visitor scans other leaves
+  bztree::BzTree::ParameterSet param(1024, 256, 1024);
+  param.max_unsorted_records = 0;
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  static const uint32_t kKeys = 2000;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    char key[32];
+    snprintf(key, sizeof(key), "tenant00/row%06u", i);
+    keys.push_back(key);
+  }
+  std::vector<uint32_t> order(kKeys);
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(1));
+  for (auto i : order) {
+    ASSERT_TRUE(t->Insert(keys[i].data(), static_cast<uint16_t>(keys[i].size()), i).IsOk());
+  }
+
+  for (uint32_t begin = 0; begin < kKeys - 5; begin += 37) {
+    uint32_t next = begin;
+    auto visitor = [&](const char *key, uint16_t key_size, uint64_t payload) {
+      EXPECT_EQ(std::string(key, key_size), keys[next]);
+      EXPECT_EQ(payload, next);
+      uint32_t other = (next * 13 + 500) % (kKeys - 20);
+      uint32_t visited = 0;
+      EXPECT_EQ(t->Scan(keys[other].data(), static_cast<uint16_t>(keys[other].size()), 20,
+                        [&](const char *, uint16_t, uint64_t inner_payload) {
+                          EXPECT_EQ(inner_payload, other + visited);
+                          ++visited;
+                          return true;
+                        }), 20);
+      ++next;
+      return true;
+    };
+    ASSERT_EQ(t->Scan(keys[begin].data(), static_cast<uint16_t>(keys[begin].size()), 5,
+                      visitor), 5);
+    ASSERT_EQ(next, begin + 5);
+  }
+}
+
+TEST_F(BzTreeTest, PrefixCompression) {
+  // Hierarchical keys, inserted in random order
+  bztree::BzTree::ParameterSet param(1024, 256, 1024);
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  std::vector<std::string> keys;
+  for (uint32_t tenant = 0; tenant < 3; ++tenant) {
+    for (uint32_t table = 0; table < 4; ++table) {
+      for (uint32_t row = 0; row < 500; ++row) {
+        char key[64];
+        snprintf(key, sizeof(key), "tenant%02u/table%02u/row%06u", tenant, table, row);
+        keys.push_back(key);
+      }
+    }
+  }
+  std::vector<uint32_t> order(keys.size());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(0));
+  for (auto i : order) {
+    ASSERT_TRUE(t->Insert(keys[i].data(), static_cast<uint16_t>(keys[i].size()), i).IsOk());
+  }
+
+  // Most leaves store their keys without a common prefix
+  uint32_t leaves = 0, compressed = 0;
+  ForEachLeaf(t.get(), [&](bztree::LeafNode *leaf) {
+    ++leaves;
+    compressed += leaf->GetPrefixSize() >= 16;
+  });
+  ASSERT_GT(compressed, leaves * 9 / 10);
+
+  // Delete every other row, which consolidates leaves as they fill up again,
+  // and update the rest
+  for (uint32_t i = 0; i < keys.size(); i += 2) {
+    ASSERT_TRUE(t->Delete(keys[i].data(), static_cast<uint16_t>(keys[i].size())).IsOk());
+  }
+  for (uint32_t i = 1; i < keys.size(); i += 2) {
+    ASSERT_TRUE(t->Upsert(keys[i].data(), static_cast<uint16_t>(keys[i].size()), i + 1).IsOk());
+  }
+  for (uint32_t i = 0; i < keys.size(); i += 2) {
+    ASSERT_TRUE(t->Insert(keys[i].data(), static_cast<uint16_t>(keys[i].size()), i + 1).IsOk());
+  }
+
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    ASSERT_TRUE(t->Read(keys[i].data(), static_cast<uint16_t>(keys[i].size()), &payload).IsOk());
+    ASSERT_EQ(payload, i + 1);
+  }
+  for (auto key : {"tenant01", "tenant01/table02/row", "tenant01/table02/row0004999",
+                   "tenant01/table04", "tenant03"}) {
+    ASSERT_TRUE(t->Read(key, static_cast<uint16_t>(strlen(key)), &payload).IsNotFound());
+  }
+
+  // Scans hand out full keys
+  uint32_t next = 0;
+  auto visitor = [&](const char *key, uint16_t key_size, uint64_t payload) {
+    EXPECT_EQ(std::string(key, key_size), keys[next]);
+    EXPECT_EQ(payload, next + 1);
+    ++next;
+    return true;
+  };
+  ASSERT_EQ(t->Scan("", 0, 10000, visitor), keys.size());
+  next = 1000;
+  ASSERT_EQ(t->Scan("tenant00/table02", 16, "tenant01/table00/row000099", 26, visitor), 1100);
+  auto iter = t->RangeScanBySize("tenant02", 8, 10000);
+  next = 4000;
+  while (auto r = iter->GetNext()) {
+    ASSERT_EQ(std::string(r->GetKey(), r->meta.GetKeyLength()), keys[next]);
+    ++next;
+  }
+  ASSERT_EQ(next, keys.size());
+}
+
+TEST_F(BzTreeTest, PrefixMergeSize) {
+  // Groups of keys with long, different prefixes: leaves merged across
+  // groups store whole keys, which need more space than the two leaves did
+  bztree::BzTree::ParameterSet param(1024, 768, 1024);
+  param.merge_policy = bztree::BzTree::ParameterSet::MergeOnDelete;
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  std::vector<std::string> keys;
+  for (uint32_t group = 0; group < 8; ++group) {
+    for (uint32_t row = 0; row < 100; ++row) {
+      char key[64];
+      snprintf(key, sizeof(key), "%s/%06u", std::string(48, 'a' + group).c_str(), row);
+      keys.push_back(key);
+      ASSERT_TRUE(t->Insert(key, static_cast<uint16_t>(keys.back().size()), row).IsOk());
+    }
+  }
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    if (i % 4 != 0) {
+      ASSERT_TRUE(t->Delete(keys[i].data(), static_cast<uint16_t>(keys[i].size())).IsOk());
+    }
+  }
+
+  // Leaves that would not fit are not merged, so all keep the leaf size
+  ForEachLeaf(t.get(), [&](bztree::LeafNode *leaf) {
+    ASSERT_EQ(leaf->GetHeader()->size, param.leaf_node_size);
+  });
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    auto rc = t->Read(keys[i].data(), static_cast<uint16_t>(keys[i].size()), &payload);
+    ASSERT_EQ(rc.IsOk(), i % 4 == 0);
+    if (rc.IsOk()) {
+      ASSERT_EQ(payload, i % 100);
+    }
+  }
+#if ENABLE_STATS
+  ASSERT_GT(t->GetStats().merges, 0);
+#endif
+}
+
+TEST_F(BzTreeTest, SeparatorTruncation) {
+  // Long keys that differ in their first eight bytes
+  bztree::BzTree::ParameterSet param(1024, 256, 1024);
+  std::unique_ptr<bztree::BzTree> t(new bztree::BzTree(param, pool));
+  static const uint32_t kKeys = 3000;
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    char key[64];
+    snprintf(key, sizeof(key), "%08x/%039u", i * 2654435761u, i);
+    keys.push_back(key);
+    ASSERT_TRUE(t->Insert(key, static_cast<uint16_t>(keys.back().size()), i).IsOk());
+  }
+
+  // Separators only keep the bytes needed to tell the leaves apart
+  {
+    pmwcas::EpochGuard guard(pool->GetEpoch());
+    bztree::Stack stack;
+    const char *fence = nullptr;
+    uint16_t fence_size = 0;
+    uint32_t leaves = 0;
+    auto *leaf = t->TraverseToLeaf(&stack, "", 0);
+    for (; leaf; leaf = t->NextLeaf(&stack, &fence, &fence_size)) {
+      if (fence) {
+        ASSERT_LE(fence_size, 8);
+      }
+      ++leaves;
+    }
+    ASSERT_GT(leaves, 10);
+  }
+
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(t->Read(keys[i].data(), static_cast<uint16_t>(keys[i].size()), &payload).IsOk());
+    ASSERT_EQ(payload, i);
+  }
+  std::sort(keys.begin(), keys.end());
+  uint32_t next = 0;
+  auto visitor = [&](const char *key, uint16_t key_size, uint64_t payload) {
+    EXPECT_EQ(std::string(key, key_size), keys[next]);
+    ++next;
+    return true;
+  };
+  ASSERT_EQ(t->Scan("", 0, kKeys, visitor), kKeys);
+}
+
+TEST_F(BzTreeTest, MultiRead) {
+  static const uint32_t kKeys = 2000;
+  for (uint64_t i = 0; i < kKeys; i += 2) {
+    ASSERT_TRUE(tree->Insert(i, i * 10).IsOk());
+  }
+
+  // Odd keys are missing; the batch size is not a multiple of the group size
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    keys.push_back(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+  std::vector<uint64_t> payloads(kKeys, 1);
+  std::vector<bztree::ReturnCode> rcs(kKeys);
+  ASSERT_EQ(tree->MultiRead(keys.data(), kKeys - 3, payloads.data(), rcs.data()),
+            std::count_if(keys.begin(), keys.end() - 3, [](uint64_t k) { return k % 2 == 0; }));
+  for (uint32_t i = 0; i < kKeys - 3; ++i) {
+    if (keys[i] % 2 == 0) {
+      ASSERT_TRUE(rcs[i].IsOk());
+      ASSERT_EQ(payloads[i], keys[i] * 10);
+    } else {
+      ASSERT_TRUE(rcs[i].IsNotFound());
+      ASSERT_EQ(payloads[i], 1);
+    }
+  }
+
+  // Variable-length keys
+  std::vector<std::string> strs = {"a", "bb", "ccc"};
+  ASSERT_TRUE(tree->Insert(strs[1].data(), strs[1].size(), 2).IsOk());
+  const char *str_keys[] = {strs[0].data(), strs[1].data(), strs[2].data()};
+  uint16_t str_sizes[] = {1, 2, 3};
+  ASSERT_EQ(tree->MultiRead(str_keys, str_sizes, 3, payloads.data(), rcs.data()), 1);
+  ASSERT_TRUE(rcs[0].IsNotFound());
+  ASSERT_TRUE(rcs[1].IsOk());
+  ASSERT_EQ(payloads[1], 2);
+  ASSERT_TRUE(rcs[2].IsNotFound());
+}
+
+TEST_F(BzTreeTest, InterleavedRead) {
+  static const uint32_t kKeys = 2000;
+  for (uint64_t i = 0; i < kKeys; i += 2) {
+    ASSERT_TRUE(tree->Insert(i, i * 10).IsOk());
+  }
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < kKeys; ++i) {
+    keys.push_back(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+
+  // More lookups in flight than keys, and the other way round
+  for (uint32_t inflight : {1u, 7u, bztree::BzTree::kMaxInflightReads}) {
+    for (uint32_t n : {0u, 5u, kKeys}) {
+      std::vector<uint64_t> payloads(n, 1);
+      std::vector<bztree::ReturnCode> rcs(n);
+      ASSERT_EQ(tree->InterleavedRead(keys.data(), n, payloads.data(), rcs.data(), inflight),
+                std::count_if(keys.begin(), keys.begin() + n,
+                              [](uint64_t k) { return k % 2 == 0; }));
+      for (uint32_t i = 0; i < n; ++i) {
+        if (keys[i] % 2 == 0) {
+          ASSERT_TRUE(rcs[i].IsOk());
+          ASSERT_EQ(payloads[i], keys[i] * 10);
+        } else {
+          ASSERT_TRUE(rcs[i].IsNotFound());
+          ASSERT_EQ(payloads[i], 1);
+        }
+      }
+    }
+  }
+}
+
+TEST_F(BzTreeTest, Stats) {
+  static const uint32_t kKeys = 1000;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Insert(i, i).IsOk());
+  }
+  uint64_t payload = 0;
+  for (uint32_t i = 0; i < kKeys; ++i) {
+    ASSERT_TRUE(tree->Read(i, &payload).IsOk());
+  }
+  for (uint32_t i = 0; i < kKeys; i += 10) {
+    ASSERT_TRUE(tree->Update(i, i + 1).IsOk());
+    ASSERT_TRUE(tree->Delete(i + 1).IsOk());
+  }
+  ASSERT_TRUE(tree->Upsert(kKeys, kKeys).IsOk());
+  tree->Scan(0, 10, [](const char *, uint16_t, uint64_t) { return true; });
+  auto iter = tree->RangeScanBySize(bztree::IntegerKey(0), kKeys);
+  while (iter->GetNext()) {
+  }
+
+  // Counters are per tree
+  std::unique_ptr<bztree::BzTree> other(new bztree::BzTree(tree->parameters, pool));
+  ASSERT_TRUE(other->Insert(0, 0).IsOk());
+
+  auto stats = tree->GetStats();
+#if ENABLE_STATS
+  ASSERT_EQ(stats.inserts, kKeys);
+  ASSERT_EQ(stats.reads, kKeys);
+  ASSERT_EQ(stats.updates, kKeys / 10);
+  ASSERT_EQ(stats.deletes, kKeys / 10);
+  ASSERT_EQ(stats.upserts, 1);
+  ASSERT_EQ(stats.scans, 2);
+  // Nothing to conflict with in a single thread
+  ASSERT_EQ(stats.frozen_retries, 0);
+  ASSERT_EQ(stats.backoff_pauses, 0);
+  ASSERT_EQ(stats.backoff_yields, 0);
+  ASSERT_EQ(stats.insert_mwcas_failures, 0);
+  ASSERT_EQ(stats.update_mwcas_failures, 0);
+  ASSERT_EQ(stats.delete_mwcas_failures, 0);
+  // Leaf hints are off, but increasing keys are appended to the right-most leaf
+  ASSERT_EQ(stats.leaf_hint_hits + stats.leaf_hint_misses, 0);
+  ASSERT_GE(stats.append_hint_hits + stats.append_hint_misses, kKeys);
+  ASSERT_GT(stats.append_hint_hits, kKeys / 2);
+  // Small nodes: leaves and internal nodes split, and so does the root
+  ASSERT_GT(stats.splits[0], 0);
+  ASSERT_GT(stats.splits[1], 0);
+  ASSERT_GT(stats.root_changes, 1);
+  ASSERT_LE(stats.root_changes, stats.splits[0]);
+  ASSERT_GE(stats.descriptors, 2 * stats.inserts);
+  ASSERT_EQ(other->GetStats().inserts, 1);
+#else
+  ASSERT_EQ(stats.inserts, 0);
+  ASSERT_EQ(stats.descriptors, 0);
+#endif
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();